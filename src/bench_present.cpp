@@ -0,0 +1,199 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Present path over synthetic backend responses, without network: a
+// SPARQL XML (SELECT) and an RDF/XML (CONSTRUCT) document of each size is
+// parsed, its solutions counted, and records extracted with get_result
+// and serialized as fetch does, sequentially from the start, at positions
+// spread over the document and at random positions. Time per record is
+// reported against position, so that costs growing with the position
+// show. One key=value line per measurement, versioned by its first field.
+// Usage: bench_present [max-solutions [page-size]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <algorithm>
+#include <sys/resource.h>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include "sparql_result.hpp"
+#include "metrics.hpp"
+
+#define BENCH_FORMAT 1
+
+namespace mp = metaproxy_1;
+
+static void sparql_xml(std::string &doc, long n)
+{
+    char buf[400];
+    long i;
+
+    doc = "<?xml version=\"1.0\"?>\n"
+        "<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n"
+        " <head><variable name=\"thing\"/><variable name=\"title\"/>"
+        "<variable name=\"date\"/></head>\n"
+        " <results distinct=\"false\" ordered=\"true\">\n";
+    for (i = 0; i < n; i++)
+    {
+        sprintf(buf, "  <result>"
+                "<binding name=\"thing\">"
+                "<uri>http://example.org/thing/%ld</uri></binding>"
+                "<binding name=\"title\"><literal>Title %ld</literal>"
+                "</binding>"
+                "<binding name=\"date\"><literal>%ld</literal></binding>"
+                "</result>\n", i, i, 1800 + i % 200);
+        doc += buf;
+    }
+    doc += " </results>\n</sparql>\n";
+}
+
+static void rdf_xml(std::string &doc, long n)
+{
+    char buf[400];
+    long i;
+
+    doc = "<?xml version=\"1.0\"?>\n"
+        "<rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\""
+        " xmlns:bf=\"http://bibframe.org/vocab/\">\n";
+    for (i = 0; i < n; i++)
+    {
+        sprintf(buf, " <rdf:Description"
+                " rdf:about=\"http://example.org/thing/%ld\">"
+                "<bf:title>Title %ld</bf:title>"
+                "<bf:creator rdf:resource=\"http://example.org/agent/%ld\"/>"
+                "</rdf:Description>\n", i, i, i % 1000);
+        doc += buf;
+    }
+    doc += "</rdf:RDF>\n";
+}
+
+static long peak_rss_kb()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_maxrss;
+}
+
+// records from pos on, as fetch makes them; returns microseconds
+static long long present(xmlDoc *doc, xmlBufferPtr buf, long pos, int number,
+                         size_t *bytes)
+{
+    long long t0 = mp::filter::monotonic_usec();
+    int i;
+
+    for (i = 0; i < number; i++)
+    {
+        xmlDoc *ndoc = 0;
+        bool found = mp::filter::get_result(doc, 0, pos + i, &ndoc);
+        xmlNode *root = ndoc ? xmlDocGetRootElement(ndoc) : 0;
+        if (found && root)
+        {
+            xmlBufferEmpty(buf);
+            xmlNodeDump(buf, ndoc, root, 0, 0);
+            *bytes += buf->use;
+        }
+        if (ndoc)
+            xmlFreeDoc(ndoc);
+        if (!found)
+            break;
+    }
+    return mp::filter::monotonic_usec() - t0;
+}
+
+static void bench(const char *name, const std::string &text, long n,
+                  int page)
+{
+    xmlBufferPtr buf = xmlBufferCreate();
+    size_t bytes = 0;
+    long long t0 = mp::filter::monotonic_usec();
+    xmlDoc *doc = xmlParseMemory(text.c_str(), text.length());
+    long long parse = mp::filter::monotonic_usec() - t0;
+    Odr_int hits = 0;
+    long i;
+
+    t0 = mp::filter::monotonic_usec();
+    mp::filter::get_result(doc, &hits, -1, 0);
+    long long count = mp::filter::monotonic_usec() - t0;
+    printf("bench_present format=%d doc=%s solutions=%ld bytes=%lu "
+           "parse_ms=%.2f count_ms=%.3f hits=%ld peak_rss_kb=%ld\n",
+           BENCH_FORMAT, name, n, (unsigned long) text.length(),
+           parse / 1e3, count / 1e3, (long) hits, peak_rss_kb());
+
+    // paging from the start, as a client reading a result list does
+    long pages = std::min(100L, n / page);
+    long long t = 0;
+    for (i = 0; i < pages; i++)
+        t += present(doc, buf, i * page, page, &bytes);
+    printf("bench_present format=%d doc=%s solutions=%ld "
+           "access=sequential records=%ld us_per_record=%.2f\n",
+           BENCH_FORMAT, name, n, pages * page,
+           pages ? (double) t / (pages * page) : 0.0);
+
+    // a page at each tenth of the document
+    for (i = 0; i < 10; i++)
+    {
+        long pos = n * i / 10;
+        t = present(doc, buf, pos, page, &bytes);
+        printf("bench_present format=%d doc=%s solutions=%ld "
+               "access=position position=%ld us_per_record=%.2f\n",
+               BENCH_FORMAT, name, n, pos, (double) t / page);
+    }
+
+    // single records at random positions
+    srand(1);
+    int randoms = 100;
+    t = 0;
+    for (i = 0; i < randoms; i++)
+        t += present(doc, buf, rand() % n, 1, &bytes);
+    printf("bench_present format=%d doc=%s solutions=%ld "
+           "access=random records=%d us_per_record=%.2f "
+           "serialized_bytes=%lu peak_rss_kb=%ld\n",
+           BENCH_FORMAT, name, n, randoms, (double) t / randoms,
+           (unsigned long) bytes, peak_rss_kb());
+
+    xmlFreeDoc(doc);
+    xmlBufferFree(buf);
+}
+
+int main(int argc, char **argv)
+{
+    long max = argc > 1 ? atol(argv[1]) : 1000000;
+    int page = argc > 2 ? atoi(argv[2]) : 10;
+    long n;
+
+    xmlInitParser();
+    for (n = 1000; n <= max; n *= 10)
+    {
+        std::string text;
+        sparql_xml(text, n);
+        bench("sparql-xml", text, n, page);
+        rdf_xml(text, n);
+        bench("rdf-xml", text, n, page);
+    }
+    xmlCleanupParser();
+    return 0;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,132 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Contention of session lookup: each thread acquires and releases its own
+// sessions, as frontend_net threads do for packages of unrelated sessions.
+// Usage: bench_sessions [rounds [max-threads]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <vector>
+#include <boost/thread/thread.hpp>
+#include <boost/bind/bind.hpp>
+#include <yaz/timing.h>
+#include "session_table.hpp"
+
+namespace mp = metaproxy_1;
+
+class Dummy {
+public:
+    Dummy(const void *) : m_in_use(true) {}
+    bool m_in_use;
+};
+
+// the table before sharding: one mutex and condition for all sessions
+class GlobalTable {
+public:
+    typedef boost::shared_ptr<Dummy> Ptr;
+    Ptr acquire(const mp::Session &key, const void *arg, bool exclusive) {
+        boost::mutex::scoped_lock lock(m_mutex);
+        while (true)
+        {
+            std::map<mp::Session,Ptr>::iterator it = m_clients.find(key);
+            if (it == m_clients.end())
+                break;
+            if (!it->second->m_in_use)
+            {
+                it->second->m_in_use = true;
+                return it->second;
+            }
+            m_cond.wait(lock);
+        }
+        Ptr p(new Dummy(arg));
+        m_clients[key] = p;
+        return p;
+    }
+    void release(const mp::Session &key, const Ptr &p, bool exclusive,
+                 bool closed) {
+        boost::mutex::scoped_lock lock(m_mutex);
+        std::map<mp::Session,Ptr>::iterator it = m_clients.find(key);
+        if (it != m_clients.end())
+        {
+            it->second->m_in_use = false;
+            if (closed)
+                m_clients.erase(it);
+            m_cond.notify_all();
+        }
+    }
+private:
+    boost::mutex m_mutex;
+    boost::condition m_cond;
+    std::map<mp::Session,Ptr> m_clients;
+};
+
+template <class Table>
+static void worker(Table *table, int rounds)
+{
+    std::vector<mp::Session> sessions(8);
+    int i;
+    for (i = 0; i < rounds; i++)
+    {
+        const mp::Session &key = sessions[i % sessions.size()];
+        typename Table::Ptr p = table->acquire(key, table, true);
+        table->release(key, p, true, false);
+    }
+}
+
+template <class Table>
+static double run(int threads, int rounds)
+{
+    Table table;
+    boost::thread_group group;
+    yaz_timing_t timing = yaz_timing_create();
+    int i;
+
+    for (i = 0; i < threads; i++)
+        group.create_thread(boost::bind(worker<Table>, &table, rounds));
+    group.join_all();
+    yaz_timing_stop(timing);
+    double t = yaz_timing_get_real(timing);
+    yaz_timing_destroy(&timing);
+    return threads * (double) rounds / t;
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 200000;
+    int max_threads = argc > 2 ? atoi(argv[2]) : 32;
+    int threads;
+
+    printf("%8s %14s %14s\n", "threads", "global ops/s", "sharded ops/s");
+    for (threads = 1; threads <= max_threads; threads *= 2)
+    {
+        double g = run<GlobalTable>(threads, rounds);
+        double s = run<mp::filter::SessionTable<Dummy> >(threads, rounds);
+        printf("%8d %14.0f %14.0f\n", threads, g, s);
+    }
+    return 0;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
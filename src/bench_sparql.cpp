@@ -0,0 +1,400 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Speed of query translation with the db sections of a filter config.
+// For each searchable db, PQF workloads are made from its indexes and
+// translated with yaz_sparql_from_rpn_wrbuf; URI lookups are translated
+// with yaz_sparql_from_uri_wrbuf for each present type. One line per
+// workload, as key=value pairs; the format is versioned by its first
+// field so that results can be compared across releases.
+// Usage: bench_sparql [config [rounds]]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <yaz/pquery.h>
+#include <yaz/timing.h>
+#include "sparql.h"
+
+#define BENCH_FORMAT 1
+
+#if defined(__GLIBC__)
+// counts allocations by interposing the allocator of the C library
+extern "C" {
+    extern void *__libc_malloc(size_t size);
+    extern void *__libc_calloc(size_t n, size_t size);
+    extern void *__libc_realloc(void *p, size_t size);
+    static unsigned long long allocations;
+
+    void *malloc(size_t size)
+    {
+        allocations++;
+        return __libc_malloc(size);
+    }
+    void *calloc(size_t n, size_t size)
+    {
+        allocations++;
+        return __libc_calloc(n, size);
+    }
+    void *realloc(void *p, size_t size)
+    {
+        allocations++;
+        return __libc_realloc(p, size);
+    }
+}
+#define ALLOCATIONS allocations
+#else
+#define ALLOCATIONS 0ULL
+#endif
+
+class Db {
+public:
+    std::string path;
+    bool searchable;
+    std::vector<std::string> indexes;
+    std::vector<std::string> presents;
+    yaz_sparql_t s;
+};
+
+static const char *get_prop(xmlNode *n, const char *name)
+{
+    xmlAttr *attr;
+    for (attr = n->properties; attr; attr = attr->next)
+        if (!strcmp((const char *) attr->name, name) && attr->children)
+            return (const char *) attr->children->content;
+    return 0;
+}
+
+static void add_names(std::vector<std::string> &to,
+                      const std::vector<std::string> &from)
+{
+    size_t i;
+    for (i = 0; i < from.size(); i++)
+        if (std::find(to.begin(), to.end(), from[i]) == to.end())
+            to.push_back(from[i]);
+}
+
+// the subset of SPARQL::configure that makes the patterns of a db
+static bool load_db(xmlNode *ptr, std::vector<Db> &dbs)
+{
+    Db db;
+    const char *v;
+
+    db.s = yaz_sparql_create();
+    db.path = (v = get_prop(ptr, "path")) ? v : "";
+    db.searchable = get_prop(ptr, "schema") != 0;
+    if ((v = get_prop(ptr, "include")))
+    {
+        std::string list = v;
+        size_t pos = 0;
+        while (pos < list.length())
+        {
+            size_t end = list.find_first_of(" \t", pos);
+            if (end == std::string::npos)
+                end = list.length();
+            std::string name = list.substr(pos, end - pos);
+            size_t i;
+            for (i = 0; name.length() && i < dbs.size(); i++)
+                if (dbs[i].path == name)
+                {
+                    yaz_sparql_include(db.s, dbs[i].s);
+                    add_names(db.indexes, dbs[i].indexes);
+                    add_names(db.presents, dbs[i].presents);
+                    break;
+                }
+            pos = end + 1;
+        }
+    }
+    xmlNode *p;
+    for (p = ptr->children; p; p = p->next)
+    {
+        if (p->type != XML_ELEMENT_NODE)
+            continue;
+        std::string name = (const char *) p->name;
+        const char *type = get_prop(p, "type");
+        if (type)
+            name = name + "." + type;
+        if (!strcmp((const char *) p->name, "index"))
+        {
+            std::string base = name;
+            if ((v = get_prop(p, "relation")))
+                name = name + ";2=" + v;
+            if ((v = get_prop(p, "truncation")))
+                name = name + ";5=" + v;
+            if ((v = get_prop(p, "selectivity")))
+                yaz_sparql_add_pattern(
+                    db.s, ("selectivity" + base.substr(5)).c_str(), v);
+            if ((v = get_prop(p, "cost")))
+                yaz_sparql_add_pattern(
+                    db.s, ("cost" + base.substr(5)).c_str(), v);
+            if (type && name == base)
+                add_names(db.indexes, std::vector<std::string>(1, type));
+        }
+        else if (!strcmp((const char *) p->name, "present") && type)
+            add_names(db.presents, std::vector<std::string>(1, type));
+        xmlChar *content = xmlNodeGetContent(p);
+        int r = yaz_sparql_add_pattern(db.s, name.c_str(),
+                                       (const char *) content);
+        xmlFree(content);
+        if (r)
+        {
+            fprintf(stderr, "bench_sparql: bad pattern %s in db %s\n",
+                    name.c_str(), db.path.c_str());
+            return false;
+        }
+    }
+    dbs.push_back(db);
+    return true;
+}
+
+static bool load_dbs(xmlNode *ptr, std::vector<Db> &dbs)
+{
+    for (; ptr; ptr = ptr->next)
+    {
+        if (ptr->type != XML_ELEMENT_NODE)
+            continue;
+        if (!strcmp((const char *) ptr->name, "db"))
+        {
+            if (!load_db(ptr, dbs))
+                return false;
+        }
+        else if (!load_dbs(ptr->children, dbs))
+            return false;
+    }
+    return true;
+}
+
+static const char *words[] = {
+    "dickens", "london", "history", "music", "water", "1984", "science",
+    "poetry", "maps", "war", "peace", "garden", "ocean", "bridge", 0
+};
+
+// operand n of a workload: index and term vary with n
+static void operand(std::string &q, const Db &db, int n)
+{
+    int nwords = 0;
+    while (words[nwords])
+        nwords++;
+    q += "@attr 1=" + db.indexes[n % db.indexes.size()] + " " +
+        words[(n * 7 + n / nwords) % nwords] + " ";
+}
+
+// complete tree of depth levels with AND and OR by turns
+static void tree(std::string &q, const Db &db, int depth, int *n)
+{
+    if (depth == 0)
+    {
+        operand(q, db, (*n)++);
+        return;
+    }
+    q += depth % 2 ? "@and " : "@or ";
+    tree(q, db, depth - 1, n);
+    tree(q, db, depth - 1, n);
+}
+
+class Workload {
+public:
+    std::string name;
+    int operands;
+    std::vector<std::string> pqf; // distinct queries, used in turn
+};
+
+static void make_workloads(const Db &db, std::vector<Workload> &wl)
+{
+    int i, j, k;
+    Workload w;
+
+    w.name = "single";
+    w.operands = 1;
+    for (i = 0; i < 16; i++)
+    {
+        std::string q;
+        operand(q, db, i);
+        w.pqf.push_back(q);
+    }
+    wl.push_back(w);
+
+    static const int depths[] = { 3, 6 };
+    for (k = 0; k < 2; k++)
+    {
+        char name[20];
+        sprintf(name, "tree%d", depths[k]);
+        w.name = name;
+        w.operands = 1 << depths[k];
+        w.pqf.clear();
+        for (i = 0; i < 16; i++)
+        {
+            std::string q;
+            int n = i;
+            tree(q, db, depths[k], &n);
+            w.pqf.push_back(q);
+        }
+        wl.push_back(w);
+    }
+
+    // every index of the db once, ANDed
+    w.name = "many";
+    w.operands = (int) db.indexes.size();
+    w.pqf.clear();
+    for (i = 0; i < 16; i++)
+    {
+        std::string q;
+        for (j = 1; j < w.operands; j++)
+            q += "@and ";
+        for (j = 0; j < w.operands; j++)
+        {
+            int nwords = sizeof(words) / sizeof(*words) - 1;
+            q += "@attr 1=" + db.indexes[j] + " " +
+                words[(i + j) % nwords] + " ";
+        }
+        w.pqf.push_back(q);
+    }
+    wl.push_back(w);
+}
+
+static void report(const Db &db, const char *workload, int operands,
+                   long queries, double t, unsigned long long allocs,
+                   long errors)
+{
+    printf("bench_sparql format=%d db=%s workload=%s operands=%d "
+           "queries=%ld qps=%.0f ns_per_operand=%.1f "
+           "allocs_per_query=%.1f errors=%ld\n",
+           BENCH_FORMAT, db.path.c_str(), workload, operands, queries,
+           queries / t, t * 1e9 / ((double) queries * operands),
+           (double) allocs / queries, errors);
+}
+
+static void bench_rpn(const Db &db, const Workload &w, int rounds)
+{
+    YAZ_PQF_Parser parser = yaz_pqf_create();
+    ODR odr = odr_createmem(ODR_ENCODE);
+    std::vector<Z_RPNQuery *> rpn;
+    WRBUF addinfo = wrbuf_alloc();
+    WRBUF out = wrbuf_alloc();
+    size_t i;
+    long n, errors = 0;
+
+    for (i = 0; i < w.pqf.size(); i++)
+    {
+        Z_RPNQuery *q = yaz_pqf_parse(parser, odr, w.pqf[i].c_str());
+        if (q)
+            rpn.push_back(q);
+    }
+    if (rpn.size())
+    {
+        // warm up, so that buffers have grown
+        for (i = 0; i < rpn.size(); i++)
+            yaz_sparql_from_rpn_wrbuf(db.s, addinfo, out, rpn[i]);
+
+        yaz_timing_t timing = yaz_timing_create();
+        unsigned long long allocs = ALLOCATIONS;
+        for (n = 0; n < rounds; n++)
+        {
+            wrbuf_rewind(addinfo);
+            wrbuf_rewind(out);
+            if (yaz_sparql_from_rpn_wrbuf(db.s, addinfo, out,
+                                          rpn[n % rpn.size()]))
+                errors++;
+        }
+        allocs = ALLOCATIONS - allocs;
+        yaz_timing_stop(timing);
+        report(db, w.name.c_str(), w.operands, rounds,
+               yaz_timing_get_real(timing), allocs, errors);
+        yaz_timing_destroy(&timing);
+    }
+    wrbuf_destroy(out);
+    wrbuf_destroy(addinfo);
+    odr_destroy(odr);
+    yaz_pqf_destroy(parser);
+}
+
+static void bench_uri(const Db &db, const std::string &schema, int rounds)
+{
+    WRBUF addinfo = wrbuf_alloc();
+    WRBUF out = wrbuf_alloc();
+    long n, errors = 0;
+    char uri[64];
+
+    yaz_timing_t timing = yaz_timing_create();
+    unsigned long long allocs = ALLOCATIONS;
+    for (n = 0; n < rounds; n++)
+    {
+        sprintf(uri, "http://example.org/resource/%ld", n % 1000);
+        wrbuf_rewind(addinfo);
+        wrbuf_rewind(out);
+        if (yaz_sparql_from_uri_wrbuf(db.s, addinfo, out, uri,
+                                      schema.c_str()))
+            errors++;
+    }
+    allocs = ALLOCATIONS - allocs;
+    yaz_timing_stop(timing);
+    std::string name = "uri:" + schema;
+    report(db, name.c_str(), 1, rounds, yaz_timing_get_real(timing),
+           allocs, errors);
+    yaz_timing_destroy(&timing);
+    wrbuf_destroy(out);
+    wrbuf_destroy(addinfo);
+}
+
+int main(int argc, char **argv)
+{
+    const char *config = argc > 1 ? argv[1] : "../bibframe/triplestore.xml";
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+    std::vector<Db> dbs;
+    size_t i, j;
+
+    xmlDocPtr doc = xmlParseFile(config);
+    if (!doc)
+    {
+        fprintf(stderr, "bench_sparql: cannot parse %s\n", config);
+        return 1;
+    }
+    if (!load_dbs(xmlDocGetRootElement(doc), dbs))
+        return 1;
+    xmlFreeDoc(doc);
+
+    for (i = 0; i < dbs.size(); i++)
+    {
+        const Db &db = dbs[i];
+        if (!db.searchable || db.indexes.empty())
+            continue;
+        std::vector<Workload> wl;
+        make_workloads(db, wl);
+        for (j = 0; j < wl.size(); j++)
+            bench_rpn(db, wl[j], rounds);
+        for (j = 0; j < db.presents.size(); j++)
+            bench_uri(db, db.presents[j], rounds);
+    }
+    // included dbs are referenced by the dbs that include them
+    for (i = dbs.size(); i > 0; i--)
+        yaz_sparql_destroy(dbs[i - 1].s);
+    return 0;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -18,16 +18,32 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 
 #include <metaproxy/package.hpp>
 #include <metaproxy/util.hpp>
+#include <limits.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <deque>
 #include <yaz/log.h>
 #include <yaz/srw.h>
 #include <yaz/diagbib1.h>
 #include <yaz/match_glob.h>
 #include <yaz/querytowrbuf.h>
+#include <yaz/copy_types.h>
 #include <boost/scoped_ptr.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/shared_mutex.hpp>
+#include <boost/thread/thread.hpp>
 #include <boost/thread/condition.hpp>
+#include <boost/thread/tss.hpp>
+#include <boost/bind/bind.hpp>
 #include <boost/algorithm/string.hpp>
 #include "sparql.h"
+#include "session_table.hpp"
+#include "metrics.hpp"
+#include "log_writer.hpp"
+#include "sparql_result.hpp"
+#include "filter_sparql.hpp"
 
 #include <yaz/zgdu.h>
 
@@ -42,11 +58,18 @@ namespace metaproxy_1 {
             class Conf;
             class Result;
             class FrontendSet;
+            class Lookup;
+            class LookupBatch;
+            class Metrics;
+            class Trace;
+            class Dbs;
 
             typedef boost::shared_ptr<Session> SessionPtr;
             typedef boost::shared_ptr<Conf> ConfPtr;
+            typedef boost::shared_ptr<const Dbs> DbsPtr;
 
             typedef boost::shared_ptr<FrontendSet> FrontendSetPtr;
+            typedef boost::shared_ptr<Lookup> LookupPtr;
             typedef std::map<std::string,FrontendSetPtr> FrontendSets;
         public:
             SPARQL();
@@ -54,10 +77,109 @@ namespace metaproxy_1 {
             void process(metaproxy_1::Package & package) const;
             void configure(const xmlNode * ptr, bool test_only,
                            const char *path);
-            SessionPtr get_session(Package &package, Z_APDU **apdu) const;
-            void release_session(Package &package) const;
+            SessionPtr get_session(Package &package, Z_APDU **apdu,
+                                   bool *exclusive) const;
+            void reaper();
+            void reap(time_t now);
+            void release_session(Package &package, SessionPtr p,
+                                 bool exclusive) const;
+            bool metrics(Package &package) const;
+            static ConfPtr parse_db(const xmlNode *ptr, const std::string &uri,
+                                    const std::list<ConfPtr> &confs);
+            void reloader();
+            bool reload();
+            void lookup_worker();
+            // current generation of the db sections
+            DbsPtr get_dbs() const;
             boost::scoped_ptr<Rep> m_p;
-            std::list<ConfPtr> db_conf;
+            int m_concurrency; // backend requests in flight per package
+            std::string m_metrics_path; // HTTP GET path; empty for none
+            int m_query_log_level; // of each generated query
+        };
+        // Stage timings of one request, logged as one line. The trace id
+        // goes to the backend in a W3C traceparent header
+        class SPARQL::Trace {
+        public:
+            enum Stage {
+                TRANSLATE, BACKEND, PARSE, RESULT, LOOKUPS, RECORDS, STAGES
+            };
+            enum Field {
+                F_TIME = 1, F_TRACE = 2, F_OP = 4, F_DB = 8, F_STATUS = 16,
+                F_HITS = 32, F_RECORDS = 64, F_BYTES = 128, F_USEC = 256,
+                F_STAGES = 512, F_RPN = 1024
+            };
+            // capture keeps the queries for the slow-query log; record
+            // bodies are kept up to body_max bytes each
+            Trace(const char *op, bool capture, size_t body_max);
+            void add(Stage stage, long long usec);
+            // header value with a new span id for a backend request
+            std::string traceparent();
+            void log(Package &package);
+            void set_query(const std::string &db, Z_RPNQuery *rpn);
+            void set_hits(Odr_int hits);
+            // resp is 0 for no response
+            void backend(const std::string &db, const char *sparql,
+                         Z_HTTP_Response *resp, long long usec);
+            void add_body(const char *buf, size_t len);
+            // status and number of records of the response
+            void set_response(Z_APDU *apdu);
+            long long elapsed() const;
+            // entry for the slow-query log
+            void slow_entry(std::string &entry);
+            // JSON line with fields, a mask of Field
+            void access_entry(std::string &entry, int fields);
+            // keeps the request and the backend responses for the
+            // capture file
+            void set_traffic(unsigned long session, Z_APDU *apdu);
+            // entry for the capture file; false if there is none
+            bool traffic_entry(std::string &entry);
+            static unsigned long long random64();
+        private:
+            class Query {
+            public:
+                std::string db;
+                std::string sparql;
+                int status;
+                size_t bytes;
+                long long usec;
+                std::string content; // of the response, when captured
+            };
+            enum { MAX_QUERIES = 8 };
+            void render(WRBUF w);
+            const char *m_op;
+            char m_id[33];
+            long long m_start;
+            bool m_capture;
+            boost::mutex m_mutex; // guards the stages and backend queries
+            long long m_usec[STAGES];
+            int m_count[STAGES];
+            std::string m_db;
+            mp::wrbuf m_rpn;
+            Odr_int m_hits; // -1 if not known
+            std::vector<Query> m_queries;
+            int m_queries_omitted;
+            unsigned long long m_bytes; // received from backend
+            int m_status; // diagnostic of response; 0 for none
+            int m_records;
+            size_t m_body_max;
+            std::vector<std::string> m_bodies;
+            bool m_traffic;
+            unsigned long m_session;
+            std::string m_apdu; // BER of the request
+            std::vector<Query> m_exchanges; // all of them, in order
+        };
+        class SPARQL::Metrics {
+        public:
+            MetricCounter searches;
+            MetricCounter presents;
+            MetricCounter lookups;
+            MetricCounter hits;
+            MetricCounter backend_errors;
+            MetricCounter bytes; // received from backend
+            LatencyHistogram translate;
+            LatencyHistogram backend;
+            LatencyHistogram parse;
+            LatencyHistogram records;
         };
         class SPARQL::Conf {
         public:
@@ -65,13 +187,58 @@ namespace metaproxy_1 {
             std::string uri;
             std::string schema;
             yaz_sparql_t s;
+            std::list<ConfPtr> includes; // referenced by s
+            // shared with the db of the same path in later generations
+            boost::shared_ptr<Metrics> metrics;
+            bool learn;
+            // shared by translations, which read what observe writes
+            boost::shared_mutex learn_mutex;
+            Conf();
             ~Conf();
         };
+        // A generation of the db sections; never changed once in use.
+        // A reload replaces it as a whole, while requests that run and
+        // result sets keep the Confs they have
+        class SPARQL::Dbs {
+        public:
+            std::list<ConfPtr> confs;
+            int generation; // from 1
+        };
         class SPARQL::Rep {
             friend class SPARQL;
-            boost::condition m_cond_session_ready;
-            boost::mutex m_mutex;
-            std::map<mp::Session,SessionPtr> m_clients;
+            Rep();
+            SessionTable<Session> m_sessions;
+            int m_session_ttl; // seconds idle before removal; 0 for never
+            int m_set_ttl;
+            boost::scoped_ptr<boost::thread> m_reaper;
+            boost::mutex m_reaper_mutex;
+            boost::condition m_reaper_cond;
+            bool m_reaper_stop;
+            Odr_int m_reaped_sessions; // since start
+            Odr_int m_reaped_sets;
+            Odr_int m_reaped_bytes;
+            boost::scoped_ptr<LogWriter> m_slow_log;
+            long long m_slow_usec; // requests that take longer are logged
+            double m_slow_sample; // fraction of those that are logged
+            boost::scoped_ptr<LogWriter> m_access_log;
+            int m_access_fields; // Trace::Field mask
+            size_t m_access_body; // bytes of each record logged
+            boost::scoped_ptr<LogWriter> m_capture;
+            boost::mutex m_dbs_mutex; // for m_dbs
+            DbsPtr m_dbs;
+            std::string m_reload_src; // file watched; empty for none
+            std::string m_reload_id; // id of this filter; empty for none
+            int m_reload_interval; // seconds between checks
+            time_t m_reload_mtime;
+            off_t m_reload_size;
+            boost::scoped_ptr<boost::thread> m_reloader;
+            LatencyHistogram m_reload_latency;
+            MetricCounter m_reload_failures;
+            boost::thread_group m_lookup_workers; // concurrency - 1
+            boost::mutex m_lookup_mutex; // for the queue and its batches
+            boost::condition m_lookup_cond;
+            std::deque<LookupBatch *> m_lookup_queue; // a lane each
+            bool m_lookup_stop;
         };
         class SPARQL::Result {
         public:
@@ -82,26 +249,71 @@ namespace metaproxy_1 {
             friend class Session;
             ConfPtr conf;
             xmlDoc *doc;
+            size_t size; // of the backend response
         };
         class SPARQL::FrontendSet {
+        public:
+            FrontendSet();
+            ~FrontendSet();
         private:
             friend class Session;
             Odr_int hits;
             std::string db;
             std::list<Result> results;
             std::vector<ConfPtr> explaindblist;
+            NMEM nmem;
+            Z_RPNQuery *query; // search of the set; for sort
+            // exclusive while the set is made; shared while presented
+            boost::shared_mutex m_mutex;
+            time_t m_last_use; // guarded by Session::m_sets_mutex
+            size_t size() const;
+        };
+        class SPARQL::Lookup {
+        public:
+            std::string uri;
+            mp::wrbuf query;
+            mp::wrbuf addinfo;
+            mp::wrbuf w; // record
+            int error;
+            // made and read by the thread of the present; moved by a lane
+            mp::odr odr; // of the request; outlives package
+            boost::scoped_ptr<Package> package;
+            long long usec;
+        };
+        // URI lookups of a present. Lane k moves the packages of lookups
+        // k, k + lanes, ... in turn, on one thread
+        class SPARQL::LookupBatch {
+        public:
+            void run(size_t lane);
+            std::vector<LookupPtr> *lookups;
+            size_t lanes;
+            size_t next; // lane to run next
+            size_t done; // lanes run
+            boost::condition done_cond;
         };
         class SPARQL::Session {
         public:
             Session(const SPARQL *);
             ~Session();
-            void handle_z(Package &package, Z_APDU *apdu);
+            void handle_z(Package &package, Z_APDU *apdu, Trace &trace);
             Z_APDU *search(mp::Package &package,
                            Z_APDU *apdu_req,
                            mp::odr &odr,
                            const char *sparql_query,
                            ConfPtr conf,
-                           FrontendSetPtr fset);
+                           FrontendSetPtr fset,
+                           bool downgraded,
+                           Trace &trace);
+            Z_APDU *sort(mp::Package &package,
+                         Z_APDU *apdu_req,
+                         mp::odr &odr,
+                         Trace &trace);
+            Z_APDU *sort_set(mp::Package &package,
+                             Z_APDU *apdu_req,
+                             mp::odr &odr,
+                             FrontendSetPtr fset,
+                             FrontendSetPtr nset,
+                             Trace &trace);
             Z_APDU *explain_search(mp::Package &package,
                            Z_APDU *apdu_req,
                            mp::odr &odr,
@@ -110,14 +322,24 @@ namespace metaproxy_1 {
             int invoke_sparql(mp::Package &package,
                               const char *sparql_query,
                               ConfPtr conf,
-                              WRBUF w);
+                              WRBUF w,
+                              Trace &trace);
+            void backend_request(Package &http_package, ODR odr,
+                                 const char *sparql_query, ConfPtr conf,
+                                 Trace &trace);
+            int backend_response(Package &package, Package &http_package,
+                                 const char *sparql_query, ConfPtr conf,
+                                 WRBUF w, Trace &trace, long long usec);
+            void invoke_lookups(mp::Package &package,
+                                std::vector<LookupPtr> &lookups,
+                                ConfPtr conf, Trace &trace);
             Z_Records *fetch(
                 Package &package,
                 FrontendSetPtr fset,
                 ODR odr, Odr_oid *preferredRecordSyntax,
                 Z_ElementSetNames *esn,
                 int start, int number, int &error_code, std::string &addinfo,
-                int *number_returned, int *next_position);
+                int *number_returned, int *next_position, Trace &trace);
             Z_Records *explain_fetch(
                 Package &package,
                 FrontendSetPtr fset,
@@ -125,9 +347,16 @@ namespace metaproxy_1 {
                 Z_ElementSetNames *esn,
                 int start, int number, int &error_code, std::string &addinfo,
                 int *number_returned, int *next_position);
-            bool m_in_use;
         private:
+            FrontendSetPtr get_set(const std::string &name);
+        public:
+            size_t reap_sets(time_t before, int *nsets);
+        private:
+            FrontendSetPtr replace_set(const std::string &name,
+                                       FrontendSetPtr old,
+                                       FrontendSetPtr fset);
             bool m_support_named_result_sets;
+            boost::mutex m_sets_mutex; // for m_frontend_sets
             FrontendSets m_frontend_sets;
             const SPARQL *m_sparql;
         };
@@ -143,14 +372,602 @@ yf::SPARQL::Result::~Result()
 yf::SPARQL::Result::Result()
 {
     doc = 0;
+    size = 0;
+}
+
+yf::SPARQL::FrontendSet::FrontendSet() : hits(0), query(0),
+                                         m_last_use(time(0))
+{
+    nmem = nmem_create();
+}
+
+size_t yf::SPARQL::FrontendSet::size() const
+{
+    size_t sz = nmem_total(nmem);
+    std::list<Result>::const_iterator it = results.begin();
+    for (; it != results.end(); it++)
+        sz += it->size;
+    return sz;
+}
+
+yf::SPARQL::FrontendSet::~FrontendSet()
+{
+    nmem_destroy(nmem);
+}
+
+yf::SPARQL::Rep::Rep() : m_session_ttl(0), m_set_ttl(0),
+                         m_reaper_stop(false), m_reaped_sessions(0),
+                         m_reaped_sets(0), m_reaped_bytes(0),
+                         m_slow_usec(0), m_slow_sample(1.0),
+                         m_access_fields(0), m_access_body(0),
+                         m_reload_interval(5), m_reload_mtime(0),
+                         m_reload_size(0), m_lookup_stop(false)
+{
+}
+
+yf::SPARQL::SPARQL() : m_p(new Rep), m_concurrency(1),
+                       m_query_log_level(YLOG_LOG)
+{
+}
+
+yf::SPARQL::Trace::Trace(const char *op, bool capture, size_t body_max) :
+    m_op(op), m_start(monotonic_usec()), m_capture(capture), m_hits(-1),
+    m_queries_omitted(0), m_bytes(0), m_status(0), m_records(0),
+    m_body_max(body_max), m_traffic(false), m_session(0)
+{
+    int i;
+    for (i = 0; i < STAGES; i++)
+    {
+        m_usec[i] = 0;
+        m_count[i] = 0;
+    }
+    sprintf(m_id, "%016llx%016llx", random64(), random64());
+}
+
+// splitmix64 over a shared counter; ids need to be unique, not secret
+unsigned long long yf::SPARQL::Trace::random64()
+{
+    static boost::atomic<unsigned long long> state(
+        (unsigned long long) time(0) << 32 ^ getpid());
+    unsigned long long z = state.fetch_add(0x9e3779b97f4a7c15ULL,
+                                           boost::memory_order_relaxed);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+void yf::SPARQL::Trace::add(Stage stage, long long usec)
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_usec[stage] += usec;
+    m_count[stage]++;
+}
+
+std::string yf::SPARQL::Trace::traceparent()
+{
+    char buf[64];
+    sprintf(buf, "00-%s-%016llx-01", m_id, random64());
+    return buf;
+}
+
+long long yf::SPARQL::Trace::elapsed() const
+{
+    return monotonic_usec() - m_start;
+}
+
+static const char *stage_names[] = {
+    "translate", "backend", "parse", "result", "lookups", "records"
+};
+
+// key=value pairs; stages that did not run are left out and _n is the
+// number of times a stage ran, if more than once
+void yf::SPARQL::Trace::render(WRBUF w)
+{
+    int i;
+
+    wrbuf_printf(w, "trace=%s op=%s total_us=%lld", m_id, m_op, elapsed());
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (i = 0; i < STAGES; i++)
+        if (m_count[i])
+        {
+            wrbuf_printf(w, " %s_us=%lld", stage_names[i], m_usec[i]);
+            if (m_count[i] > 1)
+                wrbuf_printf(w, " %s_n=%d", stage_names[i], m_count[i]);
+        }
+}
+
+void yf::SPARQL::Trace::log(Package &package)
+{
+    mp::wrbuf w;
+
+    render(w);
+    package.log("sparql", YLOG_LOG, "%s", w.c_str());
+}
+
+void yf::SPARQL::Trace::set_query(const std::string &db, Z_RPNQuery *rpn)
+{
+    m_db = db;
+    if (m_capture && rpn)
+    {
+        wrbuf_rewind(m_rpn);
+        yaz_rpnquery_to_wrbuf(m_rpn, rpn);
+    }
 }
 
-yf::SPARQL::SPARQL() : m_p(new Rep)
+void yf::SPARQL::Trace::set_hits(Odr_int hits)
 {
+    m_hits = hits;
+}
+
+void yf::SPARQL::Trace::backend(const std::string &db, const char *sparql,
+                                Z_HTTP_Response *resp, long long usec)
+{
+    int status = resp ? resp->code : 0;
+    size_t bytes = resp ? resp->content_len : 0;
+    boost::mutex::scoped_lock lock(m_mutex);
+    m_bytes += bytes;
+    if (m_traffic)
+    {
+        m_exchanges.push_back(Query());
+        Query &q = m_exchanges.back();
+        q.sparql = sparql;
+        q.status = status;
+        q.bytes = bytes;
+        q.usec = usec;
+        if (bytes)
+            q.content.assign(resp->content_buf, bytes);
+    }
+    if (!m_capture)
+        return;
+    if (m_queries.size() >= MAX_QUERIES)
+    {
+        m_queries_omitted++;
+        return;
+    }
+    m_queries.push_back(Query());
+    Query &q = m_queries.back();
+    q.db = db;
+    q.sparql = sparql;
+    q.status = status;
+    q.bytes = bytes;
+    q.usec = usec;
+}
+
+void yf::SPARQL::Trace::add_body(const char *buf, size_t len)
+{
+    if (m_body_max)
+        m_bodies.push_back(std::string(buf, std::min(len, m_body_max)));
+}
+
+static int diag_condition(Z_DefaultDiagFormat *d)
+{
+    return d && d->condition ? (int) *d->condition : 0;
+}
+
+static int diag_condition(Z_DiagRec *r)
+{
+    return r && r->which == Z_DiagRec_defaultFormat ?
+        diag_condition(r->u.defaultFormat) : 0;
+}
+
+static int records_status(Z_Records *r)
+{
+    if (r && r->which == Z_Records_NSD)
+        return diag_condition(r->u.nonSurrogateDiagnostic);
+    if (r && r->which == Z_Records_multipleNSD &&
+        r->u.multipleNonSurDiagnostics->num_diagRecs > 0)
+        return diag_condition(r->u.multipleNonSurDiagnostics->diagRecs[0]);
+    return 0;
+}
+
+void yf::SPARQL::Trace::set_response(Z_APDU *apdu)
+{
+    if (apdu->which == Z_APDU_searchResponse)
+    {
+        Z_SearchResponse *res = apdu->u.searchResponse;
+        m_status = records_status(res->records);
+        m_records = (int) *res->numberOfRecordsReturned;
+        m_hits = *res->resultCount;
+    }
+    else if (apdu->which == Z_APDU_presentResponse)
+    {
+        Z_PresentResponse *res = apdu->u.presentResponse;
+        m_status = records_status(res->records);
+        m_records = (int) *res->numberOfRecordsReturned;
+    }
+    else if (apdu->which == Z_APDU_sortResponse)
+    {
+        Z_SortResponse *res = apdu->u.sortResponse;
+        if (res->num_diagnostics > 0)
+            m_status = diag_condition(res->diagnostics[0]);
+    }
+}
+
+static void json_string(WRBUF w, const char *name, const char *buf,
+                        size_t len)
+{
+    wrbuf_printf(w, ",\"%s\":\"", name);
+    wrbuf_json_write(w, buf, len);
+    wrbuf_puts(w, "\"");
+}
+
+// each member is written with a leading comma, the first one dropped
+void yf::SPARQL::Trace::access_entry(std::string &entry, int fields)
+{
+    mp::wrbuf w;
+    int i;
+
+    if (fields & F_USEC)
+        wrbuf_printf(w, ",\"usec\":%lld", elapsed());
+    if (fields & F_TIME)
+    {
+        char tbuf[32];
+        time_t now = time(0);
+        struct tm tm;
+
+        gmtime_r(&now, &tm);
+        strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+        wrbuf_printf(w, ",\"time\":\"%s\"", tbuf);
+    }
+    if (fields & F_TRACE)
+        wrbuf_printf(w, ",\"trace\":\"%s\"", m_id);
+    if (fields & F_OP)
+        wrbuf_printf(w, ",\"op\":\"%s\"", m_op);
+    if ((fields & F_DB) && m_db.length())
+        json_string(w, "db", m_db.c_str(), m_db.length());
+    if (fields & F_STATUS)
+        wrbuf_printf(w, ",\"status\":%d", m_status);
+    if ((fields & F_HITS) && m_hits >= 0)
+        wrbuf_printf(w, ",\"hits\":" ODR_INT_PRINTF, m_hits);
+    if (fields & F_RECORDS)
+        wrbuf_printf(w, ",\"records\":%d", m_records);
+    boost::mutex::scoped_lock lock(m_mutex);
+    if (fields & F_BYTES)
+        wrbuf_printf(w, ",\"bytes\":%llu", m_bytes);
+    if (fields & F_STAGES)
+    {
+        const char *sep = "";
+        wrbuf_puts(w, ",\"stages\":{");
+        for (i = 0; i < STAGES; i++)
+            if (m_count[i])
+            {
+                wrbuf_printf(w, "%s\"%s\":%lld", sep, stage_names[i],
+                             m_usec[i]);
+                sep = ",";
+            }
+        wrbuf_puts(w, "}");
+    }
+    if ((fields & F_RPN) && m_rpn.len())
+        json_string(w, "rpn", m_rpn.c_str(), m_rpn.len());
+    if (m_bodies.size())
+    {
+        size_t j;
+        wrbuf_puts(w, ",\"body\":[");
+        for (j = 0; j < m_bodies.size(); j++)
+        {
+            if (j)
+                wrbuf_puts(w, ",");
+            wrbuf_puts(w, "\"");
+            wrbuf_json_write(w, m_bodies[j].c_str(), m_bodies[j].length());
+            wrbuf_puts(w, "\"");
+        }
+        wrbuf_puts(w, "]");
+    }
+    entry = "{";
+    if (w.len())
+        entry.append(w.c_str() + 1, w.len() - 1);
+    entry.append("}\n");
+}
+
+// comment lines with the request, then each backend query and its outcome
+void yf::SPARQL::Trace::slow_entry(std::string &entry)
+{
+    mp::wrbuf w;
+    char tbuf[32];
+    time_t now = time(0);
+    struct tm tm;
+    size_t i;
+
+    gmtime_r(&now, &tm);
+    strftime(tbuf, sizeof(tbuf), "%Y-%m-%dT%H:%M:%SZ", &tm);
+    wrbuf_printf(w, "# time=%s ", tbuf);
+    render(w);
+    wrbuf_puts(w, "\n# db=");
+    wrbuf_puts(w, m_db.c_str());
+    if (m_hits >= 0)
+        wrbuf_printf(w, " hits=" ODR_INT_PRINTF, m_hits);
+    wrbuf_puts(w, "\n");
+    if (m_rpn.len())
+        wrbuf_printf(w, "# rpn=%s\n", m_rpn.c_str());
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (i = 0; i < m_queries.size(); i++)
+    {
+        Query &q = m_queries[i];
+        wrbuf_printf(w, "# backend db=%s status=%d bytes=%lu usec=%lld\n",
+                     q.db.c_str(), q.status, (unsigned long) q.bytes,
+                     q.usec);
+        wrbuf_puts(w, q.sparql.c_str());
+        wrbuf_puts(w, "\n;\n");
+    }
+    if (m_queries_omitted)
+        wrbuf_printf(w, "# %d more backend queries\n", m_queries_omitted);
+    wrbuf_puts(w, "\n");
+    entry.assign(w.c_str(), w.len());
+}
+
+// searches, presents and sorts only: an Init may carry credentials
+// in idAuthentication, which must not end up in the capture file
+void yf::SPARQL::Trace::set_traffic(unsigned long session, Z_APDU *apdu)
+{
+    mp::odr odr(ODR_ENCODE);
+    int len = 0;
+
+    if (apdu->which != Z_APDU_searchRequest &&
+        apdu->which != Z_APDU_presentRequest &&
+        apdu->which != Z_APDU_sortRequest)
+        return;
+    if (!z_APDU(odr, &apdu, 0, 0))
+        return;
+    char *buf = odr_getbuf(odr, &len, 0);
+    m_apdu.assign(buf, len);
+    m_session = session;
+    m_traffic = true;
+}
+
+// a request line and its BER, then a backend line, the SPARQL and the
+// content of each backend response; see replay_sparql.cpp
+bool yf::SPARQL::Trace::traffic_entry(std::string &entry)
+{
+    char buf[120];
+    size_t i;
+
+    if (!m_traffic)
+        return false;
+    sprintf(buf, "request %lu %lld %lld " ODR_INT_PRINTF " %d %lu\n",
+            m_session, m_start, elapsed(), m_hits, m_records,
+            (unsigned long) m_apdu.length());
+    entry = buf;
+    entry.append(m_apdu);
+    entry.append("\n");
+    boost::mutex::scoped_lock lock(m_mutex);
+    for (i = 0; i < m_exchanges.size(); i++)
+    {
+        Query &q = m_exchanges[i];
+        sprintf(buf, "backend %d %lld %lu %lu\n", q.status, q.usec,
+                (unsigned long) q.sparql.length(),
+                (unsigned long) q.content.length());
+        entry.append(buf);
+        entry.append(q.sparql);
+        entry.append("\n");
+        entry.append(q.content);
+        entry.append("\n");
+    }
+    return true;
 }
 
 yf::SPARQL::~SPARQL()
 {
+    // the reloader waits on the same condition
+    {
+        boost::mutex::scoped_lock lock(m_p->m_reaper_mutex);
+        m_p->m_reaper_stop = true;
+        m_p->m_reaper_cond.notify_all();
+    }
+    if (m_p->m_reaper)
+        m_p->m_reaper->join();
+    if (m_p->m_reloader)
+        m_p->m_reloader->join();
+    {
+        boost::mutex::scoped_lock lock(m_p->m_lookup_mutex);
+        m_p->m_lookup_stop = true;
+        m_p->m_lookup_cond.notify_all();
+    }
+    m_p->m_lookup_workers.join_all();
+}
+
+// removes idle sessions and result sets, for clients that go away
+// without closing
+void yf::SPARQL::reaper()
+{
+    int ttl = m_p->m_session_ttl;
+    if (!ttl || (m_p->m_set_ttl && m_p->m_set_ttl < ttl))
+        ttl = m_p->m_set_ttl;
+    int interval = ttl > 4 ? ttl / 4 : 1;
+
+    boost::mutex::scoped_lock lock(m_p->m_reaper_mutex);
+    while (!m_p->m_reaper_stop)
+    {
+        boost::system_time t = boost::get_system_time() +
+            boost::posix_time::seconds(interval);
+        if (m_p->m_reaper_cond.timed_wait(lock, t))
+            continue;
+        lock.unlock();
+        reap(time(0));
+        lock.lock();
+    }
+}
+
+void yf::SPARQL::reap(time_t now)
+{
+    std::vector<SessionPtr> sessions;
+    size_t i, bytes = 0;
+    int nsets = 0;
+
+    if (m_p->m_session_ttl)
+    {
+        m_p->m_sessions.reap(now - m_p->m_session_ttl, sessions);
+        for (i = 0; i < sessions.size(); i++)
+            bytes += sessions[i]->reap_sets(now + 1, &nsets);
+    }
+    if (m_p->m_set_ttl)
+    {
+        std::vector<SessionPtr> all;
+        m_p->m_sessions.get_all(all);
+        for (i = 0; i < all.size(); i++)
+            bytes += all[i]->reap_sets(now - m_p->m_set_ttl, &nsets);
+    }
+    if (sessions.size() || nsets)
+    {
+        boost::mutex::scoped_lock lock(m_p->m_reaper_mutex);
+        m_p->m_reaped_sessions += sessions.size();
+        m_p->m_reaped_sets += nsets;
+        m_p->m_reaped_bytes += bytes;
+        yaz_log(YLOG_LOG, "sparql: reaped %d sessions, %d sets, %lu bytes;"
+                " total " ODR_INT_PRINTF " sessions, " ODR_INT_PRINTF
+                " sets, " ODR_INT_PRINTF " bytes",
+                (int) sessions.size(), nsets, (unsigned long) bytes,
+                m_p->m_reaped_sessions, m_p->m_reaped_sets,
+                m_p->m_reaped_bytes);
+    }
+}
+
+static int parse_uint(const struct _xmlAttr *attr)
+{
+    std::string v = mp::xml::get_text(attr->children);
+    char *end = 0;
+    long n = strtol(v.c_str(), &end, 10);
+
+    if (!end || end == v.c_str() || *end || n < 0 || n > INT_MAX)
+        throw mp::filter::FilterException(
+            "Bad value for " + std::string((const char *) attr->name)
+            + ": " + v);
+    return (int) n;
+}
+
+// a db section; confs are those before it, for include
+yf::SPARQL::ConfPtr yf::SPARQL::parse_db(const xmlNode *ptr,
+                                         const std::string &uri,
+                                         const std::list<ConfPtr> &confs)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+    ConfPtr conf(new Conf);
+    conf->s = s;
+    conf->uri = uri;
+
+    const struct _xmlAttr *attr;
+    for (attr = ptr->properties; attr; attr = attr->next)
+    {
+        if (!strcmp((const char *) attr->name, "path"))
+            conf->db = mp::xml::get_text(attr->children);
+        else if (!strcmp((const char *) attr->name, "uri"))
+            conf->uri = mp::xml::get_text(attr->children);
+        else if (!strcmp((const char *) attr->name, "schema"))
+            conf->schema = mp::xml::get_text(attr->children);
+        else if (!strcmp((const char *) attr->name, "selectivity"))
+        {
+            std::string v = mp::xml::get_text(attr->children);
+            if (v == "learn")
+                conf->learn = true;
+            else if (v != "static")
+                throw mp::filter::FilterException(
+                    "Bad value for selectivity: " + v);
+        }
+        else if (!strcmp((const char *) attr->name, "include"))
+        {
+            std::vector<std::string> dbs;
+            std::string db = mp::xml::get_text(attr->children);
+            boost::split(dbs, db, boost::is_any_of(" \t"));
+            size_t i;
+            for (i = 0; i < dbs.size(); i++)
+            {
+                if (dbs[i].length() == 0)
+                    continue;
+                std::list<ConfPtr>::const_iterator it = confs.begin();
+                while (1)
+                    if (it == confs.end())
+                    {
+                        throw mp::filter::FilterException(
+                            "include db not found: " + dbs[i]);
+                    }
+                    else if (dbs[i].compare((*it)->db) == 0)
+                    {
+                        if (yaz_sparql_include(s, (*it)->s))
+                            throw mp::filter::FilterException(
+                                "Bad SPARQL config include " + dbs[i]);
+                        conf->includes.push_back(*it);
+                        break;
+                    }
+                    else
+                        it++;
+            }
+        }
+        else
+            throw mp::filter::FilterException(
+                "Bad attribute " + std::string((const char *)
+                                               attr->name));
+    }
+    xmlNode *p = ptr->children;
+    for (; p; p = p->next)
+    {
+        if (p->type != XML_ELEMENT_NODE)
+            continue;
+        std::string name = (const char *) p->name;
+        std::string selectivity, cost, relation, truncation;
+        bool is_index = !strcmp((const char *) p->name, "index");
+        const struct _xmlAttr *attr;
+        for (attr = p->properties; attr; attr = attr->next)
+        {
+            if (!strcmp((const char *) attr->name, "type"))
+            {
+                name.append(".");
+                name.append(mp::xml::get_text(attr->children));
+            }
+            else if (!strcmp((const char *) attr->name,
+                             "selectivity") && is_index)
+                selectivity = mp::xml::get_text(attr->children);
+            else if (!strcmp((const char *) attr->name,
+                             "cost") && is_index)
+                cost = mp::xml::get_text(attr->children);
+            else if (!strcmp((const char *) attr->name,
+                             "relation") && is_index)
+                relation = mp::xml::get_text(attr->children);
+            else if (!strcmp((const char *) attr->name,
+                             "truncation") && is_index)
+                truncation = mp::xml::get_text(attr->children);
+            else
+                throw mp::filter::FilterException(
+                    "Bad attribute " + std::string((const char *)
+                                                   attr->name));
+        }
+        std::string base = name;
+        // variant template for index.X: index.X;2=R;5=T
+        if (relation.length())
+            name += ";2=" + relation;
+        if (truncation.length())
+            name += ";5=" + truncation;
+        std::string value = mp::xml::get_text(p);
+        if (yaz_sparql_add_pattern(s, name.c_str(), value.c_str()))
+        {
+            throw mp::filter::FilterException(
+                "Bad SPARQL config " + name);
+        }
+        // index.X gets selectivity.X and cost.X, also for variants
+        if (selectivity.length())
+        {
+            std::string sname = "selectivity" + base.substr(5);
+            if (yaz_sparql_add_pattern(s, sname.c_str(),
+                                       selectivity.c_str()))
+                throw mp::filter::FilterException(
+                    "Bad SPARQL config " + sname);
+        }
+        if (cost.length())
+        {
+            std::string cname = "cost" + base.substr(5);
+            if (yaz_sparql_add_pattern(s, cname.c_str(),
+                                       cost.c_str()))
+                throw mp::filter::FilterException(
+                    "Bad SPARQL config " + cname);
+        }
+    }
+    if (!conf->uri.length())
+    {
+        throw mp::filter::FilterException("Missing uri");
+    }
+    if (!conf->db.length())
+    {
+        throw mp::filter::FilterException("Missing path");
+    }
+    return conf;
 }
 
 void yf::SPARQL::configure(const xmlNode *xmlnode, bool test_only,
@@ -158,6 +975,12 @@ void yf::SPARQL::configure(const xmlNode *xmlnode, bool test_only,
 {
     const xmlNode *ptr = xmlnode->children;
     std::string uri;
+    boost::shared_ptr<Dbs> dbs(new Dbs);
+    const struct _xmlAttr *attr;
+
+    for (attr = xmlnode->properties; attr; attr = attr->next)
+        if (!strcmp((const char *) attr->name, "id"))
+            m_p->m_reload_id = mp::xml::get_text(attr->children);
 
     for (; ptr; ptr = ptr->next)
     {
@@ -170,112 +993,395 @@ void yf::SPARQL::configure(const xmlNode *xmlnode, bool test_only,
             {
                 if (!strcmp((const char *) attr->name, "uri"))
                     uri = mp::xml::get_text(attr->children);
+                else if (!strcmp((const char *) attr->name, "session-ttl"))
+                    m_p->m_session_ttl = parse_uint(attr);
+                else if (!strcmp((const char *) attr->name, "set-ttl"))
+                    m_p->m_set_ttl = parse_uint(attr);
+                else if (!strcmp((const char *) attr->name, "concurrency"))
+                {
+                    std::string v = mp::xml::get_text(attr->children);
+                    m_concurrency = atoi(v.c_str());
+                    if (m_concurrency < 1)
+                        throw mp::filter::FilterException(
+                            "Bad value for concurrency: " + v);
+                }
                 else
                     throw mp::filter::FilterException(
                         "Bad attribute " + std::string((const char *)
                                                        attr->name));
             }
         }
-        else if (!strcmp((const char *) ptr->name, "db"))
+        else if (!strcmp((const char *) ptr->name, "slowlog"))
         {
-            yaz_sparql_t s = yaz_sparql_create();
-            ConfPtr conf(new Conf);
-            conf->s = s;
-            conf->uri = uri;
-
+            std::string fname;
             const struct _xmlAttr *attr;
             for (attr = ptr->properties; attr; attr = attr->next)
             {
                 if (!strcmp((const char *) attr->name, "path"))
-                    conf->db = mp::xml::get_text(attr->children);
-                else if (!strcmp((const char *) attr->name, "uri"))
-                    conf->uri = mp::xml::get_text(attr->children);
-                else if (!strcmp((const char *) attr->name, "schema"))
-                    conf->schema = mp::xml::get_text(attr->children);
-                else if (!strcmp((const char *) attr->name, "include"))
+                    fname = mp::xml::get_text(attr->children);
+                else if (!strcmp((const char *) attr->name, "threshold"))
+                    m_p->m_slow_usec = parse_uint(attr) * 1000LL;
+                else if (!strcmp((const char *) attr->name, "sample"))
                 {
-                    std::vector<std::string> dbs;
-                    std::string db = mp::xml::get_text(attr->children);
-                    boost::split(dbs, db, boost::is_any_of(" \t"));
+                    std::string v = mp::xml::get_text(attr->children);
+                    char *end = 0;
+                    m_p->m_slow_sample = strtod(v.c_str(), &end);
+                    if (!end || end == v.c_str() || *end ||
+                        !(m_p->m_slow_sample > 0.0 &&
+                          m_p->m_slow_sample <= 1.0))
+                        throw mp::filter::FilterException(
+                            "Bad value for sample: " + v);
+                }
+                else
+                    throw mp::filter::FilterException(
+                        "Bad attribute " + std::string((const char *)
+                                                       attr->name));
+            }
+            if (!fname.length())
+                throw mp::filter::FilterException("Missing slowlog path");
+            if (!test_only)
+            {
+                FILE *f = fopen(fname.c_str(), "a");
+                if (!f)
+                    throw mp::filter::FilterException(
+                        "Cannot open slowlog " + fname + ": "
+                        + strerror(errno));
+                m_p->m_slow_log.reset(new LogWriter(f, 1000));
+                // the generated queries of slow requests are in that log
+                m_query_log_level = YLOG_DEBUG;
+            }
+        }
+        else if (!strcmp((const char *) ptr->name, "accesslog"))
+        {
+            static const struct {
+                const char *name;
+                int field;
+            } names[] = {
+                { "time", Trace::F_TIME }, { "trace", Trace::F_TRACE },
+                { "op", Trace::F_OP }, { "db", Trace::F_DB },
+                { "status", Trace::F_STATUS }, { "hits", Trace::F_HITS },
+                { "records", Trace::F_RECORDS }, { "bytes", Trace::F_BYTES },
+                { "usec", Trace::F_USEC }, { "stages", Trace::F_STAGES },
+                { "rpn", Trace::F_RPN }, { 0, 0 }
+            };
+            std::string fname;
+            const struct _xmlAttr *attr;
+            m_p->m_access_fields = Trace::F_RPN - 1; // all but rpn
+            for (attr = ptr->properties; attr; attr = attr->next)
+            {
+                if (!strcmp((const char *) attr->name, "path"))
+                    fname = mp::xml::get_text(attr->children);
+                else if (!strcmp((const char *) attr->name, "fields"))
+                {
+                    std::vector<std::string> fields;
+                    std::string v = mp::xml::get_text(attr->children);
+                    boost::split(fields, v, boost::is_any_of(" \t,"));
                     size_t i;
-                    for (i = 0; i < dbs.size(); i++)
+                    m_p->m_access_fields = 0;
+                    for (i = 0; i < fields.size(); i++)
                     {
-                        if (dbs[i].length() == 0)
+                        int j;
+                        if (fields[i].length() == 0)
                             continue;
-                        std::list<ConfPtr>::const_iterator it = db_conf.begin();
-                        while (1)
-                            if (it == db_conf.end())
-                            {
-                                throw mp::filter::FilterException(
-                                    "include db not found: " + dbs[i]);
-                            }
-                            else if (dbs[i].compare((*it)->db) == 0)
-                            {
-                                yaz_sparql_include(s, (*it)->s);
+                        for (j = 0; names[j].name; j++)
+                            if (fields[i] == names[j].name)
                                 break;
-                            }
-                            else
-                                it++;
+                        if (!names[j].name)
+                            throw mp::filter::FilterException(
+                                "Bad accesslog field: " + fields[i]);
+                        m_p->m_access_fields |= names[j].field;
                     }
                 }
+                else if (!strcmp((const char *) attr->name, "body"))
+                    m_p->m_access_body = parse_uint(attr);
                 else
                     throw mp::filter::FilterException(
                         "Bad attribute " + std::string((const char *)
                                                        attr->name));
             }
-            xmlNode *p = ptr->children;
-            for (; p; p = p->next)
+            if (!fname.length())
+                throw mp::filter::FilterException("Missing accesslog path");
+            if (!test_only)
             {
-                if (p->type != XML_ELEMENT_NODE)
-                    continue;
-                std::string name = (const char *) p->name;
-                const struct _xmlAttr *attr;
-                for (attr = p->properties; attr; attr = attr->next)
+                FILE *f = fopen(fname.c_str(), "a");
+                if (!f)
+                    throw mp::filter::FilterException(
+                        "Cannot open accesslog " + fname + ": "
+                        + strerror(errno));
+                m_p->m_access_log.reset(new LogWriter(f, 4096));
+            }
+        }
+        else if (!strcmp((const char *) ptr->name, "reload"))
+        {
+            const struct _xmlAttr *attr;
+            for (attr = ptr->properties; attr; attr = attr->next)
+            {
+                if (!strcmp((const char *) attr->name, "src"))
+                    m_p->m_reload_src = mp::xml::get_text(attr->children);
+                else if (!strcmp((const char *) attr->name, "interval"))
                 {
-                    if (!strcmp((const char *) attr->name, "type"))
-                    {
-                        name.append(".");
-                        name.append(mp::xml::get_text(attr->children));
-                    }
-                    else
+                    m_p->m_reload_interval = parse_uint(attr);
+                    if (m_p->m_reload_interval < 1)
                         throw mp::filter::FilterException(
-                            "Bad attribute " + std::string((const char *)
-                                                           attr->name));
+                            "Bad value for interval: 0");
                 }
-                std::string value = mp::xml::get_text(p);
-                if (yaz_sparql_add_pattern(s, name.c_str(), value.c_str()))
-                {
+                else
                     throw mp::filter::FilterException(
-                        "Bad SPARQL config " + name);
-                }
+                        "Bad attribute " + std::string((const char *)
+                                                       attr->name));
             }
-            if (!conf->uri.length())
+            if (!m_p->m_reload_src.length())
+                throw mp::filter::FilterException("Missing reload src");
+            if (m_p->m_reload_src[0] != '/' && path)
+                m_p->m_reload_src = std::string(path) + "/" +
+                    m_p->m_reload_src;
+        }
+        else if (!strcmp((const char *) ptr->name, "capture"))
+        {
+            std::string fname;
+            const struct _xmlAttr *attr;
+            for (attr = ptr->properties; attr; attr = attr->next)
+            {
+                if (!strcmp((const char *) attr->name, "path"))
+                    fname = mp::xml::get_text(attr->children);
+                else
+                    throw mp::filter::FilterException(
+                        "Bad attribute " + std::string((const char *)
+                                                       attr->name));
+            }
+            if (!fname.length())
+                throw mp::filter::FilterException("Missing capture path");
+            if (!test_only)
+            {
+                FILE *f = fopen(fname.c_str(), "a");
+                if (!f)
+                    throw mp::filter::FilterException(
+                        "Cannot open capture " + fname + ": "
+                        + strerror(errno));
+                // session ids start over with each process
+                fprintf(f, "capture %ld %ld\n", (long) getpid(),
+                        (long) time(0));
+                fflush(f);
+                m_p->m_capture.reset(new LogWriter(f, 256));
+            }
+        }
+        else if (!strcmp((const char *) ptr->name, "metrics"))
+        {
+            const struct _xmlAttr *attr;
+            for (attr = ptr->properties; attr; attr = attr->next)
+            {
+                if (!strcmp((const char *) attr->name, "path"))
+                    m_metrics_path = mp::xml::get_text(attr->children);
+                else
+                    throw mp::filter::FilterException(
+                        "Bad attribute " + std::string((const char *)
+                                                       attr->name));
+            }
+            if (m_metrics_path.length() == 0 || m_metrics_path[0] != '/')
+                throw mp::filter::FilterException(
+                    "Bad value for metrics path: " + m_metrics_path);
+        }
+        else if (!strcmp((const char *) ptr->name, "db"))
+            dbs->confs.push_back(parse_db(ptr, uri, dbs->confs));
+        else
+        {
+            throw mp::filter::FilterException
+                ("Bad element "
+                 + std::string((const char *) ptr->name)
+                 + " in sparql filter");
+        }
+    }
+    dbs->generation = 1;
+    m_p->m_dbs = dbs;
+    if (!test_only && !m_p->m_reaper &&
+        (m_p->m_session_ttl || m_p->m_set_ttl))
+        m_p->m_reaper.reset(
+            new boost::thread(boost::bind(&SPARQL::reaper, this)));
+    // the thread of a present runs a lane too
+    if (!test_only && !m_p->m_lookup_workers.size())
+    {
+        int i;
+        for (i = 1; i < m_concurrency; i++)
+            m_p->m_lookup_workers.create_thread(
+                boost::bind(&SPARQL::lookup_worker, this));
+    }
+    if (!test_only && !m_p->m_reloader && m_p->m_reload_src.length())
+    {
+        // changes from now on are reloaded; the config given is current
+        struct stat st;
+        if (stat(m_p->m_reload_src.c_str(), &st))
+            throw mp::filter::FilterException(
+                "Cannot stat reload src " + m_p->m_reload_src + ": "
+                + strerror(errno));
+        m_p->m_reload_mtime = st.st_mtime;
+        m_p->m_reload_size = st.st_size;
+        m_p->m_reloader.reset(
+            new boost::thread(boost::bind(&SPARQL::reloader, this)));
+    }
+}
+
+yf::SPARQL::DbsPtr yf::SPARQL::get_dbs() const
+{
+    boost::mutex::scoped_lock lock(m_p->m_dbs_mutex);
+    return m_p->m_dbs;
+}
+
+static void find_filters(const xmlNode *ptr, const char *id,
+                         const xmlNode **first, int *matches)
+{
+    for (; ptr; ptr = ptr->next)
+    {
+        if (ptr->type != XML_ELEMENT_NODE)
+            continue;
+        if (!strcmp((const char *) ptr->name, "filter"))
+        {
+            bool sparql = false, same_id = !id;
+            const struct _xmlAttr *attr;
+            for (attr = ptr->properties; attr; attr = attr->next)
+                if (!strcmp((const char *) attr->name, "type"))
+                    sparql = mp::xml::get_text(attr->children) == "sparql";
+                else if (id && !strcmp((const char *) attr->name, "id"))
+                    same_id = mp::xml::get_text(attr->children) == id;
+            if (sparql && same_id)
             {
-                throw mp::filter::FilterException("Missing uri");
+                if (!*first)
+                    *first = ptr;
+                (*matches)++;
             }
-            if (!conf->db.length())
+        }
+        find_filters(ptr->children, id, first, matches);
+    }
+}
+
+const xmlNode *mp::filter::find_sparql_filter(const xmlNode *ptr,
+                                              const char *id, int *matches)
+{
+    const xmlNode *first = 0;
+
+    *matches = 0;
+    find_filters(ptr, id, &first, matches);
+    return first;
+}
+
+// Makes a generation of the db sections of the sparql filter in
+// m_reload_src, off the request path, and swaps it in. The other
+// settings are those of the running config. Metrics and learned
+// selectivity of a db carry over to the db of the same path
+bool yf::SPARQL::reload()
+{
+    long long t0 = monotonic_usec();
+    boost::shared_ptr<Dbs> dbs(new Dbs);
+    xmlDoc *doc = xmlParseFile(m_p->m_reload_src.c_str());
+
+    try
+    {
+        if (!doc)
+            throw mp::filter::FilterException("bad XML");
+        const char *id = m_p->m_reload_id.length() ?
+            m_p->m_reload_id.c_str() : 0;
+        int matches;
+        const xmlNode *ptr =
+            find_sparql_filter(xmlDocGetRootElement(doc), id, &matches);
+        if (!ptr)
+            throw mp::filter::FilterException(
+                id ? "no sparql filter with id " + m_p->m_reload_id
+                : std::string("no sparql filter"));
+        if (matches > 1)
+            throw mp::filter::FilterException(
+                id ? "more than one sparql filter with id " + m_p->m_reload_id
+                : std::string("more than one sparql filter and no id"));
+        std::string uri;
+        for (ptr = ptr->children; ptr; ptr = ptr->next)
+        {
+            if (ptr->type != XML_ELEMENT_NODE)
+                continue;
+            if (!strcmp((const char *) ptr->name, "defaults"))
             {
-                throw mp::filter::FilterException("Missing path");
+                const struct _xmlAttr *attr;
+                for (attr = ptr->properties; attr; attr = attr->next)
+                    if (!strcmp((const char *) attr->name, "uri"))
+                        uri = mp::xml::get_text(attr->children);
             }
-            db_conf.push_back(conf);
+            else if (!strcmp((const char *) ptr->name, "db"))
+                dbs->confs.push_back(parse_db(ptr, uri, dbs->confs));
         }
-        else
+    }
+    catch (std::exception &e)
+    {
+        if (doc)
+            xmlFreeDoc(doc);
+        m_p->m_reload_failures.add(1);
+        yaz_log(YLOG_WARN, "sparql: reload of %s failed: %s",
+                m_p->m_reload_src.c_str(), e.what());
+        return false;
+    }
+    xmlFreeDoc(doc);
+
+    DbsPtr old = get_dbs();
+    std::list<ConfPtr>::iterator it = dbs->confs.begin();
+    for (; it != dbs->confs.end(); it++)
+    {
+        std::list<ConfPtr>::const_iterator o = old->confs.begin();
+        for (; o != old->confs.end(); o++)
+            if ((*o)->db == (*it)->db)
+                break;
+        if (o == old->confs.end())
+            continue;
+        (*it)->metrics = (*o)->metrics;
+        if ((*it)->learn && (*o)->learn)
         {
-            throw mp::filter::FilterException
-                ("Bad element "
-                 + std::string((const char *) ptr->name)
-                 + " in sparql filter");
+            boost::shared_lock<boost::shared_mutex>
+                lock((*o)->learn_mutex);
+            yaz_sparql_copy_learned((*it)->s, (*o)->s);
+        }
+    }
+    dbs->generation = old->generation + 1;
+    {
+        boost::mutex::scoped_lock lock(m_p->m_dbs_mutex);
+        m_p->m_dbs = dbs;
+    }
+    long long t = monotonic_usec() - t0;
+    m_p->m_reload_latency.record(t);
+    yaz_log(YLOG_LOG, "sparql: generation %d from %s: %d dbs in %lld us",
+            dbs->generation, m_p->m_reload_src.c_str(),
+            (int) dbs->confs.size(), t);
+    return true;
+}
+
+// checks m_reload_src for changes, of time or size
+void yf::SPARQL::reloader()
+{
+    boost::mutex::scoped_lock lock(m_p->m_reaper_mutex);
+    while (!m_p->m_reaper_stop)
+    {
+        boost::system_time t = boost::get_system_time() +
+            boost::posix_time::seconds(m_p->m_reload_interval);
+        if (m_p->m_reaper_cond.timed_wait(lock, t))
+            continue;
+        lock.unlock();
+        struct stat st;
+        if (!stat(m_p->m_reload_src.c_str(), &st) &&
+            (st.st_mtime != m_p->m_reload_mtime ||
+             st.st_size != m_p->m_reload_size))
+        {
+            m_p->m_reload_mtime = st.st_mtime;
+            m_p->m_reload_size = st.st_size;
+            reload();
         }
+        lock.lock();
     }
 }
 
+yf::SPARQL::Conf::Conf() : s(0), metrics(new Metrics), learn(false)
+{
+}
+
 yf::SPARQL::Conf::~Conf()
 {
     yaz_sparql_destroy(s);
 }
 
 yf::SPARQL::Session::Session(const SPARQL *sparql) :
-    m_in_use(true),
     m_support_named_result_sets(false),
     m_sparql(sparql)
 {
@@ -285,169 +1391,101 @@ yf::SPARQL::Session::~Session()
 {
 }
 
+// Init and close use the session exclusively. Other requests share it,
+// so that presents of a pipelining client run in parallel; they are
+// serialized per result set, see FrontendSet::m_mutex
 yf::SPARQL::SessionPtr yf::SPARQL::get_session(Package & package,
-                                               Z_APDU **apdu) const
+                                               Z_APDU **apdu,
+                                               bool *exclusive) const
 {
-    SessionPtr ptr0;
-
     Z_GDU *gdu = package.request().get();
 
-    boost::mutex::scoped_lock lock(m_p->m_mutex);
-
-    std::map<mp::Session,SPARQL::SessionPtr>::iterator it;
-
     if (gdu && gdu->which == Z_GDU_Z3950)
         *apdu = gdu->u.z3950;
     else
         *apdu = 0;
-
-    while (true)
-    {
-        it = m_p->m_clients.find(package.session());
-        if (it == m_p->m_clients.end())
-            break;
-        if (!it->second->m_in_use)
-        {
-            it->second->m_in_use = true;
-            return it->second;
-        }
-        m_p->m_cond_session_ready.wait(lock);
-    }
-    if (!*apdu)
-        return ptr0;
-
-    // new Z39.50 session ..
-    SessionPtr p(new Session(this));
-    m_p->m_clients[package.session()] = p;
-    return p;
+    *exclusive = *apdu &&
+        (*apdu)->which != Z_APDU_searchRequest &&
+        (*apdu)->which != Z_APDU_presentRequest &&
+        (*apdu)->which != Z_APDU_sortRequest;
+
+    // new Z39.50 session only if there is an APDU
+    return m_p->m_sessions.acquire(package.session(),
+                                   *apdu ? this : (const SPARQL *) 0,
+                                   *exclusive);
 }
 
-void yf::SPARQL::release_session(Package &package) const
+void yf::SPARQL::release_session(Package &package, SessionPtr p,
+                                 bool exclusive) const
 {
-    boost::mutex::scoped_lock lock(m_p->m_mutex);
-    std::map<mp::Session,SessionPtr>::iterator it;
+    if (p)
+        m_p->m_sessions.release(package.session(), p, exclusive,
+                                package.session().is_closed());
+}
 
-    it = m_p->m_clients.find(package.session());
-    if (it != m_p->m_clients.end())
-    {
-        it->second->m_in_use = false;
+yf::SPARQL::FrontendSetPtr yf::SPARQL::Session::get_set(
+    const std::string &name)
+{
+    boost::mutex::scoped_lock lock(m_sets_mutex);
+    FrontendSets::iterator it = m_frontend_sets.find(name);
 
-        if (package.session().is_closed())
-            m_p->m_clients.erase(it);
-        m_p->m_cond_session_ready.notify_all();
-    }
+    if (it == m_frontend_sets.end())
+        return FrontendSetPtr();
+    it->second->m_last_use = time(0);
+    return it->second;
 }
 
-static bool get_result(xmlDoc *doc, Odr_int *sz, Odr_int pos, xmlDoc **ndoc)
+// removes sets unused since before; returns their size
+size_t yf::SPARQL::Session::reap_sets(time_t before, int *nsets)
 {
-    xmlNode *ptr = xmlDocGetRootElement(doc);
-    xmlNode *q0;
-    Odr_int cur = 0;
-
-    if (ndoc)
-        *ndoc = xmlNewDoc(BAD_CAST "1.0");
+    boost::mutex::scoped_lock lock(m_sets_mutex);
+    FrontendSets::iterator it = m_frontend_sets.begin();
+    size_t sz = 0;
 
-    if (ptr->type == XML_ELEMENT_NODE &&
-        !strcmp((const char *) ptr->name, "RDF"))
-    {
-        if (ndoc)
+    while (it != m_frontend_sets.end())
+        if (it->second->m_last_use < before)
         {
-            q0 = xmlCopyNode(ptr, 2);
-            xmlDocSetRootElement(*ndoc, q0);
+            // a present still using the set keeps it until done
+            sz += it->second->size();
+            (*nsets)++;
+            m_frontend_sets.erase(it++);
         }
-        ptr = ptr->children;
+        else
+            it++;
+    return sz;
+}
 
-        while (ptr && ptr->type != XML_ELEMENT_NODE)
-            ptr = ptr->next;
-        if (ptr && ptr->type == XML_ELEMENT_NODE &&
-            !strcmp((const char *) ptr->name, "Description"))
-        {
-            xmlNode *p = ptr->children;
-
-            while (p && p->type != XML_ELEMENT_NODE)
-                p = p->next;
-            if (p && p->type == XML_ELEMENT_NODE &&
-                !strcmp((const char *) p->name, "type"))
-            { /* SELECT RESULT */
-                for (ptr = ptr->children; ptr; ptr = ptr->next)
-                    if (ptr->type == XML_ELEMENT_NODE &&
-                        !strcmp((const char *) ptr->name, "solution"))
-                    {
-                        if (cur++ == pos)
-                        {
-                            if (ndoc)
-                            {
-                                xmlNode *q1 = xmlCopyNode(ptr, 1);
-                                xmlAddChild(q0, q1);
-                            }
-                            break;
-                        }
-                    }
-            }
-            else
-            {   /* CONSTRUCT result */
-                for (; ptr; ptr = ptr->next)
-                    if (ptr->type == XML_ELEMENT_NODE &&
-                        !strcmp((const char *) ptr->name, "Description"))
-                    {
-                        if (cur++ == pos)
-                        {
-                            if (ndoc)
-                            {
-                                xmlNode *q1 = xmlCopyNode(ptr, 1);
-                                xmlAddChild(q0, q1);
-                            }
-                            return true;
-                        }
-                    }
-            }
-        }
-    }
+// fset replaces the set of name, if that is still old; an empty fset
+// removes it. Returns the set that was there
+yf::SPARQL::FrontendSetPtr yf::SPARQL::Session::replace_set(
+    const std::string &name, FrontendSetPtr old, FrontendSetPtr fset)
+{
+    boost::mutex::scoped_lock lock(m_sets_mutex);
+    FrontendSets::iterator it = m_frontend_sets.find(name);
+    FrontendSetPtr cur;
+
+    if (it != m_frontend_sets.end())
+        cur = it->second;
+    if (cur != old)
+        return cur;
+    if (fset)
+        m_frontend_sets[name] = fset;
+    else if (it != m_frontend_sets.end())
+        m_frontend_sets.erase(it);
+    return cur;
+}
+
+// empty buffer for records, kept by each thread; records are copied
+// to the ODR, so its memory is reused from record to record
+static xmlBufferPtr dump_buffer()
+{
+    static boost::thread_specific_ptr<xmlBuffer> buf(xmlBufferFree);
+
+    if (!buf.get())
+        buf.reset(xmlBufferCreate());
     else
-    {
-        for (; ptr; ptr = ptr->next)
-            if (ptr->type == XML_ELEMENT_NODE &&
-                !strcmp((const char *) ptr->name, "sparql"))
-                break;
-        if (ptr)
-        {
-            if (ndoc)
-            {
-                q0 = xmlCopyNode(ptr, 2);
-                xmlDocSetRootElement(*ndoc, q0);
-            }
-            for (ptr = ptr->children; ptr; ptr = ptr->next)
-                if (ptr->type == XML_ELEMENT_NODE &&
-                    !strcmp((const char *) ptr->name, "results"))
-                    break;
-        }
-        if (ptr)
-        {
-            xmlNode *q1 = 0;
-            if (ndoc)
-            {
-                q1 = xmlCopyNode(ptr, 0);
-                xmlAddChild(q0, q1);
-            }
-            for (ptr = ptr->children; ptr; ptr = ptr->next)
-                if (ptr->type == XML_ELEMENT_NODE &&
-                    !strcmp((const char *) ptr->name, "result"))
-                {
-                    if (cur++ == pos)
-                    {
-                        if (ndoc)
-                        {
-                            xmlNode *q2 = xmlCopyNode(ptr, 1);
-                            xmlAddChild(q1, q2);
-                        }
-                        return true;
-                    }
-                }
-        }
-    }
-    if (sz)
-        *sz = cur;
-    return false;
+        xmlBufferEmpty(buf.get());
+    return buf.get();
 }
 
 Z_Records *yf::SPARQL::Session::fetch(
@@ -456,8 +1494,9 @@ Z_Records *yf::SPARQL::Session::fetch(
     ODR odr, Odr_oid *preferredRecordSyntax,
     Z_ElementSetNames *esn,
     int start, int number, int &error_code, std::string &addinfo,
-    int *number_returned, int *next_position)
+    int *number_returned, int *next_position, Trace &trace)
 {
+    long long t0 = monotonic_usec();
     Z_Records *rec = (Z_Records *) odr_malloc(odr, sizeof(Z_Records));
     std::list<Result>::iterator it = fset->results.begin();
     const char *schema = 0;
@@ -486,11 +1525,14 @@ Z_Records *yf::SPARQL::Session::fetch(
                 schema);
         return rec;
     }
+    Metrics &metrics = *it->conf->metrics;
+    metrics.presents.add(1);
     rec->which = Z_Records_DBOSD;
     rec->u.databaseOrSurDiagnostics = (Z_NamePlusRecordList *)
         odr_malloc(odr, sizeof(Z_NamePlusRecordList));
     rec->u.databaseOrSurDiagnostics->records = (Z_NamePlusRecord **)
         odr_malloc(odr, sizeof(Z_NamePlusRecord *) * number);
+    std::vector<LookupPtr> lookups;
     int i;
     for (i = 0; i < number; i++)
     {
@@ -501,7 +1543,10 @@ Z_Records *yf::SPARQL::Session::fetch(
         npr->which = Z_NamePlusRecord_databaseRecord;
         xmlDoc *ndoc = 0;
 
-        if (!get_result(it->doc, 0, start - 1 + i, &ndoc))
+        long long t1 = monotonic_usec();
+        bool found = get_result(it->doc, 0, start - 1 + i, &ndoc);
+        trace.add(Trace::RESULT, monotonic_usec() - t1);
+        if (!found)
         {
             if (ndoc)
                 xmlFreeDoc(ndoc);
@@ -544,72 +1589,99 @@ Z_Records *yf::SPARQL::Session::fetch(
             }
             else
             {
-                mp::wrbuf addinfo, query, w;
-                int error = yaz_sparql_from_uri_wrbuf(it->conf->s,
-                                                      addinfo, query,
-                                                      uri.c_str(), schema);
-                if (!error)
+                LookupPtr l(new Lookup);
+                l->uri = uri;
+                l->error = yaz_sparql_from_uri_wrbuf(it->conf->s,
+                                                     l->addinfo, l->query,
+                                                     uri.c_str(), schema);
+                if (!l->error)
                 {
                     if (!fetch_logged)
                     { // Log the fetch query only once
-                        package.log("sparql", YLOG_LOG,
+                        package.log("sparql", m_sparql->m_query_log_level,
                             "fetch query: for %s \n%s",
-                            uri.c_str(), query.c_str() );
+                            uri.c_str(), l->query.c_str() );
                         fetch_logged = true;
                     }
                     else
                     {
-                        package.log("sparql", YLOG_LOG,
+                        package.log("sparql", m_sparql->m_query_log_level,
                             "fetch uri:%s", uri.c_str() );
                     }
-                    error = invoke_sparql(package, query.c_str(),
-                                          it->conf, w);
                 }
-                if (error)
-                {
-                    rec->which = Z_Records_NSD;
-                    rec->u.nonSurrogateDiagnostic =
-                        zget_DefaultDiagFormat(
-                            odr,
-                            error,
-                            addinfo.len() ? addinfo.c_str() : 0);
-                    xmlFreeDoc(ndoc);
-                    return rec;
-                }
-                npr->u.databaseRecord =
-                    z_ext_record_xml(odr, w.c_str(), w.len());
+                lookups.push_back(l);
             }
         }
         else
         {
-            xmlBufferPtr buf = xmlBufferCreate();
+            xmlBufferPtr buf = dump_buffer();
             xmlNodeDump(buf, ndoc, ndoc_root, 0, 0);
-            yaz_log(YLOG_LOG, "record %s %.*s", uri_lookup ? "uri" : "normal",
-                    (int) buf->use, (const char *) buf->content);
+            trace.add_body((const char *) buf->content, buf->use);
             npr->u.databaseRecord =
                 z_ext_record_xml(odr, (const char *) buf->content, buf->use);
-            xmlBufferFree(buf);
         }
         xmlFreeDoc(ndoc);
     }
+    if (uri_lookup)
+    {
+        size_t j;
+
+        metrics.lookups.add(lookups.size());
+        long long t1 = monotonic_usec();
+        invoke_lookups(package, lookups, it->conf, trace);
+        trace.add(Trace::LOOKUPS, monotonic_usec() - t1);
+        for (j = 0; j < lookups.size(); j++)
+        {
+            Lookup &l = *lookups[j];
+            if (l.error)
+            {
+                rec->which = Z_Records_NSD;
+                rec->u.nonSurrogateDiagnostic =
+                    zget_DefaultDiagFormat(
+                        odr,
+                        l.error,
+                        l.addinfo.len() ? l.addinfo.c_str() : 0);
+                return rec;
+            }
+            trace.add_body(l.w.c_str(), l.w.len());
+            rec->u.databaseOrSurDiagnostics->records[j]->u.databaseRecord =
+                z_ext_record_xml(odr, l.w.c_str(), l.w.len());
+        }
+    }
     rec->u.databaseOrSurDiagnostics->num_records = i;
     *number_returned = i;
     if (start + number > fset->hits)
         *next_position = 0;
     else
         *next_position = start + number;
+    // includes the URI lookups, whose backend time is also in backend
+    long long t = monotonic_usec() - t0;
+    metrics.records.record(t);
+    trace.add(Trace::RECORDS, t);
     return rec;
 }
 
 int yf::SPARQL::Session::invoke_sparql(mp::Package &package,
                                        const char *sparql_query,
                                        ConfPtr conf,
-                                       WRBUF w)
+                                       WRBUF w,
+                                       Trace &trace)
 {
     Package http_package(package.session(), package.origin());
     mp::odr odr;
 
     http_package.copy_filter(package);
+    backend_request(http_package, odr, sparql_query, conf, trace);
+    long long t0 = monotonic_usec();
+    http_package.move();
+    return backend_response(package, http_package, sparql_query, conf, w,
+                            trace, monotonic_usec() - t0);
+}
+
+void yf::SPARQL::Session::backend_request(Package &http_package, ODR odr,
+                                          const char *sparql_query,
+                                          ConfPtr conf, Trace &trace)
+{
     Z_GDU *gdu = z_get_HTTP_Request_uri(odr, conf->uri.c_str(), 0, 1);
 
     z_HTTP_header_add(odr, &gdu->u.HTTP_Request->headers,
@@ -617,6 +1689,8 @@ int yf::SPARQL::Session::invoke_sparql(mp::Package &package,
     z_HTTP_header_add(odr, &gdu->u.HTTP_Request->headers,
                       "Accept", "application/sparql-results+xml,"
                       "application/rdf+xml");
+    z_HTTP_header_add(odr, &gdu->u.HTTP_Request->headers,
+                      "traceparent", trace.traceparent().c_str());
     const char *names[2];
     names[0] = "query";
     names[1] = 0;
@@ -631,18 +1705,34 @@ int yf::SPARQL::Session::invoke_sparql(mp::Package &package,
     yaz_log(YLOG_DEBUG, "sparql: HTTP request\n%s", sparql_query);
 
     http_package.request() = gdu;
-    http_package.move();
+}
+
+// response of http_package, moved in usec, to w; package is the request
+// of the client
+int yf::SPARQL::Session::backend_response(Package &package,
+                                          Package &http_package,
+                                          const char *sparql_query,
+                                          ConfPtr conf, WRBUF w,
+                                          Trace &trace, long long usec)
+{
+    conf->metrics->backend.record(usec);
+    trace.add(Trace::BACKEND, usec);
 
     Z_GDU *gdu_resp = http_package.response().get();
+    Z_HTTP_Response *resp = 0;
+    if (gdu_resp && gdu_resp->which == Z_GDU_HTTP_Response)
+        resp = gdu_resp->u.HTTP_Response;
+    trace.backend(conf->db, sparql_query, resp, usec);
 
-    if (!gdu_resp || gdu_resp->which != Z_GDU_HTTP_Response)
+    if (!resp)
     {
+        conf->metrics->backend_errors.add(1);
         wrbuf_puts(w, "no HTTP response from backend");
         return YAZ_BIB1_TEMPORARY_SYSTEM_ERROR;
     }
-    else if (gdu_resp->u.HTTP_Response->code != 200)
+    else if (resp->code != 200)
     {
-        Z_HTTP_Response *resp = gdu_resp->u.HTTP_Response;
+        conf->metrics->backend_errors.add(1);
         wrbuf_printf(w, "sparql: HTTP error %d from backend",
                      resp->code);
         package.log("sparql", YLOG_LOG,
@@ -652,11 +1742,123 @@ int yf::SPARQL::Session::invoke_sparql(mp::Package &package,
             "%.*s" , resp->content_len, resp->content_buf );
         return YAZ_BIB1_TEMPORARY_SYSTEM_ERROR;
     }
-    Z_HTTP_Response *resp = gdu_resp->u.HTTP_Response;
+    conf->metrics->bytes.add(resp->content_len);
     wrbuf_write(w, resp->content_buf, resp->content_len);
     return 0;
 }
 
+// runs the lookups with up to m_concurrency of them in flight, on this
+// thread and on the lookup workers. Only the moves of the packages run
+// on the workers; the packages are made and read here. Each lane has a
+// session of its own, so that packages moved at the same time never
+// share one; those of lanes other than the first are closed after
+void yf::SPARQL::Session::invoke_lookups(mp::Package &package,
+                                         std::vector<LookupPtr> &lookups,
+                                         ConfPtr conf, Trace &trace)
+{
+    Rep *rep = m_sparql->m_p.get();
+    size_t i, lanes = std::min(lookups.size(),
+                               (size_t) m_sparql->m_concurrency);
+    std::vector<mp::Session> sessions;
+    LookupBatch batch;
+
+    if (!lanes)
+        return;
+    sessions.push_back(package.session());
+    for (i = 1; i < lanes; i++)
+        sessions.push_back(mp::Session());
+    for (i = 0; i < lookups.size(); i++)
+    {
+        Lookup &l = *lookups[i];
+        if (l.error)
+            continue;
+        l.package.reset(new Package(sessions[i % lanes], package.origin()));
+        l.package->copy_filter(package);
+        backend_request(*l.package, l.odr, l.query.c_str(), conf, trace);
+    }
+
+    batch.lookups = &lookups;
+    batch.lanes = lanes;
+    batch.next = 1;
+    batch.done = 0;
+    boost::mutex::scoped_lock lock(rep->m_lookup_mutex);
+    for (i = 1; i < lanes; i++)
+        rep->m_lookup_queue.push_back(&batch);
+    rep->m_lookup_cond.notify_all();
+    // lane 0, then those that no worker has taken
+    size_t lane = 0;
+    while (true)
+    {
+        lock.unlock();
+        batch.run(lane);
+        lock.lock();
+        batch.done++;
+        if (batch.next == lanes)
+            break;
+        lane = batch.next++;
+    }
+    std::deque<LookupBatch *> &q = rep->m_lookup_queue;
+    q.erase(std::remove(q.begin(), q.end(), &batch), q.end());
+    while (batch.done < lanes)
+        batch.done_cond.wait(lock);
+    lock.unlock();
+
+    for (i = 0; i < lookups.size(); i++)
+    {
+        Lookup &l = *lookups[i];
+        if (!l.error)
+            l.error = backend_response(package, *l.package, l.query.c_str(),
+                                       conf, l.w, trace, l.usec);
+    }
+    for (i = 1; i < lanes; i++)
+    {
+        Package close_package(sessions[i], package.origin());
+        close_package.copy_filter(package);
+        close_package.session().close();
+        close_package.move();
+    }
+}
+
+void yf::SPARQL::LookupBatch::run(size_t lane)
+{
+    size_t j;
+
+    for (j = lane; j < lookups->size(); j += lanes)
+    {
+        Lookup &l = *(*lookups)[j];
+        if (l.error)
+            continue;
+        long long t0 = monotonic_usec();
+        l.package->move();
+        l.usec = monotonic_usec() - t0;
+    }
+}
+
+// takes lanes of the batches queued by presents, until the filter goes
+void yf::SPARQL::lookup_worker()
+{
+    boost::mutex::scoped_lock lock(m_p->m_lookup_mutex);
+    while (!m_p->m_lookup_stop)
+    {
+        if (m_p->m_lookup_queue.empty())
+        {
+            m_p->m_lookup_cond.wait(lock);
+            continue;
+        }
+        LookupBatch *b = m_p->m_lookup_queue.front();
+        m_p->m_lookup_queue.pop_front();
+        // the present may have taken its lanes itself
+        if (b->next == b->lanes)
+            continue;
+        size_t lane = b->next++;
+        lock.unlock();
+        b->run(lane);
+        lock.lock();
+        if (++b->done == b->lanes)
+            b->done_cond.notify_all();
+    }
+}
+
 Z_Records *yf::SPARQL::Session::explain_fetch(
     Package &package,
     FrontendSetPtr fset,
@@ -727,12 +1929,12 @@ Z_APDU *yf::SPARQL::Session::explain_search(mp::Package &package,
                  // Empty string is seen here as two double quotes ""
                  // so it returns all bases as well
     int numbases = 0;
-    std::list<ConfPtr>::const_iterator it = m_sparql->db_conf.begin();
-    m_frontend_sets[req->resultSetName] = fset;
+    DbsPtr dbs = m_sparql->get_dbs();
+    std::list<ConfPtr>::const_iterator it = dbs->confs.begin();
     fset->explaindblist.clear();
-    fset->explaindblist.reserve(m_sparql->db_conf.size());
+    fset->explaindblist.reserve(dbs->confs.size());
 
-    for (; it != m_sparql->db_conf.end(); it++)
+    for (; it != dbs->confs.end(); it++)
         if ( (*it)->schema.length() > 0  &&  // searchable db
             (!*term || strcmp(term,(*it)->db.c_str())==0)  )
         { // and want all, or found the matching one
@@ -785,20 +1987,169 @@ Z_APDU *yf::SPARQL::Session::explain_search(mp::Package &package,
 }
 
 
+// of a result cut to the rows of limit.downgrade
+static const int downgrade_diag =
+    YAZ_BIB1_RESOURCES_EXHAUSTED_VALID_SUBSET_OF_RESULTS_AVAILABLE;
+
+static Z_APDU *create_sortResponse(mp::odr &odr, const Z_APDU *apdu_req,
+                                   int error, const char *addinfo)
+{
+    Z_APDU *apdu = odr.create_APDU(Z_APDU_sortResponse, apdu_req);
+    Z_SortResponse *resp = apdu->u.sortResponse;
+
+    if (error)
+    {
+        resp->sortStatus = odr_intdup(odr, Z_SortResponse_failure);
+        resp->num_diagnostics = 1;
+        resp->diagnostics = (Z_DiagRec **)
+            odr_malloc(odr, sizeof(*resp->diagnostics));
+        resp->diagnostics[0] = zget_DiagRec(odr, error, addinfo);
+    }
+    else
+        resp->sortStatus = odr_intdup(odr, Z_SortResponse_success);
+    return apdu;
+}
+
+// the search of the input set is run again with ORDER BY added
+Z_APDU *yf::SPARQL::Session::sort(mp::Package &package,
+                                  Z_APDU *apdu_req,
+                                  mp::odr &odr,
+                                  Trace &trace)
+{
+    Z_SortRequest *req = apdu_req->u.sortRequest;
+
+    if (req->num_inputResultSetNames != 1)
+        return create_sortResponse(
+            odr, apdu_req, YAZ_BIB1_SORT_TOO_MANY_INPUT_RESULTS, 0);
+    FrontendSetPtr fset = get_set(req->inputResultSetNames[0]);
+    if (!fset)
+        return create_sortResponse(
+            odr, apdu_req, YAZ_BIB1_SPECIFIED_RESULT_SET_DOES_NOT_EXIST,
+            req->inputResultSetNames[0]);
+    boost::shared_lock<boost::shared_mutex> fset_lock(fset->m_mutex);
+    if (!fset->query)
+        return create_sortResponse(
+            odr, apdu_req, YAZ_BIB1_CANNOT_SORT_ACCORDING_TO_SEQUENCE, 0);
+
+    // presents of the sorted set wait until it is made; on failure the
+    // set it replaced is put back
+    FrontendSetPtr nset(new FrontendSet);
+    boost::unique_lock<boost::shared_mutex> nset_lock(nset->m_mutex);
+    std::string sorted_name = req->sortedResultSetName;
+    FrontendSetPtr old_set;
+    trace.set_query(fset->db, fset->query);
+    {
+        boost::mutex::scoped_lock lock(m_sets_mutex);
+        old_set = m_frontend_sets[sorted_name];
+        m_frontend_sets[sorted_name] = nset;
+    }
+    Z_APDU *apdu_res = sort_set(package, apdu_req, odr, fset, nset,
+                                 trace);
+    if (*apdu_res->u.sortResponse->sortStatus == Z_SortResponse_failure)
+        replace_set(sorted_name, nset, old_set);
+    else
+        trace.set_hits(nset->hits);
+    return apdu_res;
+}
+
+Z_APDU *yf::SPARQL::Session::sort_set(mp::Package &package,
+                                      Z_APDU *apdu_req,
+                                      mp::odr &odr,
+                                      FrontendSetPtr fset,
+                                      FrontendSetPtr nset,
+                                      Trace &trace)
+{
+    Z_SortRequest *req = apdu_req->u.sortRequest;
+
+    bool partial = false; // a query was downgraded
+
+    nset->db = fset->db;
+    nset->query = yaz_clone_z_RPNQuery(fset->query, nset->nmem);
+    std::list<Result>::const_iterator it = fset->results.begin();
+    for (; it != fset->results.end(); it++)
+    {
+        ConfPtr conf = it->conf;
+        mp::wrbuf addinfo_wr;
+        mp::wrbuf sparql_wr;
+        int error, downgraded = 0;
+        long long t0 = monotonic_usec();
+        {
+            boost::shared_lock<boost::shared_mutex>
+                lock(conf->learn_mutex, boost::defer_lock);
+            if (conf->learn)
+                lock.lock();
+            error = yaz_sparql_from_rpn_sort_wrbuf(
+                conf->s, addinfo_wr, sparql_wr, nset->query,
+                req->sortSequence, &downgraded);
+        }
+        if (downgraded)
+            partial = true;
+        long long t = monotonic_usec() - t0;
+        conf->metrics->translate.record(t);
+        trace.add(Trace::TRANSLATE, t);
+        if (error)
+            return create_sortResponse(
+                odr, apdu_req, error,
+                addinfo_wr.len() ? addinfo_wr.c_str() : 0);
+        package.log("sparql", m_sparql->m_query_log_level,
+                    "sort query:\n%s", sparql_wr.c_str());
+        mp::wrbuf w;
+        error = invoke_sparql(package, sparql_wr.c_str(), conf, w, trace);
+        if (error)
+            return create_sortResponse(odr, apdu_req, error,
+                                       w.len() ? w.c_str() : 0);
+        t0 = monotonic_usec();
+        xmlDocPtr doc = xmlParseMemory(w.c_str(), w.len());
+        t = monotonic_usec() - t0;
+        conf->metrics->parse.record(t);
+        trace.add(Trace::PARSE, t);
+        if (!doc)
+            return create_sortResponse(
+                odr, apdu_req, YAZ_BIB1_TEMPORARY_SYSTEM_ERROR,
+                "invalid XML from backend");
+        Result result;
+        result.doc = doc;
+        result.conf = conf;
+        result.size = w.len();
+        nset->results.push_back(result);
+        result.doc = 0;
+        t0 = monotonic_usec();
+        get_result(doc, &nset->hits, -1, 0);
+        trace.add(Trace::RESULT, monotonic_usec() - t0);
+    }
+
+    Z_APDU *apdu_res = create_sortResponse(odr, apdu_req, 0, 0);
+    Z_SortResponse *resp = apdu_res->u.sortResponse;
+    resp->resultCount = odr_intdup(odr, nset->hits);
+    if (partial)
+    {
+        *resp->sortStatus = Z_SortResponse_partial_1;
+        resp->num_diagnostics = 1;
+        resp->diagnostics = (Z_DiagRec **)
+            odr_malloc(odr, sizeof(*resp->diagnostics));
+        resp->diagnostics[0] = zget_DiagRec(odr, downgrade_diag,
+                                            "query over cost limit");
+    }
+    return apdu_res;
+}
+
+// a downgraded query gives a subset, with diagnostic 32 in place of
+// piggybacked records
 Z_APDU *yf::SPARQL::Session::search(mp::Package &package,
                                     Z_APDU *apdu_req,
                                     mp::odr &odr,
                                     const char *sparql_query,
-                                    ConfPtr conf, FrontendSetPtr fset)
+                                    ConfPtr conf, FrontendSetPtr fset,
+                                    bool downgraded, Trace &trace)
 {
     Z_SearchRequest *req = apdu_req->u.searchRequest;
     Z_APDU *apdu_res = 0;
     mp::wrbuf w;
 
-    package.log("sparql", YLOG_LOG,
+    package.log("sparql", m_sparql->m_query_log_level,
         "search query:\n%s", sparql_query );
 
-    int error = invoke_sparql(package, sparql_query, conf, w);
+    int error = invoke_sparql(package, sparql_query, conf, w, trace);
     if (error)
     {
         apdu_res = odr.create_searchResponse(apdu_req, error,
@@ -807,7 +2158,11 @@ Z_APDU *yf::SPARQL::Session::search(mp::Package &package,
     }
     else
     {
+        long long t0 = monotonic_usec();
         xmlDocPtr doc = xmlParseMemory(w.c_str(), w.len());
+        long long t = monotonic_usec() - t0;
+        conf->metrics->parse.record(t);
+        trace.add(Trace::PARSE, t);
         if (!doc)
         {
             apdu_res = odr.create_searchResponse(
@@ -826,18 +2181,28 @@ Z_APDU *yf::SPARQL::Session::search(mp::Package &package,
 
             result.doc = doc;
             result.conf = conf;
+            result.size = w.len();
             fset->results.push_back(result);
             yaz_log(YLOG_DEBUG, "saving sparql result xmldoc=%p", doc);
 
+            t0 = monotonic_usec();
             get_result(result.doc, &fset->hits, -1, 0);
-            m_frontend_sets[req->resultSetName] = fset;
+            trace.add(Trace::RESULT, monotonic_usec() - t0);
+            conf->metrics->hits.add(fset->hits);
+            if (conf->learn)
+            {
+                boost::unique_lock<boost::shared_mutex>
+                    lock(conf->learn_mutex);
+                yaz_sparql_observe_hits(conf->s, req->query->u.type_1,
+                                        fset->hits);
+            }
 
             result.doc = 0;
 
             Odr_int number = 0;
             const char *element_set_name = 0;
             mp::util::piggyback_sr(req, fset->hits, number, &element_set_name);
-            if (number)
+            if (number && !downgraded)
             {
                 Z_ElementSetNames *esn;
 
@@ -850,7 +2215,7 @@ Z_APDU *yf::SPARQL::Session::search(mp::Package &package,
                                 1, number,
                                 error_code, addinfo,
                                 &number_returned,
-                                &next_position);
+                                &next_position, trace);
             }
             if (error_code)
             {
@@ -867,13 +2232,25 @@ Z_APDU *yf::SPARQL::Session::search(mp::Package &package,
                 *resp->numberOfRecordsReturned = number_returned;
                 *resp->nextResultSetPosition = next_position;
                 resp->records = records;
+                if (downgraded)
+                {
+                    resp->resultSetStatus =
+                        odr_intdup(odr, Z_SearchResponse_subset);
+                    resp->records = (Z_Records *)
+                        odr_malloc(odr, sizeof(Z_Records));
+                    resp->records->which = Z_Records_NSD;
+                    resp->records->u.nonSurrogateDiagnostic =
+                        zget_DefaultDiagFormat(odr, downgrade_diag,
+                                               "query over cost limit");
+                }
             }
         }
     }
     return apdu_res;
 }
 
-void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
+void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req,
+                                   Trace &trace)
 {
     mp::odr odr;
     Z_APDU *apdu_res = 0;
@@ -889,7 +2266,7 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
         int i;
         static const int masks[] = {
             Z_Options_search, Z_Options_present,
-            Z_Options_namedResultSets, -1
+            Z_Options_namedResultSets, Z_Options_sort, -1
         };
         for (i = 0; masks[i] != -1; i++)
             if (ODR_MASK_GET(req->options, masks[i]))
@@ -918,25 +2295,18 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
     {
         Z_SearchRequest *req = apdu_req->u.searchRequest;
 
-        FrontendSets::iterator fset_it =
-            m_frontend_sets.find(req->resultSetName);
-        if (fset_it != m_frontend_sets.end())
+        FrontendSetPtr old_set = get_set(req->resultSetName);
+        // result set already exist: with the replace indicator off, it
+        // is kept and the search is not run
+        if (old_set && *req->replaceIndicator)
+            replace_set(req->resultSetName, old_set, FrontendSetPtr());
+        if (old_set && *req->replaceIndicator == 0)
         {
-            // result set already exist
-            // if replace indicator is off: we return diagnostic if
-            // result set already exist.
-            if (*req->replaceIndicator == 0)
-            {
-                Z_APDU *apdu =
-                    odr.create_searchResponse(
-                        apdu_req,
-                        YAZ_BIB1_RESULT_SET_EXISTS_AND_REPLACE_INDICATOR_OFF,
-                        0);
-                package.response() = apdu;
-            }
-            m_frontend_sets.erase(fset_it);
+            apdu_res = odr.create_searchResponse(
+                apdu_req,
+                YAZ_BIB1_RESULT_SET_EXISTS_AND_REPLACE_INDICATOR_OFF, 0);
         }
-        if (req->query->which != Z_Query_type_1)
+        else if (req->query->which != Z_Query_type_1)
         {
             apdu_res = odr.create_searchResponse(
                 apdu_req, YAZ_BIB1_QUERY_TYPE_UNSUPP, 0);
@@ -952,22 +2322,46 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
             std::string db = req->databaseNames[0];
             std::list<ConfPtr>::const_iterator it;
             FrontendSetPtr fset(new FrontendSet);
+            // presents of the set wait until the search is done
+            boost::unique_lock<boost::shared_mutex> fset_lock(fset->m_mutex);
 
-            m_frontend_sets.erase(req->resultSetName);
+            {
+                boost::mutex::scoped_lock lock(m_sets_mutex);
+                m_frontend_sets[req->resultSetName] = fset;
+            }
             fset->db = db;
+            trace.set_query(db, req->query->u.type_1);
             if ( db != "info" )
             {
-                it = m_sparql->db_conf.begin();
-                for (; it != m_sparql->db_conf.end(); it++)
+                fset->query = yaz_clone_z_RPNQuery(req->query->u.type_1,
+                                                   fset->nmem);
+                // buffers are reused for each matching db
+                mp::wrbuf addinfo_wr;
+                mp::wrbuf sparql_wr;
+                // a reload meanwhile does not change the dbs searched
+                DbsPtr dbs = m_sparql->get_dbs();
+                it = dbs->confs.begin();
+                for (; it != dbs->confs.end(); it++)
                     if ((*it)->schema.length() > 0
                         && yaz_match_glob((*it)->db.c_str(), db.c_str()))
                     {
-                        mp::wrbuf addinfo_wr;
-                        mp::wrbuf sparql_wr;
-                        int error =
-                            yaz_sparql_from_rpn_wrbuf((*it)->s,
-                                                    addinfo_wr, sparql_wr,
-                                                    req->query->u.type_1);
+                        int error, downgraded = 0;
+                        long long t0 = monotonic_usec();
+                        wrbuf_rewind(addinfo_wr);
+                        wrbuf_rewind(sparql_wr);
+                        (*it)->metrics->searches.add(1);
+                        {
+                            boost::shared_lock<boost::shared_mutex>
+                                lock((*it)->learn_mutex, boost::defer_lock);
+                            if ((*it)->learn)
+                                lock.lock();
+                            error = yaz_sparql_from_rpn_sort_wrbuf(
+                                (*it)->s, addinfo_wr, sparql_wr,
+                                req->query->u.type_1, 0, &downgraded);
+                        }
+                        long long t = monotonic_usec() - t0;
+                        (*it)->metrics->translate.record(t);
+                        trace.add(Trace::TRANSLATE, t);
                         if (error)
                         {
                             apdu_res = odr.create_searchResponse(
@@ -978,7 +2372,8 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
                         {
                             Z_APDU *apdu_1 = search(package, apdu_req, odr,
                                                     sparql_wr.c_str(), *it,
-                                                    fset);
+                                                    fset, downgraded != 0,
+                                                    trace);
                             if (!apdu_res)
                                 apdu_res = apdu_1;
                         }
@@ -988,6 +2383,9 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
                     apdu_res = odr.create_searchResponse(
                         apdu_req, YAZ_BIB1_DATABASE_DOES_NOT_EXIST, db.c_str());
                 }
+                // a set exists only if a backend returned a result
+                if (fset->results.empty())
+                    replace_set(req->resultSetName, fset, FrontendSetPtr());
             }
             else
             { // The magic "explain" base
@@ -1002,12 +2400,15 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
             }
         }
     }
+    else if (apdu_req->which == Z_APDU_sortRequest)
+    {
+        apdu_res = sort(package, apdu_req, odr, trace);
+    }
     else if (apdu_req->which == Z_APDU_presentRequest)
     {
         Z_PresentRequest *req = apdu_req->u.presentRequest;
-        FrontendSets::iterator fset_it =
-            m_frontend_sets.find(req->resultSetId);
-        if (fset_it == m_frontend_sets.end())
+        FrontendSetPtr fset = get_set(req->resultSetId);
+        if (!fset)
         {
             apdu_res =
                 odr.create_presentResponse(
@@ -1037,10 +2438,12 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
             }
         }
         Z_Records *records;
-        if ( fset_it->second->explaindblist.size() > 0 )
+        boost::shared_lock<boost::shared_mutex> fset_lock(fset->m_mutex);
+        trace.set_query(fset->db, 0);
+        if ( fset->explaindblist.size() > 0 )
             records = explain_fetch(
                 package,
-                fset_it->second,
+                fset,
                 odr, req->preferredRecordSyntax, esn,
                 *req->resultSetStartPoint, *req->numberOfRecordsRequested,
                 error_code, addinfo,
@@ -1049,12 +2452,12 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
         else
             records = fetch(
                 package,
-                fset_it->second,
+                fset,
                 odr, req->preferredRecordSyntax, esn,
                 *req->resultSetStartPoint, *req->numberOfRecordsRequested,
                 error_code, addinfo,
                 &number_returned,
-                &next_position);
+                &next_position, trace);
         if (error_code)
         {
             apdu_res =
@@ -1080,20 +2483,222 @@ void yf::SPARQL::Session::handle_z(mp::Package &package, Z_APDU *apdu_req)
     }
 
     assert(apdu_res);
+    trace.set_response(apdu_res);
     package.response() = apdu_res;
 }
 
+static void metric_label(WRBUF w, const std::string &db)
+{
+    size_t i;
+
+    wrbuf_puts(w, "db=\"");
+    for (i = 0; i < db.length(); i++)
+        if (db[i] == '\\' || db[i] == '"')
+        {
+            wrbuf_putc(w, '\\');
+            wrbuf_putc(w, db[i]);
+        }
+        else if (db[i] == '\n')
+            wrbuf_puts(w, "\\n");
+        else
+            wrbuf_putc(w, db[i]);
+    wrbuf_puts(w, "\"");
+}
+
+// answers an HTTP GET for m_metrics_path with the metrics of all dbs
+bool yf::SPARQL::metrics(mp::Package &package) const
+{
+    Z_GDU *gdu = package.request().get();
+
+    if (!m_metrics_path.length() || !gdu ||
+        gdu->which != Z_GDU_HTTP_Request)
+        return false;
+    Z_HTTP_Request *req = gdu->u.HTTP_Request;
+    size_t len = strcspn(req->path, "?");
+    if (strcmp(req->method, "GET") || len != m_metrics_path.length() ||
+        memcmp(req->path, m_metrics_path.c_str(), len))
+        return false;
+
+    static const struct {
+        const char *name;
+        const char *help;
+        MetricCounter Metrics::*counter;
+    } counters[] = {
+        { "sparql_searches_total", "Searches sent to the backend",
+          &Metrics::searches },
+        { "sparql_presents_total", "Presents of records",
+          &Metrics::presents },
+        { "sparql_uri_lookups_total", "URI lookups sent to the backend",
+          &Metrics::lookups },
+        { "sparql_hits_total", "Hits of searches", &Metrics::hits },
+        { "sparql_backend_errors_total",
+          "Backend requests without a successful response",
+          &Metrics::backend_errors },
+        { "sparql_backend_received_bytes_total",
+          "Bytes of backend responses", &Metrics::bytes },
+        { 0, 0, 0 }
+    };
+    static const struct {
+        const char *name;
+        const char *help;
+        LatencyHistogram Metrics::*histogram;
+    } histograms[] = {
+        { "sparql_translate_seconds", "Translation of RPN to SPARQL",
+          &Metrics::translate },
+        { "sparql_backend_seconds", "Round trip of backend requests",
+          &Metrics::backend },
+        { "sparql_parse_seconds", "Parsing of backend responses",
+          &Metrics::parse },
+        { "sparql_records_seconds",
+          "Assembly of the records of a present, with URI lookups",
+          &Metrics::records },
+        { 0, 0, 0 }
+    };
+    mp::wrbuf w;
+    mp::wrbuf label;
+    DbsPtr dbs = get_dbs();
+    std::list<ConfPtr>::const_iterator it;
+    int i;
+
+    for (i = 0; counters[i].name; i++)
+    {
+        wrbuf_printf(w, "# HELP %s %s\n# TYPE %s counter\n",
+                     counters[i].name, counters[i].help, counters[i].name);
+        for (it = dbs->confs.begin(); it != dbs->confs.end(); it++)
+        {
+            wrbuf_rewind(label);
+            metric_label(label, (*it)->db);
+            wrbuf_printf(w, "%s{%s} %llu\n", counters[i].name,
+                         label.c_str(),
+                         ((*(*it)->metrics).*counters[i].counter).get());
+        }
+    }
+    for (i = 0; histograms[i].name; i++)
+    {
+        wrbuf_printf(w, "# HELP %s %s\n# TYPE %s histogram\n",
+                     histograms[i].name, histograms[i].help,
+                     histograms[i].name);
+        for (it = dbs->confs.begin(); it != dbs->confs.end(); it++)
+        {
+            const LatencyHistogram &h =
+                (*(*it)->metrics).*histograms[i].histogram;
+            if (h.count() == 0)
+                continue; // databases not used yet are left out
+            wrbuf_rewind(label);
+            metric_label(label, (*it)->db);
+            h.render(
+                w, histograms[i].name, label.c_str());
+        }
+    }
+    {
+        boost::mutex::scoped_lock lock(m_p->m_reaper_mutex);
+        wrbuf_printf(w, "# HELP sparql_reaped_sessions_total"
+                     " Idle sessions removed\n"
+                     "# TYPE sparql_reaped_sessions_total counter\n"
+                     "sparql_reaped_sessions_total " ODR_INT_PRINTF "\n",
+                     m_p->m_reaped_sessions);
+        wrbuf_printf(w, "# HELP sparql_reaped_sets_total"
+                     " Idle result sets removed\n"
+                     "# TYPE sparql_reaped_sets_total counter\n"
+                     "sparql_reaped_sets_total " ODR_INT_PRINTF "\n",
+                     m_p->m_reaped_sets);
+    }
+    if (m_p->m_slow_log)
+        wrbuf_printf(w, "# HELP sparql_slowlog_dropped_total"
+                     " Slow-query log entries dropped as the writer"
+                     " fell behind\n"
+                     "# TYPE sparql_slowlog_dropped_total counter\n"
+                     "sparql_slowlog_dropped_total %llu\n",
+                     m_p->m_slow_log->dropped());
+    if (m_p->m_access_log)
+        wrbuf_printf(w, "# HELP sparql_accesslog_dropped_total"
+                     " Access log entries dropped as the writer"
+                     " fell behind\n"
+                     "# TYPE sparql_accesslog_dropped_total counter\n"
+                     "sparql_accesslog_dropped_total %llu\n",
+                     m_p->m_access_log->dropped());
+    if (m_p->m_reloader)
+    {
+        wrbuf_printf(w, "# HELP sparql_config_generation"
+                     " Generation of the db sections, from 1\n"
+                     "# TYPE sparql_config_generation gauge\n"
+                     "sparql_config_generation %d\n", dbs->generation);
+        wrbuf_printf(w, "# HELP sparql_config_reload_failures_total"
+                     " Reloads that kept the old generation\n"
+                     "# TYPE sparql_config_reload_failures_total counter\n"
+                     "sparql_config_reload_failures_total %llu\n",
+                     m_p->m_reload_failures.get());
+        wrbuf_printf(w, "# HELP sparql_config_reload_seconds"
+                     " Making and swapping in a generation\n"
+                     "# TYPE sparql_config_reload_seconds histogram\n");
+        m_p->m_reload_latency.render(w, "sparql_config_reload_seconds", "");
+    }
+    if (m_p->m_capture)
+        wrbuf_printf(w, "# HELP sparql_capture_dropped_total"
+                     " Requests left out of the capture file as the"
+                     " writer fell behind\n"
+                     "# TYPE sparql_capture_dropped_total counter\n"
+                     "sparql_capture_dropped_total %llu\n",
+                     m_p->m_capture->dropped());
+
+    mp::odr odr;
+    Z_GDU *gdu_res = odr.create_HTTP_Response(package.session(), req, 200);
+    Z_HTTP_Response *resp = gdu_res->u.HTTP_Response;
+    z_HTTP_header_set(odr, &resp->headers, "Content-Type",
+                      "text/plain; version=0.0.4");
+    resp->content_len = w.len();
+    resp->content_buf = (char *) odr_malloc(odr, w.len() + 1);
+    memcpy(resp->content_buf, w.c_str(), w.len() + 1);
+    package.response() = gdu_res;
+    return true;
+}
+
 void yf::SPARQL::process(mp::Package &package) const
 {
     Z_APDU *apdu;
-    SessionPtr p = get_session(package, &apdu);
+    bool exclusive;
+
+    if (metrics(package))
+        return;
+    SessionPtr p = get_session(package, &apdu, &exclusive);
     if (p && apdu)
     {
-        p->handle_z(package, apdu);
+        Trace trace(apdu->which == Z_APDU_searchRequest ? "search" :
+                    apdu->which == Z_APDU_presentRequest ? "present" :
+                    apdu->which == Z_APDU_sortRequest ? "sort" : "other",
+                    m_p->m_slow_log != 0 ||
+                    (m_p->m_access_fields & Trace::F_RPN),
+                    m_p->m_access_body);
+        if (m_p->m_capture)
+            trace.set_traffic(package.session().id(), apdu);
+        p->handle_z(package, apdu, trace);
+        trace.log(package);
+        // sampled uniformly from the top 53 bits
+        if (m_p->m_slow_log && trace.elapsed() >= m_p->m_slow_usec &&
+            (m_p->m_slow_sample >= 1.0 ||
+             (Trace::random64() >> 11) * (1.0 / 9007199254740992.0)
+             < m_p->m_slow_sample))
+        {
+            std::string entry;
+            trace.slow_entry(entry);
+            m_p->m_slow_log->write(entry);
+        }
+        if (m_p->m_access_log)
+        {
+            std::string entry;
+            trace.access_entry(entry, m_p->m_access_fields);
+            m_p->m_access_log->write(entry);
+        }
+        if (m_p->m_capture)
+        {
+            std::string entry;
+            if (trace.traffic_entry(entry))
+                m_p->m_capture->write(entry);
+        }
     }
     else
         package.move();
-    release_session(package);
+    release_session(package, p, exclusive);
 }
 
 static mp::filter::Base* filter_creator()
@@ -21,11 +21,23 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
 #define FILTER_SPARQL_HPP
 
 #include <metaproxy/filter.hpp>
+#include <libxml/tree.h>
 
 extern "C" {
     extern struct metaproxy_1_filter_struct metaproxy_1_filter_sparql;
 }
 
+namespace metaproxy_1 {
+    namespace filter {
+        // first sparql filter element with attribute id equal to id
+        // (any, if id is 0) in ptr, its siblings and their descendants;
+        // 0 if there is none. *matches is set to the number of such
+        // elements, so that callers can reject ambiguous files
+        const xmlNode *find_sparql_filter(const xmlNode *ptr,
+                                          const char *id, int *matches);
+    }
+}
+
 #endif
 /*
  * Local variables:
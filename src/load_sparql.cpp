@@ -0,0 +1,296 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Load generator: a fixed number of Z39.50 or SRU clients, each with a
+// connection of its own, run transactions for a number of seconds.
+// Modes are search (search only), present (search and present of the
+// first records) and lookup (present with an element set that makes the
+// filter look up each record by URI). Reports throughput, latency
+// percentiles and, with -P, the RSS of the metaproxy process.
+// Usage: load_sparql [-h host:port] [-d db] [-c clients] [-t seconds]
+//                    [-m search|present|lookup] [-r records]
+//                    [-e element-set] [-s] [-q query-file] [-P pid]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+#include <yaz/zoom.h>
+#include "metrics.hpp"
+
+namespace mp = metaproxy_1;
+
+static const char *pqf_queries[] = {
+    "@attr 1=bf.title war",
+    "@attr 1=bf.maintitle peace",
+    "@and @attr 1=bf.title war @attr 1=bf.maintitle peace",
+    "@or @attr 1=bf.title london @attr 1=bf.subtitle history",
+    0
+};
+
+static const char *cql_queries[] = {
+    "bf.title=war",
+    "bf.maintitle=peace",
+    "bf.title=war and bf.maintitle=peace",
+    "bf.title=london or bf.subtitle=history",
+    0
+};
+
+class Options {
+public:
+    std::string host;
+    std::string db;
+    std::string mode;
+    std::string esn;
+    int clients;
+    int seconds;
+    int records;
+    bool sru;
+    std::vector<std::string> queries;
+};
+
+class Client {
+public:
+    std::vector<double> latencies; // of each transaction, seconds
+    long errors;
+    Client() : errors(0) {}
+};
+
+static void client_run(const Options *opt, Client *cl, int n,
+                       long long deadline)
+{
+    ZOOM_options o = ZOOM_options_create();
+    ZOOM_options_set(o, "databaseName", opt->db.c_str());
+    ZOOM_options_set(o, "preferredRecordSyntax", "xml");
+    ZOOM_options_set(o, "elementSetName", opt->esn.c_str());
+    if (opt->sru)
+        ZOOM_options_set(o, "sru", "get");
+    ZOOM_connection c = ZOOM_connection_create(o);
+    const char *msg, *addinfo, *diagset;
+
+    ZOOM_connection_connect(c, opt->host.c_str(), 0);
+    if (ZOOM_connection_error(c, &msg, &addinfo))
+    {
+        fprintf(stderr, "load_sparql: %s: %s %s\n", opt->host.c_str(),
+                msg, addinfo ? addinfo : "");
+        cl->errors++;
+        ZOOM_connection_destroy(c);
+        ZOOM_options_destroy(o);
+        return;
+    }
+    while (mp::filter::monotonic_usec() < deadline)
+    {
+        const std::string &q = opt->queries[n++ % opt->queries.size()];
+        ZOOM_query zq = ZOOM_query_create();
+        if (opt->sru)
+            ZOOM_query_cql(zq, q.c_str());
+        else
+            ZOOM_query_prefix(zq, q.c_str());
+
+        long long t0 = mp::filter::monotonic_usec();
+        ZOOM_resultset r = ZOOM_connection_search(c, zq);
+        bool error = ZOOM_connection_error(c, &msg, &addinfo) != 0;
+        if (!error && opt->mode != "search")
+        {
+            size_t want = std::min((size_t) opt->records,
+                                   ZOOM_resultset_size(r));
+            std::vector<ZOOM_record> recs(want + 1);
+            ZOOM_resultset_records(r, &recs[0], 0, want);
+            error = ZOOM_connection_error(c, &msg, &addinfo) != 0;
+            size_t i;
+            for (i = 0; !error && i < want; i++)
+                if (!recs[i] || ZOOM_record_error(recs[i], &msg,
+                                                  &addinfo, &diagset))
+                    error = true;
+        }
+        cl->latencies.push_back((mp::filter::monotonic_usec() - t0) / 1e6);
+        if (error)
+            cl->errors++;
+        ZOOM_resultset_destroy(r);
+        ZOOM_query_destroy(zq);
+    }
+    ZOOM_connection_destroy(c);
+    ZOOM_options_destroy(o);
+}
+
+// VmRSS and VmHWM of pid in kB, from /proc
+static void rss(int pid, long *cur, long *peak)
+{
+    char path[40], line[200];
+    *cur = *peak = -1;
+    sprintf(path, "/proc/%d/status", pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (!strncmp(line, "VmRSS:", 6))
+            *cur = atol(line + 6);
+        else if (!strncmp(line, "VmHWM:", 6))
+            *peak = atol(line + 6);
+    }
+    fclose(f);
+}
+
+static double percentile(const std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0.0;
+    size_t i = (size_t) (p * (v.size() - 1) + 0.5);
+    return v[i];
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    const char *query_file = 0;
+    int pid = 0;
+    int c, i;
+
+    opt.host = "localhost:9000";
+    opt.db = "work";
+    opt.mode = "search";
+    opt.clients = 10;
+    opt.seconds = 10;
+    opt.records = 10;
+    opt.sru = false;
+    while ((c = getopt(argc, argv, "h:d:c:t:m:r:e:sq:P:")) != -1)
+        switch (c)
+        {
+        case 'h':
+            opt.host = optarg;
+            break;
+        case 'd':
+            opt.db = optarg;
+            break;
+        case 'c':
+            opt.clients = atoi(optarg);
+            break;
+        case 't':
+            opt.seconds = atoi(optarg);
+            break;
+        case 'm':
+            opt.mode = optarg;
+            break;
+        case 'r':
+            opt.records = atoi(optarg);
+            break;
+        case 'e':
+            opt.esn = optarg;
+            break;
+        case 's':
+            opt.sru = true;
+            break;
+        case 'q':
+            query_file = optarg;
+            break;
+        case 'P':
+            pid = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Usage: load_sparql [-h host:port] [-d db]"
+                    " [-c clients] [-t seconds]\n"
+                    "  [-m search|present|lookup] [-r records]"
+                    " [-e element-set] [-s] [-q query-file] [-P pid]\n");
+            return 1;
+        }
+    if (opt.mode != "search" && opt.mode != "present" &&
+        opt.mode != "lookup")
+    {
+        fprintf(stderr, "load_sparql: bad mode %s\n", opt.mode.c_str());
+        return 1;
+    }
+    if (opt.esn.empty())
+        opt.esn = opt.mode == "lookup" ? "BF-L" : "sparql-results";
+    if (opt.sru)
+        opt.host = "http://" + opt.host + "/" + opt.db;
+    if (query_file)
+    {
+        FILE *f = fopen(query_file, "r");
+        char line[1024];
+        if (!f)
+        {
+            perror(query_file);
+            return 1;
+        }
+        while (fgets(line, sizeof(line), f))
+        {
+            line[strcspn(line, "\r\n")] = '\0';
+            if (*line && *line != '#')
+                opt.queries.push_back(line);
+        }
+        fclose(f);
+    }
+    else
+        for (i = 0; pqf_queries[i]; i++)
+            opt.queries.push_back(opt.sru ? cql_queries[i] : pqf_queries[i]);
+    if (opt.queries.empty())
+    {
+        fprintf(stderr, "load_sparql: no queries\n");
+        return 1;
+    }
+
+    std::vector<Client> clients(opt.clients);
+    boost::thread_group group;
+    long long start = mp::filter::monotonic_usec();
+    long long deadline = start + opt.seconds * 1000000LL;
+    for (i = 0; i < opt.clients; i++)
+        group.create_thread(boost::bind(client_run, &opt, &clients[i], i,
+                                        deadline));
+    group.join_all();
+    double elapsed = (mp::filter::monotonic_usec() - start) / 1e6;
+
+    std::vector<double> all;
+    long errors = 0;
+    for (i = 0; i < opt.clients; i++)
+    {
+        all.insert(all.end(), clients[i].latencies.begin(),
+                   clients[i].latencies.end());
+        errors += clients[i].errors;
+    }
+    std::sort(all.begin(), all.end());
+    printf("load_sparql mode=%s protocol=%s db=%s clients=%d "
+           "transactions=%lu errors=%ld tps=%.1f "
+           "p50_ms=%.2f p90_ms=%.2f p99_ms=%.2f max_ms=%.2f",
+           opt.mode.c_str(), opt.sru ? "sru" : "z3950", opt.db.c_str(),
+           opt.clients, (unsigned long) all.size(), errors,
+           all.size() / elapsed, percentile(all, 0.5) * 1e3,
+           percentile(all, 0.9) * 1e3, percentile(all, 0.99) * 1e3,
+           all.empty() ? 0.0 : all.back() * 1e3);
+    if (pid)
+    {
+        long cur, peak;
+        rss(pid, &cur, &peak);
+        printf(" rss_kb=%ld peak_rss_kb=%ld", cur, peak);
+    }
+    printf("\n");
+    return errors && all.size() == (size_t) errors ? 1 : 0;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
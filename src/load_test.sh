@@ -0,0 +1,33 @@
+#!/bin/sh
+# End-to-end load test without a triplestore: mock_sparql serves canned
+# responses on the port of the bibframe config, metaproxy runs that config
+# and load_sparql drives it in each mode.
+# Usage: load_test.sh [seconds [clients]]
+# Environment: METAPROXY (binary), MOCK_OPTS (options of mock_sparql,
+# for example "-n 1000 -d 20 -e 0.01")
+SECONDS_PER_RUN=${1:-10}
+CLIENTS=${2:-10}
+SRC=`pwd`
+if test -z "$METAPROXY"; then
+    if test -x ../../metaproxy/src/metaproxy; then
+	METAPROXY=`cd ../../metaproxy/src && pwd`/metaproxy
+    else
+	METAPROXY=metaproxy
+    fi
+fi
+
+$SRC/mock_sparql -p 8890 $MOCK_OPTS &
+MOCK_PID=$!
+cd ../bibframe
+$METAPROXY -c config-sparql.xml -l $SRC/load_test.log &
+MP_PID=$!
+cd $SRC
+trap 'kill $MP_PID $MOCK_PID 2>/dev/null' EXIT INT TERM
+sleep 2
+
+STATUS=0
+for mode in search present lookup; do
+    ./load_sparql -m $mode -c $CLIENTS -t $SECONDS_PER_RUN -P $MP_PID || STATUS=1
+done
+./load_sparql -s -m present -c $CLIENTS -t $SECONDS_PER_RUN -P $MP_PID || STATUS=1
+exit $STATUS
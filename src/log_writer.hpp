@@ -0,0 +1,184 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Log file written by a thread of its own. Requests put their entries in
+// a bounded lock-free ring (D. Vyukov's MPMC queue), so that logging costs
+// them an atomic or two and never waits for the file
+#ifndef LOG_WRITER_HPP
+#define LOG_WRITER_HPP
+
+#include <stdio.h>
+#include <string>
+#include <boost/atomic.hpp>
+#include <boost/bind/bind.hpp>
+#include <boost/scoped_array.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+namespace metaproxy_1 {
+    namespace filter {
+        class LogWriter {
+        public:
+            // takes over file; at most max_queued entries (rounded up to
+            // a power of two) wait for it
+            LogWriter(FILE *file, size_t max_queued);
+            // writes the queued entries
+            ~LogWriter();
+            // queues entry, taking its contents; false if dropped
+            bool write(std::string &entry);
+            unsigned long long dropped() const;
+        private:
+            class Cell {
+            public:
+                boost::atomic<size_t> m_seq;
+                std::string m_entry;
+            };
+            bool take(std::string &entry);
+            void run();
+            FILE *m_file;
+            size_t m_mask;
+            boost::scoped_array<Cell> m_ring;
+            boost::atomic<size_t> m_head; // next cell to put
+            size_t m_tail; // next cell to take; writer thread only
+            boost::atomic<unsigned long long> m_dropped;
+            // the writer sleeps on m_cond when the ring is empty
+            boost::atomic<bool> m_sleeping;
+            boost::atomic<bool> m_stop;
+            boost::mutex m_mutex;
+            boost::condition m_cond;
+            boost::scoped_ptr<boost::thread> m_thread;
+        };
+
+        inline LogWriter::LogWriter(FILE *file, size_t max_queued) :
+            m_file(file), m_head(0), m_tail(0), m_dropped(0),
+            m_sleeping(false), m_stop(false)
+        {
+            size_t i, n = 2;
+            while (n < max_queued)
+                n *= 2;
+            m_mask = n - 1;
+            m_ring.reset(new Cell[n]);
+            for (i = 0; i < n; i++)
+                m_ring[i].m_seq.store(i, boost::memory_order_relaxed);
+            m_thread.reset(
+                new boost::thread(boost::bind(&LogWriter::run, this)));
+        }
+
+        inline LogWriter::~LogWriter()
+        {
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_stop = true;
+                m_cond.notify_all();
+            }
+            m_thread->join();
+            fclose(m_file);
+        }
+
+        inline bool LogWriter::write(std::string &entry)
+        {
+            size_t pos = m_head.load(boost::memory_order_relaxed);
+            Cell *c;
+            while (true)
+            {
+                c = &m_ring[pos & m_mask];
+                size_t seq = c->m_seq.load(boost::memory_order_acquire);
+                if (seq == pos)
+                {
+                    if (m_head.compare_exchange_weak(
+                            pos, pos + 1, boost::memory_order_relaxed))
+                        break;
+                }
+                else if ((long) (seq - pos) < 0)
+                {
+                    m_dropped.fetch_add(1, boost::memory_order_relaxed);
+                    return false;
+                }
+                else
+                    pos = m_head.load(boost::memory_order_relaxed);
+            }
+            c->m_entry.swap(entry);
+            c->m_seq.store(pos + 1, boost::memory_order_release);
+            // pairs with the fence in run: either the writer sees the
+            // entry or this sees it sleeping
+            boost::atomic_thread_fence(boost::memory_order_seq_cst);
+            if (m_sleeping.load(boost::memory_order_relaxed))
+            {
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_cond.notify_all();
+            }
+            return true;
+        }
+
+        inline bool LogWriter::take(std::string &entry)
+        {
+            Cell *c = &m_ring[m_tail & m_mask];
+            if (c->m_seq.load(boost::memory_order_acquire) != m_tail + 1)
+                return false;
+            entry.swap(c->m_entry);
+            c->m_entry.clear();
+            c->m_seq.store(m_tail + m_mask + 1, boost::memory_order_release);
+            m_tail++;
+            return true;
+        }
+
+        inline unsigned long long LogWriter::dropped() const
+        {
+            return m_dropped.load(boost::memory_order_relaxed);
+        }
+
+        inline void LogWriter::run()
+        {
+            std::string entry;
+            while (true)
+            {
+                bool written = false;
+                while (take(entry))
+                {
+                    fwrite(entry.data(), 1, entry.length(), m_file);
+                    written = true;
+                }
+                if (written)
+                    fflush(m_file);
+                boost::mutex::scoped_lock lock(m_mutex);
+                m_sleeping.store(true, boost::memory_order_relaxed);
+                boost::atomic_thread_fence(boost::memory_order_seq_cst);
+                Cell *c = &m_ring[m_tail & m_mask];
+                if (c->m_seq.load(boost::memory_order_acquire) != m_tail + 1)
+                {
+                    if (m_stop)
+                        break;
+                    m_cond.wait(lock);
+                }
+                m_sleeping.store(false, boost::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,126 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Counters and latency histograms, updated without locks and rendered
+// in the Prometheus text format
+#ifndef METRICS_HPP
+#define METRICS_HPP
+
+#include <time.h>
+#include <algorithm>
+#include <boost/atomic.hpp>
+#include <yaz/wrbuf.h>
+
+namespace metaproxy_1 {
+    namespace filter {
+        // microseconds of a monotonic clock
+        inline long long monotonic_usec()
+        {
+            struct timespec ts;
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+        }
+
+        class MetricCounter {
+        public:
+            MetricCounter() : m_v(0) {}
+            void add(unsigned long long n) {
+                m_v.fetch_add(n, boost::memory_order_relaxed);
+            }
+            unsigned long long get() const {
+                return m_v.load(boost::memory_order_relaxed);
+            }
+        private:
+            boost::atomic<unsigned long long> m_v;
+        };
+
+        // Log-linear buckets, as in HDR histograms: each power of two
+        // from 16 microseconds on is split in SUB buckets of equal width,
+        // at most 1/SUB of their lower bound. The upper bounds are 16, 18,
+        // 20, ... 30, 32, 36, ... microseconds up to 15/8 * 2^25, about
+        // 63 seconds. Only the bounds that are powers of two, 16
+        // microseconds to 2^25, about 33 seconds, are rendered
+        class LatencyHistogram {
+        public:
+            enum { SUB = 8, POWERS = 22, BUCKETS = SUB * POWERS };
+            LatencyHistogram() : m_sum(0), m_count(0) {
+                int i;
+                for (i = 0; i < BUCKETS; i++)
+                {
+                    long long base = 16LL << (i / SUB);
+                    m_bounds[i] = base + (i % SUB) * base / SUB;
+                    m_buckets[i] = 0;
+                }
+                m_overflow = 0;
+            }
+            void record(long long usec) {
+                int i = std::lower_bound(m_bounds, m_bounds + BUCKETS, usec)
+                    - m_bounds;
+                if (i < BUCKETS)
+                    m_buckets[i].fetch_add(1, boost::memory_order_relaxed);
+                else
+                    m_overflow.fetch_add(1, boost::memory_order_relaxed);
+                m_sum.fetch_add(usec, boost::memory_order_relaxed);
+                m_count.fetch_add(1, boost::memory_order_relaxed);
+            }
+            unsigned long long count() const {
+                return m_count.load(boost::memory_order_relaxed);
+            }
+            // series of histogram name; labels are "k=\"v\"" or empty
+            void render(WRBUF w, const char *name,
+                        const char *labels) const {
+                unsigned long long cum = 0;
+                const char *sep = *labels ? "," : "";
+                int i;
+                for (i = 0; i < BUCKETS; i++)
+                {
+                    unsigned long long n =
+                        m_buckets[i].load(boost::memory_order_relaxed);
+                    cum += n;
+                    if (i % SUB == 0)
+                        wrbuf_printf(w, "%s_bucket{%s%sle=\"%g\"} %llu\n",
+                                     name, labels, sep, m_bounds[i] / 1e6,
+                                     cum);
+                }
+                cum += m_overflow.load(boost::memory_order_relaxed);
+                wrbuf_printf(w, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                             name, labels, sep, cum);
+                wrbuf_printf(w, "%s_sum{%s} %g\n", name, labels,
+                             m_sum.load(boost::memory_order_relaxed) / 1e6);
+                wrbuf_printf(w, "%s_count{%s} %llu\n", name, labels,
+                             m_count.load(boost::memory_order_relaxed));
+            }
+        private:
+            long long m_bounds[BUCKETS]; // inclusive upper bounds
+            boost::atomic<unsigned long long> m_buckets[BUCKETS];
+            boost::atomic<unsigned long long> m_overflow;
+            boost::atomic<long long> m_sum;
+            boost::atomic<unsigned long long> m_count;
+        };
+    }
+}
+
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,286 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// SPARQL endpoint with canned responses, for load tests without a
+// triplestore. SELECT queries get hits solutions binding ?thing to a URI,
+// CONSTRUCT queries (URI lookups) get an RDF/XML description of the URI.
+// Usage: mock_sparql [-p port] [-n hits] [-d delay-ms] [-e error-rate]
+//                    [-f xml|json]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <string>
+#include <boost/bind/bind.hpp>
+#include <boost/thread/thread.hpp>
+
+static int hits = 100;
+static int delay_ms = 0;
+static double error_rate = 0.0;
+static bool json = false;
+
+static bool write_all(int fd, const std::string &buf)
+{
+    size_t off = 0;
+    while (off < buf.length())
+    {
+        ssize_t r = write(fd, buf.data() + off, buf.length() - off);
+        if (r <= 0)
+            return false;
+        off += r;
+    }
+    return true;
+}
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return 0;
+}
+
+// value of query in a form-urlencoded body
+static std::string form_query(const std::string &body)
+{
+    std::string q;
+    size_t pos = body.find("query=");
+    if (pos == std::string::npos)
+        return q;
+    for (pos += 6; pos < body.length() && body[pos] != '&'; pos++)
+        if (body[pos] == '+')
+            q += ' ';
+        else if (body[pos] == '%' && pos + 2 < body.length())
+        {
+            q += (char) (hex_value(body[pos + 1]) * 16 +
+                         hex_value(body[pos + 2]));
+            pos += 2;
+        }
+        else
+            q += body[pos];
+    return q;
+}
+
+// the URI of a lookup is the first <...> term that is not a prefix
+static std::string lookup_uri(const std::string &q)
+{
+    size_t pos = 0;
+    while ((pos = q.find('<', pos)) != std::string::npos)
+    {
+        size_t end = q.find('>', pos);
+        if (end == std::string::npos)
+            break;
+        size_t line = q.rfind('\n', pos);
+        line = line == std::string::npos ? 0 : line + 1;
+        if (strncasecmp(q.c_str() + line, "PREFIX", 6))
+            return q.substr(pos + 1, end - pos - 1);
+        pos = end;
+    }
+    return "http://example.org/thing/0";
+}
+
+static void select_response(std::string &content, std::string &type)
+{
+    char buf[200];
+    int i;
+
+    if (json)
+    {
+        type = "application/sparql-results+json";
+        content = "{\"head\":{\"vars\":[\"thing\"]},"
+            "\"results\":{\"bindings\":[";
+        for (i = 0; i < hits; i++)
+        {
+            sprintf(buf, "%s{\"thing\":{\"type\":\"uri\","
+                    "\"value\":\"http://example.org/thing/%d\"}}",
+                    i ? "," : "", i);
+            content += buf;
+        }
+        content += "]}}\n";
+        return;
+    }
+    type = "application/sparql-results+xml";
+    content = "<?xml version=\"1.0\"?>\n"
+        "<sparql xmlns=\"http://www.w3.org/2005/sparql-results#\">\n"
+        " <head><variable name=\"thing\"/></head>\n"
+        " <results distinct=\"false\" ordered=\"true\">\n";
+    for (i = 0; i < hits; i++)
+    {
+        sprintf(buf, "  <result><binding name=\"thing\">"
+                "<uri>http://example.org/thing/%d</uri>"
+                "</binding></result>\n", i);
+        content += buf;
+    }
+    content += " </results>\n</sparql>\n";
+}
+
+static void construct_response(const std::string &uri, std::string &content,
+                               std::string &type)
+{
+    type = "application/rdf+xml";
+    content = "<?xml version=\"1.0\"?>\n"
+        "<rdf:RDF xmlns:rdf=\"http://www.w3.org/1999/02/22-rdf-syntax-ns#\""
+        " xmlns:bf=\"http://bibframe.org/vocab/\">\n"
+        " <rdf:Description rdf:about=\"" + uri + "\">\n"
+        "  <rdf:type rdf:resource=\"http://bibframe.org/vocab/Work\"/>\n"
+        "  <bf:title>Title of " + uri + "</bf:title>\n"
+        "  <bf:creator rdf:resource=\"" + uri + "/creator\"/>\n"
+        " </rdf:Description>\n"
+        "</rdf:RDF>\n";
+}
+
+// answers the HTTP/1.1 requests of a connection until it is closed
+static void serve(int fd, unsigned seed)
+{
+    std::string in;
+    char buf[4096];
+
+    while (true)
+    {
+        size_t head_end;
+        while ((head_end = in.find("\r\n\r\n")) == std::string::npos)
+        {
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if (r <= 0)
+            {
+                close(fd);
+                return;
+            }
+            in.append(buf, r);
+        }
+        std::string head = in.substr(0, head_end + 2);
+        size_t length = 0;
+        const char *cl = strcasestr(head.c_str(), "\r\nContent-Length:");
+        if (cl)
+            length = strtoul(cl + 17, 0, 10);
+        bool keep_alive = !strcasestr(head.c_str(), "\r\nConnection: close");
+        while (in.length() < head_end + 4 + length)
+        {
+            ssize_t r = read(fd, buf, sizeof(buf));
+            if (r <= 0)
+            {
+                close(fd);
+                return;
+            }
+            in.append(buf, r);
+        }
+        std::string q = form_query(in.substr(head_end + 4, length));
+        in.erase(0, head_end + 4 + length);
+
+        if (delay_ms)
+            usleep(delay_ms * 1000);
+        std::string content, type, status = "200 OK";
+        if (error_rate > 0.0 && rand_r(&seed) < error_rate * RAND_MAX)
+        {
+            status = "500 Internal Server Error";
+            type = "text/plain";
+            content = "mock error\n";
+        }
+        else if (strcasestr(q.c_str(), "CONSTRUCT"))
+            construct_response(lookup_uri(q), content, type);
+        else
+            select_response(content, type);
+        sprintf(buf, "HTTP/1.1 %s\r\nContent-Type: %s\r\n"
+                "Content-Length: %lu\r\n%s\r\n", status.c_str(),
+                type.c_str(), (unsigned long) content.length(),
+                keep_alive ? "" : "Connection: close\r\n");
+        if (!write_all(fd, buf + content) || !keep_alive)
+        {
+            close(fd);
+            return;
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int port = 8890;
+    int c;
+
+    while ((c = getopt(argc, argv, "p:n:d:e:f:")) != -1)
+        switch (c)
+        {
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'n':
+            hits = atoi(optarg);
+            break;
+        case 'd':
+            delay_ms = atoi(optarg);
+            break;
+        case 'e':
+            error_rate = atof(optarg);
+            break;
+        case 'f':
+            json = !strcmp(optarg, "json");
+            break;
+        default:
+            fprintf(stderr, "Usage: mock_sparql [-p port] [-n hits]"
+                    " [-d delay-ms] [-e error-rate] [-f xml|json]\n");
+            return 1;
+        }
+    signal(SIGPIPE, SIG_IGN);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    if (bind(s, (struct sockaddr *) &addr, sizeof(addr)) || listen(s, 128))
+    {
+        perror("mock_sparql");
+        return 1;
+    }
+    printf("mock_sparql: port=%d hits=%d delay_ms=%d error_rate=%g "
+           "format=%s\n", port, hits, delay_ms, error_rate,
+           json ? "json" : "xml");
+    fflush(stdout);
+
+    unsigned seed = 1;
+    while (true)
+    {
+        int fd = accept(s, 0, 0);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        boost::thread t(boost::bind(serve, fd, seed++));
+        t.detach();
+    }
+    return 0;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,471 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Replay of a capture file, as written by the capture element of the
+// sparql filter. The captured Z39.50 requests are run through the sparql
+// filter of a config, in front of a stub backend that answers each SPARQL
+// query with the captured response after the captured latency (none with
+// -n). The requests of a session are replayed in order; sessions are
+// spread over threads. Reports CPU time, peak RSS and latency percentiles
+// of the replay next to those of the capture, and the number of requests
+// whose hit count or number of records differ from the capture. A config
+// with more than one sparql filter needs -i, the id of the one to use.
+// Usage: replay_sparql [-i id] [-j threads] [-n] config capture
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <algorithm>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#include <boost/bind/bind.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <metaproxy/package.hpp>
+#include <metaproxy/router_chain.hpp>
+#include <metaproxy/util.hpp>
+#include <yaz/srw.h>
+#include "metrics.hpp"
+#include "filter_sparql.hpp"
+
+#define REPLAY_FORMAT 1
+
+namespace mp = metaproxy_1;
+
+class Request {
+public:
+    long long start;
+    long long usec; // as captured
+    Odr_int hits; // -1 if not known
+    int records;
+    std::string apdu; // BER
+    const char *op;
+    long long replay_usec;
+    bool differs;
+};
+
+class Response {
+public:
+    int status; // 0 for no response
+    long long usec;
+    std::string content;
+};
+
+// answers the HTTP requests of the sparql filter from the capture
+class Backend : public mp::filter::Base {
+public:
+    Backend(bool delay) : m_delay(delay), m_misses(0) {}
+    void add(const std::string &sparql, Response &r);
+    void process(mp::Package &package) const;
+    unsigned long misses() const;
+private:
+    bool m_delay;
+    mutable boost::mutex m_mutex;
+    // by request content; a query sent more than once gets its
+    // responses in turn, and the last one after that
+    mutable std::map<std::string,std::deque<Response> > m_responses;
+    mutable unsigned long m_misses;
+};
+
+// the request content of a query, as made by SPARQL::invoke_sparql
+static std::string form_content(const std::string &sparql)
+{
+    mp::odr odr;
+    const char *names[2];
+    const char *values[1];
+    char *path = 0;
+
+    names[0] = "query";
+    names[1] = 0;
+    values[0] = sparql.c_str();
+    yaz_array_to_uri(&path, odr, (char **) names, (char **) values);
+    return path;
+}
+
+void Backend::add(const std::string &sparql, Response &r)
+{
+    std::deque<Response> &q = m_responses[form_content(sparql)];
+    q.push_back(Response());
+    q.back().status = r.status;
+    q.back().usec = r.usec;
+    q.back().content.swap(r.content);
+}
+
+unsigned long Backend::misses() const
+{
+    boost::mutex::scoped_lock lock(m_mutex);
+    return m_misses;
+}
+
+void Backend::process(mp::Package &package) const
+{
+    Z_GDU *gdu = package.request().get();
+
+    if (!gdu || gdu->which != Z_GDU_HTTP_Request)
+        return;
+    Z_HTTP_Request *req = gdu->u.HTTP_Request;
+    std::string key(req->content_buf ? req->content_buf : "",
+                    req->content_len);
+    Response r;
+    {
+        boost::mutex::scoped_lock lock(m_mutex);
+        std::map<std::string,std::deque<Response> >::iterator it =
+            m_responses.find(key);
+        if (it == m_responses.end())
+        {
+            m_misses++;
+            r.status = 404;
+            r.usec = 0;
+            r.content = "query not in capture\n";
+        }
+        else
+        {
+            r = it->second.front();
+            if (it->second.size() > 1)
+                it->second.pop_front();
+        }
+    }
+    if (m_delay && r.usec > 0)
+        usleep(r.usec);
+    if (!r.status)
+        return;
+    mp::odr odr;
+    Z_GDU *gdu_res = odr.create_HTTP_Response(package.session(), req,
+                                              r.status);
+    Z_HTTP_Response *resp = gdu_res->u.HTTP_Response;
+    resp->content_len = r.content.length();
+    resp->content_buf = (char *) odr_malloc(odr, r.content.length() + 1);
+    memcpy(resp->content_buf, r.content.c_str(), r.content.length() + 1);
+    package.response() = gdu_res;
+}
+
+static bool read_bytes(FILE *f, std::string &to, unsigned long len)
+{
+    to.resize(len);
+    if (len && fread(&to[0], 1, len, f) != len)
+        return false;
+    return getc(f) == '\n';
+}
+
+// requests by session, with the backend responses added to backend;
+// a truncated last entry is left out
+static bool load_capture(const char *fname,
+                         std::map<std::string,std::vector<Request> > &sessions,
+                         Backend &backend, size_t *nrequests)
+{
+    FILE *f = fopen(fname, "r");
+    char line[200];
+    int segment = 0;
+    Request *last = 0;
+
+    if (!f)
+    {
+        perror(fname);
+        return false;
+    }
+    *nrequests = 0;
+    while (fgets(line, sizeof(line), f))
+    {
+        unsigned long session, len, clen;
+        long long hits;
+        Request r;
+        Response b;
+        std::string sparql;
+
+        if (!strncmp(line, "capture ", 8))
+            segment++;
+        else if (sscanf(line, "request %lu %lld %lld %lld %d %lu",
+                        &session, &r.start, &r.usec, &hits, &r.records,
+                        &len) == 6)
+        {
+            if (!read_bytes(f, r.apdu, len))
+                break;
+            char key[60];
+            sprintf(key, "%d.%lu", segment, session);
+            r.hits = hits;
+            r.op = "other";
+            r.replay_usec = 0;
+            r.differs = false;
+            std::vector<Request> &v = sessions[key];
+            v.push_back(r);
+            last = &v.back();
+            (*nrequests)++;
+        }
+        else if (sscanf(line, "backend %d %lld %lu %lu", &b.status, &b.usec,
+                        &len, &clen) == 4 && last)
+        {
+            if (!read_bytes(f, sparql, len) ||
+                !read_bytes(f, b.content, clen))
+                break;
+            backend.add(sparql, b);
+        }
+        else
+        {
+            fprintf(stderr, "replay_sparql: %s: bad line: %s", fname, line);
+            fclose(f);
+            return false;
+        }
+    }
+    fclose(f);
+    return true;
+}
+
+static void outcome(Z_GDU *gdu, Odr_int *hits, int *records)
+{
+    *hits = -1;
+    *records = 0;
+    if (!gdu || gdu->which != Z_GDU_Z3950)
+        return;
+    Z_APDU *apdu = gdu->u.z3950;
+    if (apdu->which == Z_APDU_searchResponse)
+    {
+        *hits = *apdu->u.searchResponse->resultCount;
+        *records = (int) *apdu->u.searchResponse->numberOfRecordsReturned;
+    }
+    else if (apdu->which == Z_APDU_presentResponse)
+        *records = (int) *apdu->u.presentResponse->numberOfRecordsReturned;
+    else if (apdu->which == Z_APDU_sortResponse &&
+             apdu->u.sortResponse->resultCount)
+        *hits = *apdu->u.sortResponse->resultCount;
+}
+
+// the sessions are replayed one after the other, each then closed
+static void replay_run(const mp::RouterChain *router,
+                       std::vector<std::vector<Request> *> *sessions)
+{
+    size_t i, j;
+    mp::Origin origin;
+
+    for (i = 0; i < sessions->size(); i++)
+    {
+        std::vector<Request> &v = *(*sessions)[i];
+        mp::Session session;
+        for (j = 0; j < v.size(); j++)
+        {
+            Request &r = v[j];
+            mp::odr odr(ODR_DECODE);
+            Z_APDU *apdu = 0;
+            odr_setbuf(odr, (char *) r.apdu.data(), r.apdu.length(), 0);
+            if (!z_APDU(odr, &apdu, 0, 0))
+            {
+                r.differs = true;
+                continue;
+            }
+            r.op = apdu->which == Z_APDU_searchRequest ? "search" :
+                apdu->which == Z_APDU_presentRequest ? "present" :
+                apdu->which == Z_APDU_sortRequest ? "sort" : "other";
+
+            mp::Package package(session, origin);
+            package.router(*router);
+            package.request() = apdu;
+            long long t0 = mp::filter::monotonic_usec();
+            package.move();
+            r.replay_usec = mp::filter::monotonic_usec() - t0;
+
+            Odr_int hits;
+            int records;
+            outcome(package.response().get(), &hits, &records);
+            r.differs = hits != r.hits || records != r.records;
+        }
+        mp::Package package(session, origin);
+        package.session().close();
+        package.router(*router);
+        package.move();
+    }
+}
+
+static double percentile(const std::vector<double> &v, double p)
+{
+    if (v.empty())
+        return 0.0;
+    size_t i = (size_t) (p * (v.size() - 1) + 0.5);
+    return v[i];
+}
+
+static bool by_start(const Request &a, const Request &b)
+{
+    return a.start < b.start;
+}
+
+static long long cpu_usec()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000LL +
+        ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+int main(int argc, char **argv)
+{
+    int threads = 1;
+    bool delay = true;
+    const char *id = 0;
+    int c;
+    size_t i, j;
+
+    while ((c = getopt(argc, argv, "i:j:n")) != -1)
+        switch (c)
+        {
+        case 'i':
+            id = optarg;
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            break;
+        case 'n':
+            delay = false;
+            break;
+        default:
+            fprintf(stderr, "Usage: replay_sparql [-i id] [-j threads] [-n]"
+                    " config capture\n");
+            return 1;
+        }
+    if (argc - optind != 2 || threads < 1)
+    {
+        fprintf(stderr, "Usage: replay_sparql [-i id] [-j threads] [-n]"
+                " config capture\n");
+        return 1;
+    }
+    const char *config = argv[optind];
+    xmlDoc *doc = xmlParseFile(config);
+    int matches = 0;
+    xmlNode *filter = doc ? (xmlNode *)
+        mp::filter::find_sparql_filter(xmlDocGetRootElement(doc), id,
+                                       &matches) : 0;
+    if (!filter)
+    {
+        fprintf(stderr, "replay_sparql: %s: no sparql filter%s%s\n", config,
+                id ? " with id " : "", id ? id : "");
+        return 1;
+    }
+    if (matches > 1)
+    {
+        fprintf(stderr, "replay_sparql: %s: more than one sparql filter%s%s;"
+                " use -i\n", config, id ? " with id " : "", id ? id : "");
+        return 1;
+    }
+    // the replay is not captured again
+    xmlNode *n = filter->children;
+    while (n)
+    {
+        xmlNode *next = n->next;
+        if (n->type == XML_ELEMENT_NODE &&
+            !strcmp((const char *) n->name, "capture"))
+        {
+            xmlUnlinkNode(n);
+            xmlFreeNode(n);
+        }
+        n = next;
+    }
+
+    Backend backend(delay);
+    std::map<std::string,std::vector<Request> > sessions;
+    size_t nrequests;
+    if (!load_capture(argv[optind + 1], sessions, backend, &nrequests))
+        return 1;
+
+    std::string dir = config;
+    dir = dir.find('/') == std::string::npos ? "." :
+        dir.substr(0, dir.rfind('/'));
+    boost::scoped_ptr<mp::filter::Base> sparql(
+        metaproxy_1_filter_sparql.creator());
+    try
+    {
+        sparql->configure(filter, false, dir.c_str());
+    }
+    catch (std::exception &e)
+    {
+        fprintf(stderr, "replay_sparql: %s: %s\n", config, e.what());
+        return 1;
+    }
+    mp::RouterChain router;
+    router.append(*sparql);
+    router.append(backend);
+
+    std::vector<std::vector<std::vector<Request> *> > work(threads);
+    std::map<std::string,std::vector<Request> >::iterator it;
+    for (i = 0, it = sessions.begin(); it != sessions.end(); it++, i++)
+    {
+        std::stable_sort(it->second.begin(), it->second.end(), by_start);
+        work[i % threads].push_back(&it->second);
+    }
+    long long cpu0 = cpu_usec();
+    long long t0 = mp::filter::monotonic_usec();
+    boost::thread_group group;
+    for (i = 1; i < (size_t) threads; i++)
+        group.create_thread(boost::bind(replay_run, &router, &work[i]));
+    replay_run(&router, &work[0]);
+    group.join_all();
+    double elapsed = (mp::filter::monotonic_usec() - t0) / 1e6;
+    long long cpu = cpu_usec() - cpu0;
+
+    static const char *ops[] = { "search", "present", "sort", "other", 0 };
+    unsigned long differs = 0;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    for (c = 0; ops[c]; c++)
+    {
+        std::vector<double> captured, replayed;
+        for (it = sessions.begin(); it != sessions.end(); it++)
+            for (j = 0; j < it->second.size(); j++)
+            {
+                Request &r = it->second[j];
+                if (strcmp(r.op, ops[c]))
+                    continue;
+                captured.push_back(r.usec / 1e3);
+                replayed.push_back(r.replay_usec / 1e3);
+                if (r.differs)
+                    differs++;
+            }
+        if (captured.empty())
+            continue;
+        std::sort(captured.begin(), captured.end());
+        std::sort(replayed.begin(), replayed.end());
+        printf("replay_sparql format=%d op=%s requests=%lu "
+               "captured_p50_ms=%.2f captured_p99_ms=%.2f "
+               "replay_p50_ms=%.2f replay_p99_ms=%.2f\n",
+               REPLAY_FORMAT, ops[c], (unsigned long) captured.size(),
+               percentile(captured, 0.5), percentile(captured, 0.99),
+               percentile(replayed, 0.5), percentile(replayed, 0.99));
+    }
+    printf("replay_sparql format=%d requests=%lu sessions=%lu threads=%d "
+           "delay=%s elapsed_s=%.2f cpu_ms=%.1f cpu_us_per_request=%.1f "
+           "peak_rss_kb=%ld misses=%lu differs=%lu\n",
+           REPLAY_FORMAT, (unsigned long) nrequests,
+           (unsigned long) sessions.size(), threads, delay ? "yes" : "no",
+           elapsed, cpu / 1e3, nrequests ? (double) cpu / nrequests : 0.0,
+           ru.ru_maxrss, backend.misses(), differs);
+    sparql.reset();
+    xmlFreeDoc(doc);
+    return differs || backend.misses() ? 2 : 0;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -0,0 +1,191 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Sessions of a filter, shared by the packages of each session
+#ifndef SESSION_TABLE_HPP
+#define SESSION_TABLE_HPP
+
+#include <metaproxy/package.hpp>
+#include <time.h>
+#include <vector>
+#include <boost/shared_ptr.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition.hpp>
+
+namespace metaproxy_1 {
+    namespace filter {
+        // Sharded by session id, so that unrelated sessions rarely share
+        // a lock. A package waiting for its session waits on that
+        // session only and is not woken by releases of other sessions.
+        // A session is used by any number of shared users or by one
+        // exclusive user; waiting exclusive users go first.
+        template <class T> class SessionTable {
+        public:
+            typedef boost::shared_ptr<T> Ptr;
+            // session of key; waits while it is in use by others in a
+            // conflicting mode. If there is none, a new T(arg) is made,
+            // unless arg is 0
+            template <class A> Ptr acquire(const Session &key, A *arg,
+                                           bool exclusive);
+            // ends use of session p; it is removed if closed
+            void release(const Session &key, const Ptr &p, bool exclusive,
+                         bool closed);
+            // removes sessions unused since before, adding them to removed
+            void reap(time_t before, std::vector<Ptr> &removed);
+            // adds all sessions to v
+            void get_all(std::vector<Ptr> &v);
+        private:
+            class Entry {
+            public:
+                Entry(T *p, bool exclusive) : m_p(p), m_writer(exclusive),
+                    m_readers(exclusive ? 0 : 1), m_waiters(0),
+                    m_writers_waiting(0), m_last_use(time(0)) {}
+                Ptr m_p;
+                bool m_writer;
+                int m_readers;
+                int m_waiters;
+                int m_writers_waiting;
+                time_t m_last_use;
+                boost::condition m_ready;
+            };
+            typedef boost::shared_ptr<Entry> EntryPtr;
+            typedef boost::unordered_map<unsigned long, EntryPtr> Map;
+            class Shard {
+            public:
+                boost::mutex m_mutex;
+                Map m_map;
+            };
+            enum { SHARDS = 64 };
+            Shard m_shards[SHARDS];
+            Shard &shard(const Session &key) {
+                return m_shards[key.id() % SHARDS];
+            }
+        };
+
+        template <class T> template <class A>
+        typename SessionTable<T>::Ptr SessionTable<T>::acquire(
+            const Session &key, A *arg, bool exclusive)
+        {
+            Shard &s = shard(key);
+            boost::mutex::scoped_lock lock(s.m_mutex);
+
+            while (true)
+            {
+                typename Map::iterator it = s.m_map.find(key.id());
+                if (it == s.m_map.end())
+                    break;
+                EntryPtr e = it->second;
+                if (exclusive && !e->m_writer && !e->m_readers)
+                {
+                    e->m_writer = true;
+                    return e->m_p;
+                }
+                if (!exclusive && !e->m_writer && !e->m_writers_waiting)
+                {
+                    e->m_readers++;
+                    return e->m_p;
+                }
+                // e is kept, even if the session is removed meanwhile
+                e->m_waiters++;
+                if (exclusive)
+                    e->m_writers_waiting++;
+                e->m_ready.wait(lock);
+                if (exclusive)
+                    e->m_writers_waiting--;
+                e->m_waiters--;
+            }
+            if (!arg)
+                return Ptr();
+            EntryPtr e(new Entry(new T(arg), exclusive));
+            s.m_map[key.id()] = e;
+            return e->m_p;
+        }
+
+        template <class T>
+        void SessionTable<T>::release(const Session &key, const Ptr &p,
+                                      bool exclusive, bool closed)
+        {
+            Shard &s = shard(key);
+            boost::mutex::scoped_lock lock(s.m_mutex);
+            typename Map::iterator it = s.m_map.find(key.id());
+
+            // the session may have been closed and made anew meanwhile
+            if (it == s.m_map.end() || it->second->m_p != p)
+                return;
+            EntryPtr e = it->second;
+            if (exclusive)
+                e->m_writer = false;
+            else
+                e->m_readers--;
+            e->m_last_use = time(0);
+            if (closed)
+                s.m_map.erase(it);
+            if (e->m_waiters && (closed || !e->m_readers))
+                e->m_ready.notify_all();
+        }
+
+        template <class T>
+        void SessionTable<T>::reap(time_t before, std::vector<Ptr> &removed)
+        {
+            int i;
+            for (i = 0; i < SHARDS; i++)
+            {
+                Shard &s = m_shards[i];
+                boost::mutex::scoped_lock lock(s.m_mutex);
+                typename Map::iterator it = s.m_map.begin();
+                while (it != s.m_map.end())
+                {
+                    Entry &e = *it->second;
+                    if (!e.m_writer && !e.m_readers && !e.m_waiters &&
+                        e.m_last_use < before)
+                    {
+                        removed.push_back(e.m_p);
+                        it = s.m_map.erase(it);
+                    }
+                    else
+                        it++;
+                }
+            }
+        }
+
+        template <class T>
+        void SessionTable<T>::get_all(std::vector<Ptr> &v)
+        {
+            int i;
+            for (i = 0; i < SHARDS; i++)
+            {
+                Shard &s = m_shards[i];
+                boost::mutex::scoped_lock lock(s.m_mutex);
+                typename Map::iterator it = s.m_map.begin();
+                for (; it != s.m_map.end(); it++)
+                    v.push_back(it->second->m_p);
+            }
+        }
+    }
+}
+
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
@@ -4,22 +4,641 @@
  */
 
 #include <assert.h>
+#include <ctype.h>
+#include <stdio.h>
 #include <yaz/diagbib1.h>
+#include <yaz/xmalloc.h>
 #include <yaz/tokenizer.h>
+#include <yaz/log.h>
 #include "sparql.h"
 
+/* template operations; value is expanded by running these in order */
+enum sparql_op_type {
+    SPARQL_OP_LITERAL,   /* copy buf, len */
+    SPARQL_OP_STRING,    /* %s: term as quoted string */
+    SPARQL_OP_URI,       /* %u: term as <uri> */
+    SPARQL_OP_TERM,      /* %t: term verbatim, JSON escaped */
+    SPARQL_OP_RAW,       /* %d: term verbatim */
+    SPARQL_OP_VAR,       /* %v: ?v<no> */
+    SPARQL_OP_END
+};
+
+struct sparql_op {
+    enum sparql_op_type which;
+    const char *buf;
+    size_t len;
+};
+
 struct sparql_entry {
     char *pattern;
     char *value;
     struct sparql_entry *next;
+    struct sparql_entry *kind_next; /* next entry of same kind; variants */
+    struct sparql_op *prog;         /* compiled value; index/present/uri */
+    unsigned *binds;                /* bitset of variables in value */
+    int binds_words;
+    int opt_var;                    /* criteria.optional variable or -1 */
+    const char *index;              /* index name of index entries */
+    Odr_int relation;               /* variant for relation; 0 for any */
+    Odr_int truncation;             /* variant for truncation; 0 for any */
+    yaz_sparql_t vars;              /* numbering of binds and opt_var */
+    yaz_sparql_t owner;             /* entries of others are not modified */
+    yaz_sparql_t include;           /* included configuration or 0 */
+};
+
+/* criteria.optional entry with its variable in the numbering of user */
+struct sparql_ref {
+    struct sparql_entry *e;
+    int opt_var;
+    struct sparql_ref *next;
+};
+
+/* included configuration and its variables in the numbering of user */
+struct sparql_layer {
+    yaz_sparql_t u;
+    int *map;
+    struct sparql_layer *next;
+};
+
+struct sparql_hash_node {
+    const char *key;          /* string key; 0 for numeric key */
+    Odr_int num;              /* numeric key */
+    struct sparql_entry *e;
+    struct sparql_hash_node *next;
+};
+
+struct sparql_hash {
+    struct sparql_hash_node **buckets;
+    unsigned size;
+    unsigned count;
 };
 
 struct yaz_sparql_s {
     NMEM nmem;
     struct sparql_entry *conf;
     struct sparql_entry **last;
+    int errors;                       /* number of unknown patterns */
+    WRBUF prefix_buf;                 /* rendered PREFIX lines */
+    WRBUF form_buf;                   /* rendered form lines */
+    WRBUF criteria_buf;               /* rendered criteria lines */
+    WRBUF prologue;                   /* static query text up to WHERE body */
+    WRBUF epilogue;                   /* static query text after WHERE body */
+    WRBUF modifier_head;              /* modifiers before ORDER BY */
+    WRBUF order_buf;                  /* expressions of static ORDER BY */
+    WRBUF modifier_tail;              /* LIMIT and OFFSET modifiers */
+    WRBUF modifier_offset;            /* OFFSET modifiers alone */
+    Odr_int modifier_limit;           /* rows of LIMIT modifier; or -1 */
+    struct sparql_ref *optional;
+    struct sparql_ref **optional_last;
+    struct sparql_entry *schema;      /* first present.X or uri.X entry */
+    struct sparql_layer *layers;      /* all included, directly or not */
+    struct sparql_hash index_str;     /* index.X by X */
+    struct sparql_hash index_num;     /* index.N by numeric N */
+    struct sparql_hash sort_str;      /* sort.X by X */
+    struct sparql_hash sort_num;      /* sort.N by numeric N */
+    struct sparql_hash schema_str;    /* present.X, uri.X by X */
+    struct sparql_hash var_str;       /* variable name to number */
+    int num_vars;
+    struct sparql_hash selectivity;   /* index name to configured hits */
+    struct sparql_hash learned;       /* index name to observed hits */
+    int and_not_minus;                /* AND-NOT as MINUS, else FILTER */
+    struct sparql_hash cost;          /* index name to cost of a term */
+    Odr_int factor_unanchored;        /* cost factor for unanchored terms */
+    Odr_int limit_cost;               /* limits; 0 for none */
+    Odr_int limit_operands;
+    Odr_int limit_depth;
+    Odr_int limit_unanchored;
+    Odr_int limit_downgrade;          /* rows, if over cost limit; or 0 */
+    unsigned settings;                /* SPARQL_SET_ bits given explicitly */
+    int log_level;
 };
 
+#define SPARQL_SET_AND_NOT           1
+#define SPARQL_SET_FACTOR_UNANCHORED 2
+#define SPARQL_SET_LIMIT_COST        4
+#define SPARQL_SET_LIMIT_OPERANDS    8
+#define SPARQL_SET_LIMIT_DEPTH       16
+#define SPARQL_SET_LIMIT_UNANCHORED  32
+#define SPARQL_SET_LIMIT_DOWNGRADE   64
+
+struct sparql_cost {
+    Odr_int cost;
+    int operands;
+    int depth;                        /* of nested UNIONs */
+    int unanchored;                   /* terms truncated at the left */
+};
+
+/* node of a query, with the index entry of a term resolved */
+struct sparql_node {
+    Z_RPNStructure *q;
+    struct sparql_node *s1, *s2;      /* operands, if q is complex */
+    struct sparql_entry *e;           /* index of term; 0 if not found */
+    int error;                        /* of the index lookup */
+    Odr_int estimate;                 /* expected hits; or -1 */
+};
+
+#define SPARQL_VAR_WORDS(n) (((n) + 31) / 32)
+#define SPARQL_VAR_BIT 32
+
+static void hash_init(struct sparql_hash *h)
+{
+    h->buckets = 0;
+    h->size = 0;
+    h->count = 0;
+}
+
+static void hash_destroy(struct sparql_hash *h)
+{
+    xfree(h->buckets);
+}
+
+static unsigned hash_str(const char *key)
+{
+    unsigned v = 2166136261u;
+    for (; *key; key++)
+        v = (v ^ (unsigned char) *key) * 16777619u;
+    return v;
+}
+
+static unsigned hash_num(Odr_int num)
+{
+    return (unsigned) (num ^ (num >> 32)) * 2654435761u;
+}
+
+static void hash_grow(struct sparql_hash *h)
+{
+    unsigned i, size = h->size ? 2 * h->size : 32;
+    struct sparql_hash_node **buckets = (struct sparql_hash_node **)
+        xcalloc(size, sizeof(*buckets));
+
+    for (i = 0; i < h->size; i++)
+    {
+        struct sparql_hash_node *n = h->buckets[i];
+        while (n)
+        {
+            struct sparql_hash_node *n_next = n->next;
+            unsigned b = (n->key ? hash_str(n->key) : hash_num(n->num))
+                & (size - 1);
+            n->next = buckets[b];
+            buckets[b] = n;
+            n = n_next;
+        }
+    }
+    xfree(h->buckets);
+    h->buckets = buckets;
+    h->size = size;
+}
+
+static struct sparql_hash_node *hash_find(const struct sparql_hash *h,
+                                          const char *key, Odr_int num)
+{
+    struct sparql_hash_node *n;
+    if (!h->size)
+        return 0;
+    if (key)
+    {
+        for (n = h->buckets[hash_str(key) & (h->size - 1)]; n; n = n->next)
+            if (n->key && !strcmp(n->key, key))
+                return n;
+    }
+    else
+    {
+        for (n = h->buckets[hash_num(num) & (h->size - 1)]; n; n = n->next)
+            if (!n->key && n->num == num)
+                return n;
+    }
+    return 0;
+}
+
+static struct sparql_entry *hash_lookup_str(const struct sparql_hash *h,
+                                            const char *key)
+{
+    struct sparql_hash_node *n = hash_find(h, key, 0);
+    return n ? n->e : 0;
+}
+
+static struct sparql_entry *hash_lookup_num(const struct sparql_hash *h,
+                                            Odr_int num)
+{
+    struct sparql_hash_node *n = hash_find(h, 0, num);
+    return n ? n->e : 0;
+}
+
+/* adds key unless already present: first definition wins */
+static void hash_add(NMEM nmem, struct sparql_hash *h,
+                     const char *key, Odr_int num, struct sparql_entry *e)
+{
+    struct sparql_hash_node *n;
+    unsigned b;
+
+    if (hash_find(h, key, num))
+        return;
+    if (h->count >= h->size)
+        hash_grow(h);
+    b = (key ? hash_str(key) : hash_num(num)) & (h->size - 1);
+    n = (struct sparql_hash_node *) nmem_malloc(nmem, sizeof(*n));
+    n->key = key;
+    n->num = num;
+    n->e = e;
+    n->next = h->buckets[b];
+    h->buckets[b] = n;
+    h->count++;
+}
+
+/* adds all keys of src to dst, sharing keys and entries with src */
+static void hash_merge(NMEM nmem, struct sparql_hash *dst,
+                       const struct sparql_hash *src)
+{
+    unsigned i;
+    for (i = 0; i < src->size; i++)
+    {
+        struct sparql_hash_node *n = src->buckets[i];
+        for (; n; n = n->next)
+            hash_add(nmem, dst, n->key, n->num, n->e);
+    }
+}
+
+static int compile_op(struct sparql_op *prog, int n,
+                      enum sparql_op_type which, const char *buf, size_t len)
+{
+    if (prog)
+    {
+        prog[n].which = which;
+        prog[n].buf = buf;
+        prog[n].len = len;
+    }
+    return n + 1;
+}
+
+static int compile_value(struct sparql_op *prog, const char *value)
+{
+    const char *cp = value, *lit = value;
+    int n = 0;
+
+    while (*cp)
+    {
+        if (*cp != '%')
+        {
+            cp++;
+            continue;
+        }
+        if (cp > lit)
+            n = compile_op(prog, n, SPARQL_OP_LITERAL, lit, cp - lit);
+        switch (cp[1])
+        {
+        case 's':
+            n = compile_op(prog, n, SPARQL_OP_STRING, 0, 0);
+            break;
+        case 'u':
+            n = compile_op(prog, n, SPARQL_OP_URI, 0, 0);
+            break;
+        case 't':
+            n = compile_op(prog, n, SPARQL_OP_TERM, 0, 0);
+            break;
+        case 'd':
+            n = compile_op(prog, n, SPARQL_OP_RAW, 0, 0);
+            break;
+        case 'v':
+            n = compile_op(prog, n, SPARQL_OP_VAR, 0, 0);
+            break;
+        case '%':
+            n = compile_op(prog, n, SPARQL_OP_LITERAL, cp, 1);
+            break;
+        }
+        if (!cp[1])
+            break;
+        cp += 2;
+        lit = cp;
+    }
+    if (cp > lit)
+        n = compile_op(prog, n, SPARQL_OP_LITERAL, lit, cp - lit);
+    return compile_op(prog, n, SPARQL_OP_END, 0, 0);
+}
+
+static int var_char(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9') || c == '_';
+}
+
+/* returns number of variable, giving it a new number if not seen before */
+static int intern_var(yaz_sparql_t s, const char *name, size_t len)
+{
+    struct sparql_hash_node *n;
+    char *key = nmem_strdupn(s->nmem, name, len);
+
+    n = hash_find(&s->var_str, key, 0);
+    if (n)
+        return (int) n->num;
+    hash_add(s->nmem, &s->var_str, key, s->num_vars, 0);
+    return s->num_vars++;
+}
+
+/* variables in literal parts of e's program; sets bits if binds is given.
+   IRIs and quoted strings are skipped, also when a substitution splits
+   them; a < followed by = or by white space before any > is an operator,
+   as is a < that ends an op, unless %u follows */
+static int scan_vars(yaz_sparql_t s, struct sparql_entry *e, unsigned *binds)
+{
+    const struct sparql_op *op;
+    int max_var = -1;
+    char close = 0;
+
+    for (op = e->prog; op->which != SPARQL_OP_END; op++)
+    {
+        size_t i = 0;
+        if (op->which != SPARQL_OP_LITERAL)
+            continue;
+        while (i < op->len)
+        {
+            size_t j = i + 1;
+            int no;
+            if (close)
+            {
+                if (op->buf[i] == '\\' && close != '>')
+                    i++;
+                else if (op->buf[i] == close)
+                    close = 0;
+                i++;
+                continue;
+            }
+            if (op->buf[i] == '"' || op->buf[i] == '\'')
+            {
+                close = op->buf[i++];
+                continue;
+            }
+            if (op->buf[i] == '<')
+            {
+                while (j < op->len && !strchr(" \t\r\n>", op->buf[j]))
+                    j++;
+                if (j == i + 1 && j == op->len)
+                {
+                    if (op[1].which == SPARQL_OP_URI)
+                        close = '>';
+                }
+                else if ((j == op->len || op->buf[j] == '>') &&
+                         !(j > i + 1 && op->buf[i + 1] == '='))
+                    close = '>';
+                i++;
+                continue;
+            }
+            if (!strchr("$?", op->buf[i]))
+            {
+                i++;
+                continue;
+            }
+            while (j < op->len && var_char(op->buf[j]))
+                j++;
+            if (j == i + 1)
+            {
+                i++;
+                continue;
+            }
+            no = intern_var(s, op->buf + i + 1, j - i - 1);
+            if (no > max_var)
+                max_var = no;
+            if (binds)
+                binds[no / SPARQL_VAR_BIT] |= 1U << (no % SPARQL_VAR_BIT);
+            i = j;
+        }
+        /* an IRI goes on only into a substitution that can be part of it */
+        if (close == '>' && op[1].which != SPARQL_OP_URI &&
+            op[1].which != SPARQL_OP_TERM && op[1].which != SPARQL_OP_RAW)
+            close = 0;
+    }
+    return max_var;
+}
+
+/* compiles value of e: the program and the variables it binds */
+static void compile_entry(yaz_sparql_t s, struct sparql_entry *e)
+{
+    int n = compile_value(0, e->value);
+
+    e->prog = (struct sparql_op *) nmem_malloc(s->nmem, n * sizeof(*e->prog));
+    compile_value(e->prog, e->value);
+    e->binds_words = SPARQL_VAR_WORDS(scan_vars(s, e, 0) + 1);
+    if (e->binds_words)
+    {
+        e->binds = (unsigned *)
+            nmem_malloc(s->nmem, e->binds_words * sizeof(*e->binds));
+        memset(e->binds, 0, e->binds_words * sizeof(*e->binds));
+        scan_vars(s, e, e->binds);
+    }
+}
+
+/* the variable that a criteria.optional value ends with */
+static void compile_optional(yaz_sparql_t s, struct sparql_entry *e)
+{
+    size_t i = strlen(e->value), j;
+
+    while (i > 0 && strchr(" \t\r\n\f", e->value[i-1]))
+        --i;
+    j = i;
+    while (i > 0 && !strchr("$?", e->value[i-1]))
+        --i;
+    if (i > 0 && j > i)
+        e->opt_var = intern_var(s, e->value + i, j - i);
+}
+
+static void render_prefix(WRBUF w, const char *value)
+{
+    yaz_tok_cfg_t cfg = yaz_tok_cfg_create();
+    yaz_tok_parse_t p = yaz_tok_parse_buf(cfg, value);
+    int no = 0;
+
+    wrbuf_puts(w, "PREFIX");
+    while (1)
+    {
+        const char *tok_str;
+        int token = yaz_tok_move(p);
+        if (token != YAZ_TOK_STRING)
+            break;
+        wrbuf_puts(w, " ");
+
+        tok_str = yaz_tok_parse_string(p);
+        if (tok_str[0])
+        {
+            if (no > 0 && tok_str[0] != '<')
+                wrbuf_puts(w, "<");
+            wrbuf_puts(w, tok_str);
+            if (no > 0 && tok_str[strlen(tok_str)-1] != '>')
+                wrbuf_puts(w, ">");
+        }
+        no++;
+    }
+    wrbuf_puts(w, "\n");
+    yaz_tok_parse_destroy(p);
+    yaz_tok_cfg_destroy(cfg);
+}
+
+/* static part of RPN query up to and including the criteria */
+static void render_prologue(yaz_sparql_t s)
+{
+    wrbuf_rewind(s->prologue);
+    wrbuf_puts(s->prologue, wrbuf_cstr(s->prefix_buf));
+    wrbuf_puts(s->prologue, wrbuf_cstr(s->form_buf));
+    wrbuf_puts(s->prologue, "WHERE {\n");
+    wrbuf_puts(s->prologue, wrbuf_cstr(s->criteria_buf));
+    /* terminated here, so that queries only read the buffers */
+    wrbuf_cstr(s->prologue);
+}
+
+/* appends config buffer b to w; reads b only, for the query path */
+static void wrbuf_append(WRBUF w, WRBUF b)
+{
+    wrbuf_write(w, wrbuf_buf(b), wrbuf_len(b));
+}
+
+/* order expressions, then LIMIT/OFFSET, as the SPARQL grammar requires;
+   if downgraded, LIMIT is at most limit.downgrade */
+static void render_order(WRBUF w, yaz_sparql_t s, const char *keys,
+                         int downgrade)
+{
+    wrbuf_puts(w, "\n}\n");
+    wrbuf_append(w, s->modifier_head);
+    if (*keys || wrbuf_len(s->order_buf))
+    {
+        wrbuf_puts(w, "ORDER BY");
+        wrbuf_puts(w, keys);
+        wrbuf_append(w, s->order_buf);
+        wrbuf_puts(w, "\n");
+    }
+    if (downgrade)
+    {
+        Odr_int limit = s->limit_downgrade;
+
+        if (s->modifier_limit >= 0 && s->modifier_limit < limit)
+            limit = s->modifier_limit;
+        wrbuf_printf(w, "LIMIT " ODR_INT_PRINTF "\n", limit);
+        wrbuf_append(w, s->modifier_offset);
+    }
+    else
+        wrbuf_append(w, s->modifier_tail);
+}
+
+static void render_epilogue(yaz_sparql_t s)
+{
+    wrbuf_rewind(s->epilogue);
+    render_order(s->epilogue, s, "", 0);
+    wrbuf_cstr(s->epilogue);
+    /* terminated at config time, as the prologue buffers are */
+    wrbuf_cstr(s->modifier_head);
+    wrbuf_cstr(s->order_buf);
+    wrbuf_cstr(s->modifier_tail);
+    wrbuf_cstr(s->modifier_offset);
+}
+
+/* length of keyword at start of value, if it is there; 0 otherwise */
+static size_t modifier_keyword(const char *value, const char *keyword)
+{
+    size_t i;
+
+    for (i = 0; keyword[i]; i++)
+        if (toupper((unsigned char) value[i]) != keyword[i])
+            return 0;
+    if (value[i] && !isspace((unsigned char) value[i]))
+        return 0;
+    return i;
+}
+
+/* length of ORDER BY, LIMIT or OFFSET at start of value; 0 otherwise */
+static size_t modifier_clause(const char *value)
+{
+    size_t n;
+
+    if ((n = modifier_keyword(value, "ORDER")) != 0)
+    {
+        size_t m;
+        while (isspace((unsigned char) value[n]))
+            n++;
+        if ((m = modifier_keyword(value + n, "BY")) == 0)
+            return 0;
+        return n + m;
+    }
+    if ((n = modifier_keyword(value, "LIMIT")) != 0)
+        return n;
+    return modifier_keyword(value, "OFFSET");
+}
+
+/* start of the next ORDER BY, LIMIT or OFFSET clause in value, outside
+   quoted strings; the end of value if there is none */
+static const char *modifier_next(const char *value)
+{
+    const char *cp = value;
+    char close = 0;
+
+    for (; *cp; cp++)
+    {
+        if (close)
+        {
+            if (*cp == '\\' && cp[1])
+                cp++;
+            else if (*cp == close)
+                close = 0;
+        }
+        else if (*cp == '"' || *cp == '\'')
+            close = *cp;
+        else if ((cp == value || isspace((unsigned char) cp[-1]) ||
+                  cp[-1] == ')') && modifier_clause(cp))
+            break;
+    }
+    return cp;
+}
+
+/* appends buf, len without trailing white space, then a newline */
+static void modifier_line(WRBUF w, const char *buf, size_t len)
+{
+    while (len > 0 && isspace((unsigned char) buf[len - 1]))
+        len--;
+    wrbuf_write(w, buf, len);
+    wrbuf_puts(w, "\n");
+}
+
+/* files each clause of value: ORDER BY expressions, LIMIT and OFFSET
+   apart, so that they can be emitted in the order of the grammar */
+static void add_modifier(yaz_sparql_t s, const char *value)
+{
+    while (1)
+    {
+        const char *end;
+        size_t n;
+
+        while (isspace((unsigned char) *value))
+            value++;
+        if (!*value)
+            break;
+        n = modifier_clause(value);
+        end = modifier_next(value + n);
+        if (n == 0)
+            modifier_line(s->modifier_head, value, end - value);
+        else if (modifier_keyword(value, "LIMIT"))
+        {
+            Odr_int limit = odr_strtol(value + n, 0, 10);
+
+            /* kept if under limit.downgrade */
+            if (s->modifier_limit < 0 || limit < s->modifier_limit)
+                s->modifier_limit = limit;
+            modifier_line(s->modifier_tail, value, end - value);
+        }
+        else if (modifier_keyword(value, "OFFSET"))
+        {
+            modifier_line(s->modifier_tail, value, end - value);
+            modifier_line(s->modifier_offset, value, end - value);
+        }
+        else
+        {
+            const char *cp = value + n, *cp_end = end;
+            while (isspace((unsigned char) *cp))
+                cp++;
+            while (cp_end > cp && isspace((unsigned char) cp_end[-1]))
+                cp_end--;
+            wrbuf_puts(s->order_buf, " ");
+            wrbuf_write(s->order_buf, cp, cp_end - cp);
+        }
+        value = end;
+    }
+}
+
 yaz_sparql_t yaz_sparql_create(void)
 {
     NMEM nmem = nmem_create();
@@ -28,20 +647,394 @@ yaz_sparql_t yaz_sparql_create(void)
     s->nmem = nmem;
     s->conf = 0;
     s->last = &s->conf;
+    s->errors = 0;
+    s->prefix_buf = wrbuf_alloc();
+    s->form_buf = wrbuf_alloc();
+    s->criteria_buf = wrbuf_alloc();
+    s->prologue = wrbuf_alloc();
+    s->epilogue = wrbuf_alloc();
+    s->modifier_head = wrbuf_alloc();
+    s->order_buf = wrbuf_alloc();
+    s->modifier_tail = wrbuf_alloc();
+    s->modifier_offset = wrbuf_alloc();
+    s->modifier_limit = -1;
+    s->optional = 0;
+    s->optional_last = &s->optional;
+    render_prologue(s);
+    render_epilogue(s);
+    s->schema = 0;
+    s->layers = 0;
+    hash_init(&s->index_str);
+    hash_init(&s->index_num);
+    hash_init(&s->sort_str);
+    hash_init(&s->sort_num);
+    hash_init(&s->schema_str);
+    hash_init(&s->var_str);
+    s->num_vars = 0;
+    hash_init(&s->selectivity);
+    hash_init(&s->learned);
+    s->and_not_minus = 0;
+    hash_init(&s->cost);
+    s->factor_unanchored = 10;
+    s->limit_cost = 0;
+    s->limit_operands = 0;
+    s->limit_depth = 0;
+    s->limit_unanchored = 0;
+    s->limit_downgrade = 0;
+    s->settings = 0;
+    s->log_level = yaz_log_module_level("sparql");
     return s;
 }
 
 void yaz_sparql_destroy(yaz_sparql_t s)
 {
     if (s)
+    {
+        hash_destroy(&s->index_str);
+        hash_destroy(&s->index_num);
+        hash_destroy(&s->sort_str);
+        hash_destroy(&s->sort_num);
+        hash_destroy(&s->schema_str);
+        hash_destroy(&s->var_str);
+        hash_destroy(&s->selectivity);
+        hash_destroy(&s->learned);
+        hash_destroy(&s->cost);
+        wrbuf_destroy(s->prefix_buf);
+        wrbuf_destroy(s->form_buf);
+        wrbuf_destroy(s->criteria_buf);
+        wrbuf_destroy(s->prologue);
+        wrbuf_destroy(s->epilogue);
+        wrbuf_destroy(s->modifier_head);
+        wrbuf_destroy(s->order_buf);
+        wrbuf_destroy(s->modifier_tail);
+        wrbuf_destroy(s->modifier_offset);
         nmem_destroy(s->nmem);
+    }
+}
+
+/* e itself if owned by s; otherwise a copy owned by s */
+static struct sparql_entry *entry_own(yaz_sparql_t s, struct sparql_entry *e)
+{
+    struct sparql_entry *c;
+
+    if (e->owner == s)
+        return e;
+    c = (struct sparql_entry *) nmem_malloc(s->nmem, sizeof(*c));
+    *c = *e;
+    c->owner = s;
+    return c;
+}
+
+/* appends variants v, v->kind_next, .. to those of base owned by s */
+static void variants_append(yaz_sparql_t s, struct sparql_entry *base,
+                            struct sparql_entry *v)
+{
+    struct sparql_entry **vp = &base->kind_next;
+
+    for (; *vp; vp = &(*vp)->kind_next)
+        *vp = entry_own(s, *vp);
+    while (v)
+    {
+        struct sparql_entry *c = entry_own(s, v);
+
+        v = v->kind_next;
+        c->kind_next = 0;
+        *vp = c;
+        vp = &c->kind_next;
+    }
+}
+
+/* index entry for a, then b: a real entry replaces a placeholder and
+   variants of b follow those of a */
+static struct sparql_entry *index_merge(yaz_sparql_t s, struct sparql_entry *a,
+                                        struct sparql_entry *b)
+{
+    struct sparql_entry *base, *v = b->kind_next;
+
+    if (a->prog || !b->prog)
+    {
+        if (!v)
+            return a;
+        base = entry_own(s, a);
+    }
+    else
+    {
+        base = entry_own(s, b);
+        base->kind_next = a->kind_next;
+    }
+    variants_append(s, base, v);
+    return base;
+}
+
+/* e replaces old as index entry for e->index */
+static void index_replace(yaz_sparql_t s, struct sparql_entry *old,
+                          struct sparql_entry *e)
+{
+    char *end = 0;
+    Odr_int w = odr_strtol(e->index, &end, 10);
+    struct sparql_hash_node *n = hash_find(&s->index_str, e->index, 0);
+
+    if (n && n->e == old)
+        n->e = e;
+    if (end && *end == '\0' && (n = hash_find(&s->index_num, 0, w)) &&
+        n->e == old)
+        n->e = e;
+}
+
+/* adds index entry e for use attribute e->index */
+static void index_add(yaz_sparql_t s, struct sparql_entry *e)
+{
+    struct sparql_hash_node *n = hash_find(&s->index_str, e->index, 0);
+    char *end = 0;
+    Odr_int w;
+
+    if (n)
+    {
+        struct sparql_entry *old = n->e, *m = index_merge(s, old, e);
+        if (m != old)
+            index_replace(s, old, m);
+        return;
+    }
+    w = odr_strtol(e->index, &end, 10);
+    if (end && *end == '\0')
+        hash_add(s->nmem, &s->index_num, 0, w, e);
+    hash_add(s->nmem, &s->index_str, e->index, 0, e);
 }
 
-void yaz_sparql_include(yaz_sparql_t s, yaz_sparql_t u)
+/* adds sort entry e for use attribute e->index */
+static void sort_add(yaz_sparql_t s, struct sparql_entry *e)
 {
-    struct sparql_entry *e = u->conf;
-    for (; e; e = e->next)
-        yaz_sparql_add_pattern(s, e->pattern, e->value);
+    char *end = 0;
+    Odr_int w = odr_strtol(e->index, &end, 10);
+
+    if (end && *end == '\0')
+        hash_add(s->nmem, &s->sort_num, 0, w, e);
+    hash_add(s->nmem, &s->sort_str, e->index, 0, e);
+}
+
+/* index.X;2=R;5=T: template for X with relation R and truncation T */
+static int add_variant(yaz_sparql_t s, struct sparql_entry *e)
+{
+    const char *cp = strchr(e->pattern + 6, ';');
+    struct sparql_entry *base, *m;
+
+    e->index = nmem_strdupn(s->nmem, e->pattern + 6, cp - e->pattern - 6);
+    while (*cp == ';')
+    {
+        char *end = 0;
+        Odr_int type = odr_strtol(cp + 1, &end, 10), v;
+
+        if (!end || *end != '=')
+            return -1;
+        cp = end + 1;
+        v = odr_strtol(cp, &end, 10);
+        if (!end || end == cp || v <= 0)
+            return -1;
+        if (type == 2)
+            e->relation = v;
+        else if (type == 5)
+            e->truncation = v;
+        else
+            return -1;
+        cp = end;
+    }
+    if (*cp)
+        return -1;
+    base = hash_lookup_str(&s->index_str, e->index);
+    if (!base)
+    {
+        base = (struct sparql_entry *) nmem_malloc(s->nmem, sizeof(*base));
+        memset(base, 0, sizeof(*base));
+        base->pattern = nmem_strdupn(s->nmem, e->pattern,
+                                     6 + strlen(e->index));
+        base->value = nmem_strdup(s->nmem, "");
+        base->opt_var = -1;
+        base->index = e->index;
+        base->vars = s;
+        base->owner = s;
+        index_add(s, base);
+    }
+    m = entry_own(s, base);
+    variants_append(s, m, e);
+    if (m != base)
+        index_replace(s, base, m);
+    return 0;
+}
+
+/* variables of u in the numbering of s */
+static void add_layer(yaz_sparql_t s, yaz_sparql_t u)
+{
+    struct sparql_layer *l;
+    unsigned i;
+
+    for (l = s->layers; l; l = l->next)
+        if (l->u == u)
+            return;
+    l = (struct sparql_layer *) nmem_malloc(s->nmem, sizeof(*l));
+    l->u = u;
+    l->map = (int *) nmem_malloc(s->nmem, (u->num_vars + 1) * sizeof(int));
+    for (i = 0; i < u->var_str.size; i++)
+    {
+        struct sparql_hash_node *n = u->var_str.buckets[i];
+        for (; n; n = n->next)
+            l->map[n->num] = intern_var(s, n->key, strlen(n->key));
+    }
+    l->next = s->layers;
+    s->layers = l;
+}
+
+/* map of variables of entries of vars; 0 if numbered by s */
+static int var_map(yaz_sparql_t s, yaz_sparql_t vars, const int **map)
+{
+    struct sparql_layer *l;
+
+    *map = 0;
+    if (vars == s)
+        return 0;
+    for (l = s->layers; l; l = l->next)
+        if (l->u == vars)
+        {
+            *map = l->map;
+            return 0;
+        }
+    return -1;
+}
+
+static void add_optional(yaz_sparql_t s, struct sparql_entry *e, int opt_var)
+{
+    struct sparql_ref *r =
+        (struct sparql_ref *) nmem_malloc(s->nmem, sizeof(*r));
+
+    r->e = e;
+    r->opt_var = opt_var;
+    r->next = 0;
+    *s->optional_last = r;
+    s->optional_last = &r->next;
+}
+
+/* index and sort entries of u, as u resolved them, in the order they
+   are declared in conf, which is u's or that of one of its includes */
+static void include_entries(yaz_sparql_t s, yaz_sparql_t u,
+                            struct sparql_entry *conf, NMEM nmem,
+                            struct sparql_hash *seen)
+{
+    struct sparql_entry *e, *m;
+
+    for (e = conf; e; e = e->next)
+        if (e->include)
+            include_entries(s, u, e->include->conf, nmem, seen);
+        else if (!strncmp(e->pattern, "index.", 6))
+        {
+            if (hash_find(seen, e->index, 0))
+                continue;
+            hash_add(nmem, seen, e->index, 0, 0);
+            m = hash_lookup_str(&u->index_str, e->index);
+            if (m)
+                index_add(s, m);
+        }
+        else if (!strncmp(e->pattern, "sort.", 5))
+        {
+            m = hash_lookup_str(&u->sort_str, e->index);
+            if (m)
+                sort_add(s, m);
+        }
+}
+
+int yaz_sparql_include(yaz_sparql_t s, yaz_sparql_t u)
+{
+    struct sparql_entry *e;
+    struct sparql_layer *l;
+    struct sparql_ref *r;
+    struct sparql_hash seen;
+    NMEM nmem;
+    const int *map;
+    unsigned set;
+
+    if (u == s)
+        return -1;
+    for (l = u->layers; l; l = l->next)
+        if (l->u == s)
+            return -1;
+
+    /* recorded, so that explain lists indexes in configuration order */
+    e = (struct sparql_entry *) nmem_malloc(s->nmem, sizeof(*e));
+    memset(e, 0, sizeof(*e));
+    e->pattern = nmem_strdup(s->nmem, "include");
+    e->value = nmem_strdup(s->nmem, "");
+    e->opt_var = -1;
+    e->vars = s;
+    e->owner = s;
+    e->include = u;
+    *s->last = e;
+    s->last = &e->next;
+
+    s->errors += u->errors;
+    add_layer(s, u);
+    for (l = u->layers; l; l = l->next)
+        add_layer(s, l->u);
+    if (var_map(s, u, &map))
+    {
+        s->errors++;
+        return -1;
+    }
+
+    wrbuf_append(s->prefix_buf, u->prefix_buf);
+    wrbuf_append(s->form_buf, u->form_buf);
+    wrbuf_append(s->criteria_buf, u->criteria_buf);
+    render_prologue(s);
+    wrbuf_append(s->modifier_head, u->modifier_head);
+    wrbuf_append(s->order_buf, u->order_buf);
+    wrbuf_append(s->modifier_tail, u->modifier_tail);
+    wrbuf_append(s->modifier_offset, u->modifier_offset);
+    if (u->modifier_limit >= 0 &&
+        (s->modifier_limit < 0 || u->modifier_limit < s->modifier_limit))
+        s->modifier_limit = u->modifier_limit;
+    render_epilogue(s);
+    for (r = u->optional; r; r = r->next)
+        add_optional(s, r->e, r->opt_var >= 0 ? map[r->opt_var] : -1);
+
+    /* entries are shared; merged variants are copied, see index_merge */
+    nmem = nmem_create();
+    hash_init(&seen);
+    include_entries(s, u, u->conf, nmem, &seen);
+    hash_destroy(&seen);
+    nmem_destroy(nmem);
+    if (!s->schema)
+        s->schema = u->schema;
+    hash_merge(s->nmem, &s->schema_str, &u->schema_str);
+    hash_merge(s->nmem, &s->selectivity, &u->selectivity);
+    hash_merge(s->nmem, &s->cost, &u->cost);
+
+    /* settings given by s, or by an earlier include, are kept, as its
+       indexes and schemas are */
+    set = u->settings & ~s->settings;
+    if (set & SPARQL_SET_AND_NOT)
+        s->and_not_minus = u->and_not_minus;
+    if (set & SPARQL_SET_FACTOR_UNANCHORED)
+        s->factor_unanchored = u->factor_unanchored;
+    if (set & SPARQL_SET_LIMIT_COST)
+        s->limit_cost = u->limit_cost;
+    if (set & SPARQL_SET_LIMIT_OPERANDS)
+        s->limit_operands = u->limit_operands;
+    if (set & SPARQL_SET_LIMIT_DEPTH)
+        s->limit_depth = u->limit_depth;
+    if (set & SPARQL_SET_LIMIT_UNANCHORED)
+        s->limit_unanchored = u->limit_unanchored;
+    if (set & SPARQL_SET_LIMIT_DOWNGRADE)
+        s->limit_downgrade = u->limit_downgrade;
+    s->settings |= u->settings;
+    return 0;
+}
+
+/* non-negative integer */
+static int parse_count(const char *value, Odr_int *v)
+{
+    char *end = 0;
+
+    *v = odr_strtol(value, &end, 10);
+    if (!end || end == value || *end || *v < 0)
+        return -1;
+    return 0;
 }
 
 int yaz_sparql_add_pattern(yaz_sparql_t s, const char *pattern,
@@ -54,8 +1047,153 @@ int yaz_sparql_add_pattern(yaz_sparql_t s, const char *pattern,
     e->pattern = nmem_strdup(s->nmem, pattern);
     e->value = nmem_strdup(s->nmem, value);
     e->next = 0;
+    e->kind_next = 0;
+    e->prog = 0;
+    e->binds = 0;
+    e->binds_words = 0;
+    e->opt_var = -1;
+    e->index = 0;
+    e->relation = 0;
+    e->truncation = 0;
+    e->vars = s;
+    e->owner = s;
+    e->include = 0;
     *s->last = e;
     s->last = &e->next;
+
+    if (!strcmp(pattern, "prefix"))
+    {
+        render_prefix(s->prefix_buf, value);
+        render_prologue(s);
+    }
+    else if (!strcmp(pattern, "form"))
+    {
+        wrbuf_puts(s->form_buf, value);
+        wrbuf_puts(s->form_buf, "\n");
+        render_prologue(s);
+    }
+    else if (!strcmp(pattern, "criteria"))
+    {
+        wrbuf_puts(s->criteria_buf, "  ");
+        wrbuf_puts(s->criteria_buf, value);
+        wrbuf_puts(s->criteria_buf, " .\n");
+        render_prologue(s);
+    }
+    else if (!strcmp(pattern, "criteria.optional"))
+    {
+        compile_optional(s, e);
+        add_optional(s, e, e->opt_var);
+    }
+    else if (!strcmp(pattern, "modifier"))
+    {
+        add_modifier(s, value);
+        render_epilogue(s);
+    }
+    else if (!strncmp(pattern, "index.", 6))
+    {
+        compile_entry(s, e);
+        if (strchr(e->pattern + 6, ';'))
+            return add_variant(s, e);
+        e->index = e->pattern + 6;
+        index_add(s, e);
+    }
+    else if (!strncmp(pattern, "sort.", 5))
+    {
+        const struct sparql_op *op;
+
+        compile_entry(s, e);
+        /* the value is bound to %v; there is no term */
+        for (op = e->prog; op->which != SPARQL_OP_END; op++)
+            if (op->which != SPARQL_OP_LITERAL && op->which != SPARQL_OP_VAR)
+                return -1;
+        e->index = e->pattern + 5;
+        sort_add(s, e);
+    }
+    else if (!strncmp(pattern, "present", 7) || !strncmp(pattern, "uri", 3))
+    {
+        const char *schema = 0;
+        compile_entry(s, e);
+        if (!strncmp(pattern, "present.", 8))
+            schema = e->pattern + 8;
+        else if (!strncmp(pattern, "uri.", 4))
+            schema = e->pattern + 4;
+        if (schema)
+        {
+            if (!s->schema)
+                s->schema = e;
+            hash_add(s->nmem, &s->schema_str, schema, 0, e);
+        }
+    }
+    else if (!strncmp(pattern, "selectivity.", 12))
+    {
+        Odr_int hits;
+
+        if (parse_count(value, &hits))
+            return -1;
+        hash_add(s->nmem, &s->selectivity, e->pattern + 12, hits, 0);
+    }
+    else if (!strncmp(pattern, "cost.", 5))
+    {
+        Odr_int cost;
+
+        if (parse_count(value, &cost))
+            return -1;
+        hash_add(s->nmem, &s->cost, e->pattern + 5, cost, 0);
+    }
+    else if (!strncmp(pattern, "limit.", 6) ||
+             !strcmp(pattern, "factor.unanchored"))
+    {
+        Odr_int *vp;
+        unsigned set;
+
+        if (!strcmp(pattern, "factor.unanchored"))
+        {
+            vp = &s->factor_unanchored;
+            set = SPARQL_SET_FACTOR_UNANCHORED;
+        }
+        else if (!strcmp(pattern, "limit.cost"))
+        {
+            vp = &s->limit_cost;
+            set = SPARQL_SET_LIMIT_COST;
+        }
+        else if (!strcmp(pattern, "limit.operands"))
+        {
+            vp = &s->limit_operands;
+            set = SPARQL_SET_LIMIT_OPERANDS;
+        }
+        else if (!strcmp(pattern, "limit.depth"))
+        {
+            vp = &s->limit_depth;
+            set = SPARQL_SET_LIMIT_DEPTH;
+        }
+        else if (!strcmp(pattern, "limit.unanchored"))
+        {
+            vp = &s->limit_unanchored;
+            set = SPARQL_SET_LIMIT_UNANCHORED;
+        }
+        else if (!strcmp(pattern, "limit.downgrade"))
+        {
+            vp = &s->limit_downgrade;
+            set = SPARQL_SET_LIMIT_DOWNGRADE;
+        }
+        else
+            return -1;
+        if (parse_count(value, vp))
+            return -1;
+        s->settings |= set;
+    }
+    else if (!strcmp(pattern, "andnot"))
+    {
+        if (!strcmp(value, "minus"))
+            s->and_not_minus = 1;
+        else if (!strcmp(value, "filter"))
+            s->and_not_minus = 0;
+        else
+            return -1;
+        s->settings |= SPARQL_SET_AND_NOT;
+    }
+    else
+        s->errors++;
     return 0;
 }
 
@@ -65,6 +1203,14 @@ int yaz_sparql_from_rpn_wrbuf(yaz_sparql_t s, WRBUF addinfo, WRBUF w,
     return yaz_sparql_from_rpn_stream(s, addinfo, wrbuf_vp_puts, w, q);
 }
 
+int yaz_sparql_from_rpn_sort_wrbuf(yaz_sparql_t s, WRBUF addinfo, WRBUF w,
+                                   Z_RPNQuery *q, Z_SortKeySpecList *sort,
+                                   int *downgraded)
+{
+    return yaz_sparql_from_rpn_sort_stream(s, addinfo, wrbuf_vp_puts, w, q,
+                                           sort, downgraded);
+}
+
 int yaz_sparql_from_uri_wrbuf(yaz_sparql_t s, WRBUF addinfo, WRBUF w,
                               const char *uri, const char *schema)
 {
@@ -72,238 +1218,614 @@ int yaz_sparql_from_uri_wrbuf(yaz_sparql_t s, WRBUF addinfo, WRBUF w,
                                       schema);
 }
 
-static Odr_int lookup_attr_numeric(Z_AttributeList *attributes, int type)
+static Odr_int lookup_attr_numeric(Z_AttributeList *attributes, int type)
+{
+    int j;
+    for (j = 0; j < attributes->num_attributes; j++)
+    {
+        Z_AttributeElement *ae = attributes->attributes[j];
+        if (*ae->attributeType == type)
+        {
+            if (ae->which == Z_AttributeValue_numeric)
+                return *ae->value.numeric;
+        }
+    }
+    return 0;
+}
+
+static const char *lookup_attr_string(Z_AttributeList *attributes, int type)
+{
+    int j;
+    for (j = 0; j < attributes->num_attributes; j++)
+    {
+        Z_AttributeElement *ae = attributes->attributes[j];
+        if (*ae->attributeType == type)
+        {
+            if (ae->which == Z_AttributeValue_complex)
+            {
+                Z_ComplexAttribute *ca = ae->value.complex;
+                int i;
+                for (i = 0; i < ca->num_list; i++)
+                {
+                    Z_StringOrNumeric *son = ca->list[i];
+                    if (son->which == Z_StringOrNumeric_string)
+                        return son->u.string;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+static void term_write(WRBUF w, Z_Term *term, int json)
+{
+    switch (term->which)
+    {
+    case Z_Term_general:
+        if (json)
+            wrbuf_json_write(w, term->u.general->buf, term->u.general->len);
+        else
+            wrbuf_write(w, term->u.general->buf, term->u.general->len);
+        break;
+    case Z_Term_numeric:
+        wrbuf_printf(w, ODR_INT_PRINTF, *term->u.numeric);
+        break;
+    case Z_Term_characterString:
+        if (json)
+            wrbuf_json_puts(w, term->u.characterString);
+        else
+            wrbuf_puts(w, term->u.characterString);
+        break;
+    }
+}
+
+static void op_term(WRBUF res, enum sparql_op_type which, Z_Term *term)
+{
+    switch (which)
+    {
+    case SPARQL_OP_STRING:
+        wrbuf_putc(res, '"');
+        term_write(res, term, 1);
+        wrbuf_putc(res, '"');
+        break;
+    case SPARQL_OP_URI:
+        wrbuf_putc(res, '<');
+        term_write(res, term, 1);
+        wrbuf_putc(res, '>');
+        break;
+    case SPARQL_OP_TERM:
+        term_write(res, term, 1);
+        break;
+    case SPARQL_OP_RAW:
+        term_write(res, term, 0);
+        break;
+    default:
+        break;
+    }
+}
+
+/* marks variables bound by e in the numbering of s */
+static void bind_vars(yaz_sparql_t s, unsigned *bound,
+                      const struct sparql_entry *e)
+{
+    const int *map;
+    int i;
+
+    /* vars is s or one of its layers, see yaz_sparql_include */
+    if (var_map(s, e->vars, &map))
+        return;
+    if (!map)
+    {
+        for (i = 0; i < e->binds_words; i++)
+            bound[i] |= e->binds[i];
+        return;
+    }
+    for (i = 0; i < e->binds_words * SPARQL_VAR_BIT; i++)
+        if (e->binds[i / SPARQL_VAR_BIT] & (1U << (i % SPARQL_VAR_BIT)))
+            bound[map[i] / SPARQL_VAR_BIT] |= 1U << (map[i] % SPARQL_VAR_BIT);
+}
+
+/* expands e for term; a null term expands to the VALUES variable */
+static int z_term(yaz_sparql_t s, WRBUF res, unsigned *bound,
+                  struct sparql_entry *e, Z_Term *term, int var_no)
+{
+    const struct sparql_op *op;
+
+    if (bound)
+        bind_vars(s, bound, e);
+    for (op = e->prog; op->which != SPARQL_OP_END; op++)
+    {
+        switch (op->which)
+        {
+        case SPARQL_OP_LITERAL:
+            wrbuf_write(res, op->buf, op->len);
+            break;
+        case SPARQL_OP_VAR:
+            wrbuf_printf(res, "?v%d", var_no);
+            break;
+        case SPARQL_OP_END:
+            break;
+        default:
+            if (term)
+                op_term(res, op->which, term);
+            else
+                wrbuf_printf(res, "?v%d", var_no + 1);
+            break;
+        }
+    }
+    return 0;
+}
+
+/* op type of all terms in e if they can be bound by VALUES, else END */
+static enum sparql_op_type values_type(struct sparql_entry *e)
+{
+    const struct sparql_op *op;
+    enum sparql_op_type which = SPARQL_OP_END;
+
+    for (op = e->prog; op->which != SPARQL_OP_END; op++)
+    {
+        if (op->which == SPARQL_OP_LITERAL || op->which == SPARQL_OP_VAR)
+            continue;
+        if (op->which != SPARQL_OP_STRING && op->which != SPARQL_OP_URI)
+            return SPARQL_OP_END;
+        if (which != SPARQL_OP_END && which != op->which)
+            return SPARQL_OP_END;
+        which = op->which;
+    }
+    return which;
+}
+
+/* most specific variant of index e for relation and truncation of term */
+static int lookup_variant(struct sparql_entry *e, Z_AttributeList *attributes,
+                          WRBUF addinfo, struct sparql_entry **ep)
+{
+    Odr_int relation = lookup_attr_numeric(attributes, 2);
+    Odr_int truncation = lookup_attr_numeric(attributes, 5);
+    struct sparql_entry *v;
+    int best = 0, relation_ok = 0;
+
+    if (!relation)
+        relation = 3;
+    if (!truncation)
+        truncation = 100;
+    *ep = e->prog ? e : 0;
+    for (v = e->kind_next; v; v = v->kind_next)
+    {
+        int score = 0;
+        if (v->relation)
+        {
+            if (v->relation != relation)
+                continue;
+            score++;
+        }
+        relation_ok = 1;
+        if (v->truncation)
+        {
+            if (v->truncation != truncation)
+                continue;
+            score++;
+        }
+        if (score > best)
+        {
+            best = score;
+            *ep = v;
+        }
+    }
+    if (*ep)
+        return 0;
+    if (!relation_ok)
+    {
+        if (addinfo)
+            wrbuf_printf(addinfo, ODR_INT_PRINTF, relation);
+        return YAZ_BIB1_UNSUPP_RELATION_ATTRIBUTE;
+    }
+    if (addinfo)
+        wrbuf_printf(addinfo, ODR_INT_PRINTF, truncation);
+    return YAZ_BIB1_UNSUPP_TRUNCATION_ATTRIBUTE;
+}
+
+static int lookup_use(struct sparql_hash *num, struct sparql_hash *str,
+                      Z_AttributeList *attributes, int error,
+                      WRBUF addinfo, struct sparql_entry **ep)
+{
+    Odr_int v = lookup_attr_numeric(attributes, 1);
+    if (v)
+    {
+        *ep = hash_lookup_num(num, v);
+        if (!*ep)
+        {
+            if (addinfo)
+                wrbuf_printf(addinfo, ODR_INT_PRINTF, v);
+            return error;
+        }
+    }
+    else
+    {
+        const char *index_name = lookup_attr_string(attributes, 1);
+        if (!index_name)
+            index_name = "any";
+        *ep = hash_lookup_str(str, index_name);
+        if (!*ep)
+        {
+            if (addinfo)
+                wrbuf_puts(addinfo, index_name);
+            return error;
+        }
+    }
+    return 0;
+}
+
+static int lookup_index(yaz_sparql_t s, Z_AttributeList *attributes,
+                        WRBUF addinfo, struct sparql_entry **ep)
+{
+    int r = lookup_use(&s->index_num, &s->index_str, attributes,
+                       YAZ_BIB1_UNSUPP_USE_ATTRIBUTE, addinfo, ep);
+    if (r)
+        return r;
+    return lookup_variant(*ep, attributes, addinfo, ep);
+}
+
+static int apt(yaz_sparql_t s, WRBUF addinfo, WRBUF res, unsigned *bound,
+               struct sparql_node *n, int indent, int *var_no)
+{
+    Z_AttributesPlusTerm *q = n->q->u.simple->u.attributesPlusTerm;
+    int i;
+
+    /* looked up again only for the addinfo of the diagnostic */
+    if (n->error)
+        return lookup_index(s, q->attributes, addinfo, &n->e);
+    wrbuf_puts(res, "  ");
+    for (i = 0; i < indent; i++)
+        wrbuf_puts(res, " ");
+    assert(n->e);
+
+    z_term(s, res, bound, n->e, q->term, *var_no);
+    (*var_no)++;
+    return 0;
+}
+
+/* expected hits for index: observed, else configured, else -1 */
+static Odr_int index_estimate(yaz_sparql_t s, struct sparql_entry *e)
+{
+    struct sparql_hash_node *n = hash_find(&s->learned, e->index, 0);
+
+    if (!n)
+        n = hash_find(&s->selectivity, e->index, 0);
+    return n ? n->num : -1;
+}
+
+/* q with the index entries of its terms and the expected hits of each
+   node; terms are looked up once per query, here */
+static struct sparql_node *rpn_resolve(yaz_sparql_t s, NMEM nmem,
+                                       Z_RPNStructure *q)
+{
+    struct sparql_node *n =
+        (struct sparql_node *) nmem_malloc(nmem, sizeof(*n));
+
+    n->q = q;
+    n->s1 = n->s2 = 0;
+    n->e = 0;
+    n->error = 0;
+    n->estimate = -1;
+    if (q->which == Z_RPNStructure_complex)
+    {
+        Z_Complex *c = q->u.complex;
+        Odr_int e1, e2;
+
+        n->s1 = rpn_resolve(s, nmem, c->s1);
+        n->s2 = rpn_resolve(s, nmem, c->s2);
+        e1 = n->s1->estimate;
+        e2 = n->s2->estimate;
+        switch (c->roperator->which)
+        {
+        case Z_Operator_and:
+            n->estimate = (e1 < 0 || (e2 >= 0 && e2 < e1)) ? e2 : e1;
+            break;
+        case Z_Operator_or:
+            n->estimate = (e1 < 0 || e2 < 0) ? -1 : e1 + e2;
+            break;
+        case Z_Operator_and_not:
+            n->estimate = e1;
+            break;
+        }
+    }
+    else if (q->u.simple->which == Z_Operand_APT)
+    {
+        n->error = lookup_index(
+            s, q->u.simple->u.attributesPlusTerm->attributes, 0, &n->e);
+        if (n->error)
+            n->e = 0;
+        else
+            n->estimate = index_estimate(s, n->e);
+    }
+    return n;
+}
+
+/* cost of q: terms cost the weight of their index, multiplied for
+   unanchored terms and by the number of UNIONs they are nested in */
+static void rpn_cost(yaz_sparql_t s, struct sparql_node *q, int depth,
+                     int in_or, struct sparql_cost *c)
 {
-    int j;
-    for (j = 0; j < attributes->num_attributes; j++)
+    if (q->s1)
     {
-        Z_AttributeElement *ae = attributes->attributes[j];
-        if (*ae->attributeType == type)
+        int is_or = q->q->u.complex->roperator->which == Z_Operator_or;
+
+        /* an OR chain is one UNION */
+        if (is_or && !in_or)
+            depth++;
+        if (depth > c->depth)
+            c->depth = depth;
+        rpn_cost(s, q->s1, depth, is_or, c);
+        rpn_cost(s, q->s2, depth, is_or, c);
+    }
+    else if (q->q->u.simple->which == Z_Operand_APT)
+    {
+        Z_AttributesPlusTerm *apt = q->q->u.simple->u.attributesPlusTerm;
+        Odr_int truncation = lookup_attr_numeric(apt->attributes, 5);
+        Odr_int cost = 1;
+
+        if (q->e)
         {
-            if (ae->which == Z_AttributeValue_numeric)
-                return *ae->value.numeric;
+            struct sparql_hash_node *n = hash_find(&s->cost, q->e->index, 0);
+            if (n)
+                cost = n->num;
+        }
+        /* left, left and right, regular expressions */
+        if (truncation == 2 || truncation == 3 ||
+            (truncation >= 102 && truncation <= 104))
+        {
+            c->unanchored++;
+            cost *= s->factor_unanchored;
         }
+        c->operands++;
+        c->cost += cost * (1 + depth);
     }
-    return 0;
 }
 
-static const char *lookup_attr_string(Z_AttributeList *attributes, int type)
+/* bib-1 diagnostic if q is too expensive; *downgrade set if q may run
+   with a row limit instead */
+static int cost_check(yaz_sparql_t s, WRBUF addinfo, struct sparql_node *q,
+                      int *downgrade)
 {
-    int j;
-    for (j = 0; j < attributes->num_attributes; j++)
+    struct sparql_cost c;
+
+    c.cost = 0;
+    c.operands = 0;
+    c.depth = 0;
+    c.unanchored = 0;
+    rpn_cost(s, q, 0, 0, &c);
+    yaz_log(s->log_level, "sparql: cost " ODR_INT_PRINTF
+            " operands %d depth %d unanchored %d",
+            c.cost, c.operands, c.depth, c.unanchored);
+    *downgrade = 0;
+    if (s->limit_operands && c.operands > s->limit_operands)
     {
-        Z_AttributeElement *ae = attributes->attributes[j];
-        if (*ae->attributeType == type)
+        if (addinfo)
+            wrbuf_printf(addinfo, "%d", c.operands);
+        return YAZ_BIB1_TOO_MANY_ARGUMENT_WORDS;
+    }
+    if (s->limit_depth && c.depth > s->limit_depth)
+    {
+        if (addinfo)
+            wrbuf_printf(addinfo, "%d", c.depth);
+        return YAZ_BIB1_TOO_MANY_BOOLEAN_OPERATORS;
+    }
+    if (s->limit_unanchored && c.unanchored > s->limit_unanchored)
+    {
+        if (addinfo)
+            wrbuf_printf(addinfo, "%d", c.unanchored);
+        return YAZ_BIB1_TOO_MANY_TRUNCATED_WORDS;
+    }
+    if (s->limit_cost && c.cost > s->limit_cost)
+    {
+        if (s->limit_downgrade)
         {
-            if (ae->which == Z_AttributeValue_complex)
-            {
-                Z_ComplexAttribute *ca = ae->value.complex;
-                int i;
-                for (i = 0; i < ca->num_list; i++)
-                {
-                    Z_StringOrNumeric *son = ca->list[i];
-                    if (son->which == Z_StringOrNumeric_string)
-                        return son->u.string;
-                }
-            }
+            *downgrade = 1;
+            return 0;
         }
+        if (addinfo)
+            wrbuf_printf(addinfo, "cost " ODR_INT_PRINTF, c.cost);
+        return YAZ_BIB1_UNSUPP_SEARCH;
     }
     return 0;
 }
 
-static int z_term(yaz_sparql_t s, WRBUF addinfo, WRBUF res, WRBUF vars,
-                  struct sparql_entry *e, const char *use_var,
-                  Z_Term *term, int indent, int *var_no)
+/* collects operands of chain of operator which into ops; returns count */
+static int op_collect(struct sparql_node *q, int which,
+                      struct sparql_node **ops, int n)
 {
-    const char *cp;
-    for (cp = e->value; *cp; cp++)
+    if (q->s1 && q->q->u.complex->roperator->which == which)
     {
-        if (strchr(" \t\r\n\f", *cp) && !use_var)
-        {
-            use_var = e->value;
-            if (strchr("$?", e->value[0]))
-            {
-                wrbuf_write(vars, e->value + 1, cp - e->value - 1);
-                wrbuf_puts(vars, " ");
-            }
-        }
-        if (*cp == '%')
-        {
-            switch (*++cp)
-            {
-            case 's':
-                wrbuf_puts(addinfo, "\"");
-                switch (term->which)
-                {
-                case Z_Term_general:
-                    wrbuf_json_write(addinfo,
-                                term->u.general->buf, term->u.general->len);
-                    break;
-                case Z_Term_numeric:
-                    wrbuf_printf(addinfo, ODR_INT_PRINTF, *term->u.numeric);
-                    break;
-                case Z_Term_characterString:
-                    wrbuf_json_puts(addinfo, term->u.characterString);
-                    break;
-                }
-                wrbuf_puts(addinfo, "\"");
-                break;
-            case 'u':
-                wrbuf_puts(addinfo, "<");
-                switch (term->which)
-                {
-                case Z_Term_general:
-                    wrbuf_json_write(addinfo,
-                                term->u.general->buf, term->u.general->len);
-                    break;
-                case Z_Term_numeric:
-                    wrbuf_printf(addinfo, ODR_INT_PRINTF, *term->u.numeric);
-                    break;
-                case Z_Term_characterString:
-                    wrbuf_json_puts(addinfo, term->u.characterString);
-                    break;
-                }
-                wrbuf_puts(addinfo, ">");
-                break;
-            case 't':
-                switch (term->which)
-                {
-                case Z_Term_general:
-                    wrbuf_json_write(addinfo,
-                                term->u.general->buf, term->u.general->len);
-                    break;
-                case Z_Term_numeric:
-                    wrbuf_printf(addinfo, ODR_INT_PRINTF, *term->u.numeric);
-                    break;
-                case Z_Term_characterString:
-                    wrbuf_json_puts(addinfo, term->u.characterString);
-                    break;
-                }
-                break;
-            case 'd':
-                switch (term->which)
-                {
-                case Z_Term_general:
-                    wrbuf_write(addinfo,
-                                term->u.general->buf, term->u.general->len);
-                    break;
-                case Z_Term_numeric:
-                    wrbuf_printf(addinfo, ODR_INT_PRINTF, *term->u.numeric);
-                    break;
-                case Z_Term_characterString:
-                    wrbuf_puts(addinfo, term->u.characterString);
-                    break;
-                }
-                break;
-            case 'v':
-                wrbuf_printf(addinfo, "?v%d", *var_no);
-                break;
-            case '%':
-                wrbuf_putc(addinfo, '%');
-                break;
-            }
-        }
-        else
-            wrbuf_putc(addinfo, *cp);
+        n = op_collect(q->s1, which, ops, n);
+        return op_collect(q->s2, which, ops, n);
     }
-    wrbuf_puts(res, wrbuf_cstr(addinfo));
-    return 0;
+    if (ops)
+        ops[n] = q;
+    return n + 1;
 }
 
-static int apt(yaz_sparql_t s, WRBUF addinfo, WRBUF res, WRBUF vars,
-               Z_AttributesPlusTerm *q, int indent, int *var_no)
+/* most selective operands first; those without estimate last, in order */
+static void and_order(NMEM nmem, struct sparql_node **ops, int n)
 {
-    Odr_int v = lookup_attr_numeric(q->attributes, 1);
-    struct sparql_entry *e = 0;
-    const char *use_var = 0;
-    int i;
+    Odr_int *est = (Odr_int *) nmem_malloc(nmem, n * sizeof(*est));
+    int i, j;
 
-    wrbuf_puts(res, "  ");
-    for (i = 0; i < indent; i++)
-        wrbuf_puts(res, " ");
-    if (v)
+    for (i = 0; i < n; i++)
     {
-        for (e = s->conf; e; e = e->next)
-        {
-            if (!strncmp(e->pattern, "index.", 6))
-            {
-                char *end = 0;
-                Odr_int w = odr_strtol(e->pattern + 6, &end, 10);
+        struct sparql_node *op = ops[i];
+        Odr_int v = op->estimate;
 
-                if (end && *end == '\0' && v == w)
-                    break;
-            }
-        }
-        if (!e)
+        for (j = i; j > 0 && v >= 0 && (est[j - 1] < 0 || est[j - 1] > v);
+             j--)
         {
-            wrbuf_printf(addinfo, ODR_INT_PRINTF, v);
-            return YAZ_BIB1_UNSUPP_USE_ATTRIBUTE;
+            est[j] = est[j - 1];
+            ops[j] = ops[j - 1];
         }
+        est[j] = v;
+        ops[j] = op;
     }
-    else
+}
+
+static int rpn_structure(yaz_sparql_t s, NMEM nmem, WRBUF addinfo,
+                         WRBUF res, unsigned *bound, struct sparql_node *q,
+                         int indent, int *var_no);
+
+static int rpn_and(yaz_sparql_t s, NMEM nmem, WRBUF addinfo,
+                   WRBUF res, unsigned *bound, struct sparql_node *q,
+                   int indent, int *var_no)
+{
+    int i, r = 0, n = op_collect(q, Z_Operator_and, 0, 0);
+    struct sparql_node **ops =
+        (struct sparql_node **) nmem_malloc(nmem, n * sizeof(*ops));
+
+    op_collect(q, Z_Operator_and, ops, 0);
+    if (s->selectivity.count || s->learned.count)
+        and_order(nmem, ops, n);
+    for (i = 0; !r && i < n; i++)
     {
-        const char *index_name = lookup_attr_string(q->attributes, 1);
-        if (!index_name)
-            index_name = "any";
-        for (e = s->conf; e; e = e->next)
+        if (i)
+            wrbuf_puts(res, " .\n");
+        r = rpn_structure(s, nmem, addinfo, res, bound, ops[i], indent,
+                          var_no);
+    }
+    return r;
+}
+
+/* index entry of operand q if its term can be bound by VALUES, else 0 */
+static struct sparql_entry *values_entry(struct sparql_node *q)
+{
+    if (!q->e || values_type(q->e) == SPARQL_OP_END)
+        return 0;
+    return q->e;
+}
+
+/* operands ops[i..n) with entry e as one pattern with a VALUES block */
+static void rpn_values(yaz_sparql_t s, WRBUF res, unsigned *bound,
+                       struct sparql_entry *e,
+                       struct sparql_node **ops, struct sparql_entry **es,
+                       int i, int n, int indent, int *var_no)
+{
+    enum sparql_op_type which = values_type(e);
+    int j;
+
+    for (j = 0; j < indent; j++)
+        wrbuf_puts(res, " ");
+    wrbuf_printf(res, "  VALUES ?v%d {", *var_no + 1);
+    for (; i < n; i++)
+        if (es[i] == e)
         {
-            if (!strncmp(e->pattern, "index.", 6))
-            {
-                if (!strcmp(e->pattern + 6, index_name))
-                    break;
-            }
+            wrbuf_putc(res, ' ');
+            op_term(res, which,
+                    ops[i]->q->u.simple->u.attributesPlusTerm->term);
+            ops[i] = 0;
         }
-        if (!e)
+    wrbuf_puts(res, " }\n");
+    for (j = 0; j < indent; j++)
+        wrbuf_puts(res, " ");
+    wrbuf_puts(res, "  ");
+    z_term(s, res, bound, e, 0, *var_no);
+    *var_no += 2;
+}
+
+/* OR chain as a flat UNION; terms of the same index share one branch */
+static int rpn_or(yaz_sparql_t s, NMEM nmem, WRBUF addinfo,
+                  WRBUF res, unsigned *bound, struct sparql_node *q,
+                  int indent, int *var_no)
+{
+    int i, j, r = 0, branches = 0, no = 0;
+    int n = op_collect(q, Z_Operator_or, 0, 0);
+    struct sparql_node **ops =
+        (struct sparql_node **) nmem_malloc(nmem, n * sizeof(*ops));
+    struct sparql_entry **es =
+        (struct sparql_entry **) nmem_malloc(nmem, n * sizeof(*es));
+    int *shared = (int *) nmem_malloc(nmem, n * sizeof(*shared));
+
+    op_collect(q, Z_Operator_or, ops, 0);
+    for (i = 0; i < n; i++)
+    {
+        es[i] = values_entry(ops[i]);
+        shared[i] = 0;
+        for (j = 0; es[i] && j < i; j++)
+            if (es[j] == es[i])
+                break;
+        if (es[i] && j < i)
+            shared[j] = 1;
+        else
+            branches++;
+    }
+    if (branches > 1)
+        indent++;
+    for (i = 0; !r && i < n; i++)
+    {
+        if (!ops[i])
+            continue;
+        if (branches > 1)
         {
-            wrbuf_puts(addinfo, index_name);
-            return YAZ_BIB1_UNSUPP_USE_ATTRIBUTE;
+            for (j = 0; j < indent - 1; j++)
+                wrbuf_puts(res, " ");
+            wrbuf_puts(res, no++ ? "\n  } UNION {\n" : "  {\n");
         }
+        if (shared[i])
+            rpn_values(s, res, bound, es[i], ops, es, i, n, indent, var_no);
+        else
+            r = rpn_structure(s, nmem, addinfo, res, bound, ops[i], indent,
+                              var_no);
     }
-    assert(e);
-    wrbuf_rewind(addinfo);
-
-    z_term(s, addinfo, res, vars, e, use_var, q->term, indent, var_no);
-    (*var_no)++;
-    return 0;
+    if (branches > 1)
+    {
+        wrbuf_puts(res, "\n");
+        for (j = 0; j < indent - 1; j++)
+            wrbuf_puts(res, " ");
+        wrbuf_puts(res, "  }");
+    }
+    return r;
 }
 
+/* excluded operand does not bind variables for the optional criteria */
+static int rpn_and_not(yaz_sparql_t s, NMEM nmem, WRBUF addinfo,
+                       WRBUF res, unsigned *bound, struct sparql_node *q,
+                       int indent, int *var_no)
+{
+    int i, r = rpn_structure(s, nmem, addinfo, res, bound, q->s1, indent,
+                             var_no);
+
+    if (r)
+        return r;
+    wrbuf_puts(res, " .\n");
+    for (i = 0; i < indent; i++)
+        wrbuf_puts(res, " ");
+    if (s->and_not_minus)
+        wrbuf_puts(res, "  MINUS {\n");
+    else
+        wrbuf_puts(res, "  FILTER NOT EXISTS {\n");
+    r = rpn_structure(s, nmem, addinfo, res, 0, q->s2, indent + 1, var_no);
+    wrbuf_puts(res, "\n");
+    for (i = 0; i < indent; i++)
+        wrbuf_puts(res, " ");
+    wrbuf_puts(res, "  }");
+    return r;
+}
 
-static int rpn_structure(yaz_sparql_t s, WRBUF addinfo,
-                         WRBUF res, WRBUF vars, Z_RPNStructure *q, int indent,
-                         int *var_no)
+static int rpn_structure(yaz_sparql_t s, NMEM nmem, WRBUF addinfo,
+                         WRBUF res, unsigned *bound, struct sparql_node *q,
+                         int indent, int *var_no)
 {
-    int i;
-    if (q->which == Z_RPNStructure_complex)
+    if (q->s1)
     {
-        int r;
-        Z_Complex *c = q->u.complex;
+        Z_Complex *c = q->q->u.complex;
         Z_Operator *op = c->roperator;
         if (op->which == Z_Operator_and)
         {
-            r = rpn_structure(s, addinfo, res, vars, c->s1, indent, var_no);
-            if (r)
-                return r;
-            wrbuf_puts(res, " .\n");
-            return rpn_structure(s, addinfo, res, vars, c->s2, indent, var_no);
+            return rpn_and(s, nmem, addinfo, res, bound, q, indent, var_no);
         }
         else if (op->which == Z_Operator_or)
         {
-            for (i = 0; i < indent; i++)
-                wrbuf_puts(res, " ");
-            wrbuf_puts(res, "  {\n");
-            r = rpn_structure(s, addinfo, res, vars, c->s1, indent + 1, var_no);
-            if (r)
-                return r;
-            wrbuf_puts(res, "\n");
-            for (i = 0; i < indent; i++)
-                wrbuf_puts(res, " ");
-            wrbuf_puts(res, "  } UNION {\n");
-            r = rpn_structure(s, addinfo, res, vars, c->s2, indent + 1, var_no);
-            wrbuf_puts(res, "\n");
-            for (i = 0; i < indent; i++)
-                wrbuf_puts(res, " ");
-            wrbuf_puts(res, "  }");
-            return r;
+            return rpn_or(s, nmem, addinfo, res, bound, q, indent, var_no);
+        }
+        else if (op->which == Z_Operator_and_not)
+        {
+            return rpn_and_not(s, nmem, addinfo, res, bound, q, indent,
+                               var_no);
         }
         else
         {
@@ -312,110 +1834,201 @@ static int rpn_structure(yaz_sparql_t s, WRBUF addinfo,
     }
     else
     {
-        Z_Operand *op = q->u.simple;
-        if (op->which == Z_Operand_APT)
-            return apt(s, addinfo, res, vars, op->u.attributesPlusTerm, indent,
-                       var_no);
+        if (q->q->u.simple->which == Z_Operand_APT)
+            return apt(s, addinfo, res, bound, q, indent, var_no);
         else
             return YAZ_BIB1_RESULT_SET_UNSUPP_AS_A_SEARCH_TERM;
     }
     return 0;
 }
 
-static int emit_prefixes(yaz_sparql_t s,
-                          WRBUF addinfo,
-                          void (*pr)(const char *buf,
-                                     void *client_data),
-                          void *client_data)
-{
+struct sparql_sort_key {
     struct sparql_entry *e;
-    yaz_tok_cfg_t cfg = yaz_tok_cfg_create();
-    int errors = 0;
-    for (e = s->conf; e; e = e->next)
-    {
-        if (!strcmp(e->pattern, "prefix"))
-        {
-            yaz_tok_parse_t p = yaz_tok_parse_buf(cfg, e->value);
-            int no = 0;
+    int descending;
+    Odr_int priority;
+};
 
-            pr("PREFIX", client_data);
-            while (1)
-            {
-                const char *tok_str;
-                int token = yaz_tok_move(p);
-                if (token != YAZ_TOK_STRING)
-                    break;
-                pr(" ", client_data);
-
-                tok_str = yaz_tok_parse_string(p);
-                if (tok_str[0])
-                {
-                    if (no > 0 && tok_str[0] != '<')
-                        pr("<", client_data);
-                    pr(tok_str, client_data);
-                    if (no > 0 && tok_str[strlen(tok_str)-1] != '>')
-                        pr(">", client_data);
-                }
-                no++;
-            }
-            pr("\n", client_data);
-            yaz_tok_parse_destroy(p);
-        }
-        else if (!strcmp(e->pattern, "criteria"))
-        {
-            ;
-        }
-        else if (!strcmp(e->pattern, "criteria.optional"))
-        {
-            ;
-        }
-        else if (!strncmp(e->pattern, "index.", 6))
-        {
-            ;
-        }
-        else if (!strcmp(e->pattern, "form"))
-        {
-            ;
-        }
-        else if (!strcmp(e->pattern, "modifier"))
-        {
-            ;
-        }
-        else if (!strncmp(e->pattern, "present", 7))
+static int is_sort_apt(Z_RPNStructure *q)
+{
+    return q->which == Z_RPNStructure_simple &&
+        q->u.simple->which == Z_Operand_APT &&
+        lookup_attr_numeric(q->u.simple->u.attributesPlusTerm->attributes,
+                            7) != 0;
+}
+
+/* skips sort keys combined with the query at top level, as in
+   @or query @attr 7=1 @attr 1=title 0; these are put in keys, if given,
+   last one first */
+static Z_RPNStructure *sort_strip(Z_RPNStructure *q, Z_RPNStructure **keys,
+                                  int *n)
+{
+    while (q->which == Z_RPNStructure_complex &&
+           (q->u.complex->roperator->which == Z_Operator_or ||
+            q->u.complex->roperator->which == Z_Operator_and))
+    {
+        Z_Complex *c = q->u.complex;
+        if (is_sort_apt(c->s2))
         {
-            ;
+            if (keys)
+                keys[*n] = c->s2;
+            q = c->s1;
         }
-        else if (!strncmp(e->pattern, "uri", 3))
+        else if (is_sort_apt(c->s1))
         {
-            ;
+            if (keys)
+                keys[*n] = c->s1;
+            q = c->s2;
         }
         else
-        {
-            errors++;
-        }
+            break;
+        (*n)++;
     }
-    yaz_tok_cfg_destroy(cfg);
-    return errors;
+    return q;
+}
+
+static int sort_key_apt(yaz_sparql_t s, WRBUF addinfo, Z_RPNStructure *q,
+                        struct sparql_sort_key *key)
+{
+    Z_AttributesPlusTerm *apt = q->u.simple->u.attributesPlusTerm;
+    Odr_int relation = lookup_attr_numeric(apt->attributes, 7);
+
+    if (relation != 1 && relation != 2)
+    {
+        if (addinfo)
+            wrbuf_printf(addinfo, ODR_INT_PRINTF, relation);
+        return YAZ_BIB1_ILLEGAL_SORT_RELATION;
+    }
+    key->descending = relation == 2;
+    key->priority = 0;
+    if (apt->term->which == Z_Term_numeric)
+        key->priority = *apt->term->u.numeric;
+    else if (apt->term->which == Z_Term_general)
+    {
+        char buf[32];
+        int len = apt->term->u.general->len;
+        if (len >= (int) sizeof(buf))
+            len = sizeof(buf) - 1;
+        memcpy(buf, apt->term->u.general->buf, len);
+        buf[len] = '\0';
+        key->priority = odr_strtol(buf, 0, 10);
+    }
+    return lookup_use(&s->sort_num, &s->sort_str, apt->attributes,
+                      YAZ_BIB1_CANNOT_SORT_ACCORDING_TO_SEQUENCE, addinfo,
+                      &key->e);
+}
+
+static int sort_key_spec(yaz_sparql_t s, WRBUF addinfo, Z_SortKeySpec *spec,
+                         struct sparql_sort_key *key)
+{
+    Z_SortKey *sk = spec->sortElement->which == Z_SortElement_generic ?
+        spec->sortElement->u.generic : 0;
+
+    switch (*spec->sortRelation)
+    {
+    case Z_SortKeySpec_ascending:
+    case Z_SortKeySpec_descending:
+        key->descending = *spec->sortRelation == Z_SortKeySpec_descending;
+        break;
+    default:
+        if (addinfo)
+            wrbuf_printf(addinfo, ODR_INT_PRINTF, *spec->sortRelation);
+        return YAZ_BIB1_ILLEGAL_SORT_RELATION;
+    }
+    key->priority = 0;
+    if (sk && sk->which == Z_SortKey_sortAttributes)
+        return lookup_use(&s->sort_num, &s->sort_str,
+                          sk->u.sortAttributes->list,
+                          YAZ_BIB1_CANNOT_SORT_ACCORDING_TO_SEQUENCE,
+                          addinfo, &key->e);
+    if (sk && sk->which == Z_SortKey_sortField)
+    {
+        key->e = hash_lookup_str(&s->sort_str, sk->u.sortField);
+        if (key->e)
+            return 0;
+        if (addinfo)
+            wrbuf_puts(addinfo, sk->u.sortField);
+    }
+    return YAZ_BIB1_CANNOT_SORT_ACCORDING_TO_SEQUENCE;
+}
+
+/* sort keys of spec, else those of the query, in order of priority;
+   *qp is set to the query without its sort keys */
+static int sort_keys(yaz_sparql_t s, NMEM nmem, WRBUF addinfo,
+                     Z_RPNStructure **qp,
+                     Z_SortKeySpecList *spec,
+                     struct sparql_sort_key **keysp, int *np)
+{
+    Z_RPNStructure **apts;
+    struct sparql_sort_key *keys;
+    int i, j, r = 0, n = 0;
+
+    sort_strip(*qp, 0, &n);
+    apts = (Z_RPNStructure **) nmem_malloc(nmem, (n + 1) * sizeof(*apts));
+    n = 0;
+    *qp = sort_strip(*qp, apts, &n);
+    if (spec && spec->num_specs)
+        n = spec->num_specs;
+    keys = (struct sparql_sort_key *)
+        nmem_malloc(nmem, (n + 1) * sizeof(*keys));
+    for (i = 0; !r && i < n; i++)
+    {
+        struct sparql_sort_key key;
+        if (spec && spec->num_specs)
+            r = sort_key_spec(s, addinfo, spec->specs[i], &key);
+        else
+            r = sort_key_apt(s, addinfo, apts[n - 1 - i], &key);
+        for (j = i; j > 0 && keys[j - 1].priority > key.priority; j--)
+            keys[j] = keys[j - 1];
+        keys[j] = key;
+    }
+    if (r)
+    {
+        keys = 0;
+        n = 0;
+    }
+    *keysp = keys;
+    *np = n;
+    return r;
 }
 
 struct sparql_entry *lookup_schema(yaz_sparql_t s, const char *schema)
 {
+    if (!schema)
+        return s->schema;
+    return hash_lookup_str(&s->schema_str, schema);
+}
+
+void yaz_sparql_observe_hits(yaz_sparql_t s, Z_RPNQuery *q, Odr_int hits)
+{
+    int keys = 0;
+    Z_RPNStructure *rs = sort_strip(q->RPNStructure, 0, &keys);
     struct sparql_entry *e;
+    struct sparql_hash_node *n;
+
+    if (rs->which != Z_RPNStructure_simple ||
+        rs->u.simple->which != Z_Operand_APT ||
+        lookup_index(s, rs->u.simple->u.attributesPlusTerm->attributes,
+                     0, &e))
+        return;
+    n = hash_find(&s->learned, e->index, 0);
+    if (n)
+        n->num = (3 * n->num + hits) / 4;
+    else
+        hash_add(s->nmem, &s->learned, e->index, hits, 0);
+}
 
-    for (e = s->conf; e; e = e->next)
+void yaz_sparql_copy_learned(yaz_sparql_t s, yaz_sparql_t from)
+{
+    unsigned i;
+
+    for (i = 0; i < from->learned.size; i++)
     {
-        if (!strncmp(e->pattern, "present.", 8))
-        {
-            if (!schema || !strcmp(e->pattern + 8, schema))
-                break;
-        }
-        if (!strncmp(e->pattern, "uri.", 4))
-        {
-            if (!schema || !strcmp(e->pattern + 4, schema))
-                break;
-        }
+        struct sparql_hash_node *n = from->learned.buckets[i];
+        for (; n; n = n->next)
+            if (!hash_find(&s->learned, n->key, 0))
+                hash_add(s->nmem, &s->learned, nmem_strdup(s->nmem, n->key),
+                         n->num, 0);
     }
-    return e;
 }
 
 int yaz_sparql_lookup_schema(yaz_sparql_t s, const char *schema)
@@ -429,27 +2042,27 @@ int yaz_sparql_from_uri_stream(yaz_sparql_t s,
                                void *client_data,
                                const char *uri, const char *schema)
 {
-    int r = 0, errors = emit_prefixes(s, addinfo, pr, client_data);
+    int r = 0, errors = s->errors;
     struct sparql_entry *e = lookup_schema(s, schema);
+
+    pr(wrbuf_buf(s->prefix_buf), client_data);
     if (!e)
         errors++;
     if (!errors)
     {
         WRBUF res = wrbuf_alloc();
-        WRBUF vars = wrbuf_alloc();
         int var_no = 0;
         Z_Term term;
 
         term.which = Z_Term_characterString;
         term.u.characterString = (char *) uri;
-        r = z_term(s, addinfo, res, vars, e, 0, &term, 0, &var_no);
+        r = z_term(s, res, 0, e, &term, var_no);
         if (!r)
         {
             pr(wrbuf_cstr(res), client_data);
             pr("\n", client_data);
         }
         wrbuf_destroy(res);
-        wrbuf_destroy(vars);
     }
     return errors ? -1 : r;
 }
@@ -461,99 +2074,112 @@ int yaz_sparql_from_rpn_stream(yaz_sparql_t s,
                                void *client_data,
                                Z_RPNQuery *q)
 {
-    int r = 0, errors = emit_prefixes(s, addinfo, pr, client_data);
-    struct sparql_entry *e;
+    return yaz_sparql_from_rpn_sort_stream(s, addinfo, pr, client_data,
+                                           q, 0, 0);
+}
 
-    for (e = s->conf; e; e = e->next)
-    {
-        if (!strcmp(e->pattern, "form"))
-        {
-            pr(e->value, client_data);
-            pr("\n", client_data);
-        }
-    }
-    pr("WHERE {\n", client_data);
-    for (e = s->conf; e; e = e->next)
-    {
-        if (!strcmp(e->pattern, "criteria"))
-        {
-            pr("  ", client_data);
-            pr(e->value, client_data);
-            pr(" .\n", client_data);
-        }
-    }
+int yaz_sparql_from_rpn_sort_stream(yaz_sparql_t s,
+                                    WRBUF addinfo,
+                                    void (*pr)(const char *buf,
+                                               void *client_data),
+                                    void *client_data,
+                                    Z_RPNQuery *q,
+                                    Z_SortKeySpecList *sort,
+                                    int *downgraded)
+{
+    int r = 0, errors = s->errors, downgrade = 0, ordered = 0;
+
+    pr(wrbuf_buf(s->prologue), client_data);
     if (!errors)
     {
+        /* temporaries of the translation; freed at once */
+        NMEM nmem = nmem_create();
         WRBUF res = wrbuf_alloc();
-        WRBUF vars = wrbuf_alloc();
-        int var_no = 0;
-        r = rpn_structure(s, addinfo, res, vars, q->RPNStructure, 0, &var_no);
+        int words = SPARQL_VAR_WORDS(s->num_vars);
+        unsigned *bound = (unsigned *)
+            nmem_malloc(nmem, (words + 1) * sizeof(*bound));
+        int i, n, var_no = 0;
+        struct sparql_sort_key *keys;
+        Z_RPNStructure *rpn = q->RPNStructure;
+        struct sparql_node *tree = 0;
+
+        memset(bound, 0, words * sizeof(*bound));
+        r = sort_keys(s, nmem, addinfo, &rpn, sort, &keys, &n);
+        if (r == 0)
+            tree = rpn_resolve(s, nmem, rpn);
+        if (r == 0 && (s->limit_cost || s->limit_operands ||
+                       s->limit_depth || s->limit_unanchored ||
+                       s->log_level))
+            r = cost_check(s, addinfo, tree, &downgrade);
+        if (r == 0)
+            r = rpn_structure(s, nmem, addinfo, res, bound, tree, 0, &var_no);
         if (r == 0)
         {
-            WRBUF t_var = wrbuf_alloc();
-            for (e = s->conf; e; e = e->next)
+            struct sparql_ref *o;
+            int key_var = var_no;
+
+            for (o = s->optional; o; o = o->next)
+            {
+                int optional = 1;
+
+                if (o->opt_var >= 0 &&
+                    (bound[o->opt_var / SPARQL_VAR_BIT] &
+                     (1U << (o->opt_var % SPARQL_VAR_BIT))))
+                    optional = 0;
+                pr("  ", client_data);
+                if (optional)
+                    pr("OPTIONAL { ", client_data);
+                pr(o->e->value, client_data);
+                if (optional)
+                    pr(" }", client_data);
+                pr(" .\n", client_data);
+            }
+            pr(wrbuf_cstr(res), client_data);
+            if (n)
             {
-                if (!strcmp(e->pattern, "criteria.optional"))
+                /* sort values are optional: records without are kept */
+                wrbuf_rewind(res);
+                for (i = 0; i < n; i++)
                 {
-                    int optional = 1;
-                    size_t i = strlen(e->value), j;
-
-                    while (i > 0 && strchr(" \t\r\n\f", e->value[i-1]))
-                        --i;
-                    j = i;
-                    while (i > 0 && !strchr("$?", e->value[i-1]))
-                        --i;
-                    if (i > 0 && j > i)
-                    {
-                        wrbuf_rewind(t_var);
-                        wrbuf_write(t_var, e->value + i, j - i);
-                        wrbuf_puts(t_var, " ");
-                        if (strstr(wrbuf_cstr(vars), wrbuf_cstr(t_var)))
-                            optional = 0;
-                    }
-
-                    pr("  ", client_data);
-                    if (optional)
-                        pr("OPTIONAL { ", client_data);
-                    pr(e->value, client_data);
-                    if (optional)
-                        pr(" }", client_data);
-                    pr(" .\n", client_data);
+                    wrbuf_puts(res, " .\n  OPTIONAL { ");
+                    z_term(s, res, 0, keys[i].e, 0, key_var + i);
+                    wrbuf_puts(res, " }");
                 }
+                pr(wrbuf_cstr(res), client_data);
             }
-            pr(wrbuf_cstr(res), client_data);
-            wrbuf_destroy(t_var);
-        }
-        wrbuf_destroy(res);
-        wrbuf_destroy(vars);
-    }
-    pr("\n}\n", client_data);
+            if (n || downgrade)
+            {
+                char *order;
 
-    for (e = s->conf; e; e = e->next)
-    {
-        if (!strcmp(e->pattern, "modifier"))
-        {
-            pr(e->value, client_data);
-            pr("\n", client_data);
+                wrbuf_rewind(res);
+                for (i = 0; i < n; i++)
+                    wrbuf_printf(res, " %s(?v%d)",
+                                 keys[i].descending ? "DESC" : "ASC",
+                                 key_var + i);
+                order = nmem_strdup(nmem, wrbuf_cstr(res));
+                wrbuf_rewind(res);
+                render_order(res, s, order, downgrade);
+                pr(wrbuf_cstr(res), client_data);
+                ordered = 1;
+            }
         }
+        wrbuf_destroy(res);
+        nmem_destroy(nmem);
     }
+    if (!ordered)
+        pr(wrbuf_buf(s->epilogue), client_data);
+    if (downgraded)
+        *downgraded = downgrade;
     return errors ? -1 : r;
 }
 
-void yaz_sparql_explain_indexes( yaz_sparql_t s, WRBUF w, int indent)
+/* index entries of conf and its includes, checked against lookups of s */
+static void explain_entries(yaz_sparql_t s, struct sparql_entry *conf,
+                            WRBUF w, const char *indentspace)
 {
-    char indentspace[200]; // must be enough
-    assert(indent<200);
-    int i;
-    for (i=0; i < indent; i++)
-        indentspace[i] = ' ';
-    indentspace[indent] = '\0';
-
     struct sparql_entry *e;
-    wrbuf_puts(w,indentspace);
-    wrbuf_puts(w,"<indexInfo>\n");
 
-    for (e = s->conf; e; e = e->next)
+    for (e = conf; e; e = e->next)
     {
         /*
         wrbuf_puts(w,"    <FOO>");
@@ -562,22 +2188,45 @@ void yaz_sparql_explain_indexes( yaz_sparql_t s, WRBUF w, int indent)
         wrbuf_xmlputs(w, e->value );
         wrbuf_puts(w,"    </FOO>\n");
         */
-        if ( strncmp(e->pattern, "index.", 6 ) == 0 )
+        if (e->include)
+            explain_entries(s, e->include->conf, w, indentspace);
+        else if ( strncmp(e->pattern, "index.", 6 ) == 0 )
         {
+            struct sparql_entry *b = hash_lookup_str(&s->index_str, e->index);
+            /* variants are listed once, only if there is no base entry;
+               copies of a variant share its pattern */
+            if (strchr(e->pattern + 6, ';') &&
+                !(b && !b->prog && b->kind_next &&
+                  b->kind_next->pattern == e->pattern))
+                continue;
             wrbuf_puts(w,indentspace);
             wrbuf_puts(w,"  <index>\n");
             wrbuf_puts(w,indentspace);
             wrbuf_puts(w,"    <title>");
-            wrbuf_xmlputs(w, e->pattern + 6);
+            wrbuf_xmlputs(w, e->index);
             wrbuf_puts(w,"</title>\n");
             wrbuf_puts(w,indentspace);
             wrbuf_puts(w,"    <map><name>");
-            wrbuf_xmlputs(w, e->pattern + 6);
+            wrbuf_xmlputs(w, e->index);
             wrbuf_puts(w,"</name></map>\n");
             wrbuf_puts(w,indentspace);
             wrbuf_puts(w,"  </index>\n");
         }
     }
+}
+
+void yaz_sparql_explain_indexes( yaz_sparql_t s, WRBUF w, int indent)
+{
+    char indentspace[200]; // must be enough
+    assert(indent<200);
+    int i;
+    for (i=0; i < indent; i++)
+        indentspace[i] = ' ';
+    indentspace[indent] = '\0';
+
+    wrbuf_puts(w,indentspace);
+    wrbuf_puts(w,"<indexInfo>\n");
+    explain_entries(s, s->conf, w, indentspace);
     wrbuf_puts(w,indentspace);
     wrbuf_puts(w,"</indexInfo>\n");
 }
@@ -31,6 +31,25 @@ YAZ_EXPORT
 int yaz_sparql_from_rpn_wrbuf(yaz_sparql_t s, WRBUF addinfo, WRBUF w,
                               Z_RPNQuery *q);
 
+/* like yaz_sparql_from_rpn_stream; ordered by sort if given and
+   non-empty, else by sort keys (attribute type 7) in q. If downgraded
+   is given, *downgraded is set to 1 if q is over the cost limit and
+   limited to the rows of limit.downgrade, else to 0 */
+YAZ_EXPORT
+int yaz_sparql_from_rpn_sort_stream(yaz_sparql_t s,
+                                    WRBUF addinfo,
+                                    void (*pr)(const char *buf,
+                                               void *client_data),
+                                    void *client_data,
+                                    Z_RPNQuery *q,
+                                    Z_SortKeySpecList *sort,
+                                    int *downgraded);
+
+YAZ_EXPORT
+int yaz_sparql_from_rpn_sort_wrbuf(yaz_sparql_t s, WRBUF addinfo, WRBUF w,
+                                   Z_RPNQuery *q, Z_SortKeySpecList *sort,
+                                   int *downgraded);
+
 
 YAZ_EXPORT
 int yaz_sparql_from_uri_stream(yaz_sparql_t s,
@@ -46,8 +65,24 @@ int yaz_sparql_from_uri_wrbuf(yaz_sparql_t s, WRBUF addinfo, WRBUF w,
 YAZ_EXPORT
 int yaz_sparql_lookup_schema(yaz_sparql_t s, const char *schema);
 
+/* records hits for a single-term query; used to order AND operands.
+   Must not run concurrently with other calls on s. Translations only
+   read s, so they may run concurrently with each other */
+YAZ_EXPORT
+void yaz_sparql_observe_hits(yaz_sparql_t s, Z_RPNQuery *q, Odr_int hits);
+
+/* takes over the hits observed by from, for indexes not observed by s;
+   so that a new configuration starts with what the old one learned.
+   Must not run concurrently with other calls on s or with
+   yaz_sparql_observe_hits on from */
+YAZ_EXPORT
+void yaz_sparql_copy_learned(yaz_sparql_t s, yaz_sparql_t from);
+
+/* makes the configuration of u part of s. Entries of u are referenced,
+   not copied: u must not be changed afterwards and must outlive s.
+   Returns 0 on success; -1 if u is s or includes s */
 YAZ_EXPORT
-void yaz_sparql_include(yaz_sparql_t s, yaz_sparql_t u);
+int yaz_sparql_include(yaz_sparql_t s, yaz_sparql_t u);
 
 YAZ_EXPORT
 void yaz_sparql_explain_indexes( yaz_sparql_t s, WRBUF w, int indent);
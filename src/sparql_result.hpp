@@ -0,0 +1,46 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// Solutions of a backend response
+#ifndef SPARQL_RESULT_HPP
+#define SPARQL_RESULT_HPP
+
+#include <libxml/tree.h>
+#include <yaz/odr.h>
+
+namespace metaproxy_1 {
+    namespace filter {
+        // Solution pos (from 0) of a SPARQL XML or RDF/XML doc is copied
+        // to a new *ndoc, unless ndoc is 0; the wrapping elements are
+        // kept. If there is no such solution, false is returned and *sz,
+        // unless sz is 0, is set to the number of solutions. Takes time
+        // linear in pos.
+        bool get_result(xmlDoc *doc, Odr_int *sz, Odr_int pos,
+                        xmlDoc **ndoc);
+    }
+}
+
+#endif
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
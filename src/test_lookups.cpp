@@ -0,0 +1,269 @@
+/* This file is part of Metaproxy.
+   Copyright (C) Index Data
+
+Metaproxy is free software; you can redistribute it and/or modify it under
+the terms of the GNU General Public License as published by the Free
+Software Foundation; either version 2, or (at your option) any later
+version.
+
+Metaproxy is distributed in the hope that it will be useful, but WITHOUT ANY
+WARRANTY; without even the implied warranty of MERCHANTABILITY or
+FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program; if not, write to the Free Software
+Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+// A present with URI lookups, run through the sparql filter in front of
+// a stub backend. The backend answers the search with a list of URIs and
+// each lookup with its own query, after a delay, so that lookups may
+// overlap. Checks that the records come back in order, that no two
+// lookups in flight shared a session, and that the sessions of the extra
+// lanes were closed: with the default concurrency, lookups run one at a
+// time in the session of the client; with concurrency 4, up to 4 at once.
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <map>
+#include <string>
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <libxml/parser.h>
+#include <libxml/tree.h>
+#include <metaproxy/package.hpp>
+#include <metaproxy/router_chain.hpp>
+#include <metaproxy/util.hpp>
+#include <yaz/pquery.h>
+#include <yaz/srw.h>
+#include <yaz/test.h>
+
+namespace mp = metaproxy_1;
+
+extern "C" {
+    extern struct metaproxy_1_filter_struct metaproxy_1_filter_sparql;
+}
+
+#define RECORDS 10
+
+// the filter element, after its defaults
+static const char *config_db =
+    " <db path=\"work\" schema=\"sparql-results\">\n"
+    "  <prefix>bf: http://bibframe.org/vocab/</prefix>\n"
+    "  <form>SELECT ?work</form>\n"
+    "  <criteria>?work a bf:Work</criteria>\n"
+    "  <index type=\"4\">?work bf:title %s</index>\n"
+    "  <present type=\"full\">CONSTRUCT { %u ?p ?o } "
+    "WHERE { %u ?p ?o }</present>\n"
+    " </db>\n"
+    "</filter>\n";
+
+class Backend : public mp::filter::Base {
+public:
+    Backend() : m_in_flight(0), m_max_in_flight(0), m_shared(0),
+                m_closed(0) {}
+    void process(mp::Package &package) const;
+    mutable boost::mutex m_mutex;
+    mutable std::map<unsigned long,int> m_sessions; // in flight
+    mutable int m_in_flight;
+    mutable int m_max_in_flight;
+    mutable int m_shared; // lookups begun while their session was busy
+    mutable int m_closed; // sessions closed
+};
+
+// search: RECORDS URIs; lookup: the query, as a record
+void Backend::process(mp::Package &package) const
+{
+    Z_GDU *gdu = package.request().get();
+
+    if (!gdu)
+    {
+        if (package.session().is_closed())
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_closed++;
+        }
+        return;
+    }
+    if (gdu->which != Z_GDU_HTTP_Request)
+        return;
+    Z_HTTP_Request *req = gdu->u.HTTP_Request;
+    mp::odr odr;
+    char **names, **values;
+    std::string path(req->content_buf, req->content_len);
+    yaz_uri_to_array(path.c_str(), odr, &names, &values);
+    const char *query = names[0] ? values[0] : "";
+    mp::wrbuf w;
+    if (!strstr(query, "CONSTRUCT"))
+    {
+        int i;
+        wrbuf_puts(w, "<sparql xmlns=\"http://www.w3.org/2005/"
+                   "sparql-results#\"><results>");
+        for (i = 0; i < RECORDS; i++)
+            wrbuf_printf(w, "<result><binding name=\"work\">"
+                         "<uri>http://example.org/thing/%d</uri>"
+                         "</binding></result>", i);
+        wrbuf_puts(w, "</results></sparql>");
+    }
+    else
+    {
+        unsigned long id = package.session().id();
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            if (m_sessions[id]++)
+                m_shared++;
+            if (++m_in_flight > m_max_in_flight)
+                m_max_in_flight = m_in_flight;
+        }
+        usleep(20000);
+        {
+            boost::mutex::scoped_lock lock(m_mutex);
+            m_sessions[id]--;
+            m_in_flight--;
+        }
+        wrbuf_puts(w, "<record>");
+        wrbuf_xmlputs(w, query);
+        wrbuf_puts(w, "</record>");
+    }
+    Z_GDU *gdu_res = odr.create_HTTP_Response(package.session(), req, 200);
+    Z_HTTP_Response *resp = gdu_res->u.HTTP_Response;
+    resp->content_len = w.len();
+    resp->content_buf = odr_strdup(odr, w.c_str());
+    package.response() = gdu_res;
+}
+
+static Z_APDU *search_request(ODR odr)
+{
+    Z_APDU *apdu = zget_APDU(odr, Z_APDU_searchRequest);
+    Z_SearchRequest *req = apdu->u.searchRequest;
+    YAZ_PQF_Parser parser = yaz_pqf_create();
+    Z_Query *query = (Z_Query *) odr_malloc(odr, sizeof(*query));
+
+    query->which = Z_Query_type_1;
+    query->u.type_1 = yaz_pqf_parse(parser, odr, "@attr 1=4 x");
+    yaz_pqf_destroy(parser);
+    req->query = query;
+    req->num_databaseNames = 1;
+    req->databaseNames = (char **) odr_malloc(odr, sizeof(char *));
+    req->databaseNames[0] = odr_strdup(odr, "work");
+    return apdu;
+}
+
+static Z_APDU *present_request(ODR odr)
+{
+    Z_APDU *apdu = zget_APDU(odr, Z_APDU_presentRequest);
+    Z_PresentRequest *req = apdu->u.presentRequest;
+    Z_RecordComposition *comp =
+        (Z_RecordComposition *) odr_malloc(odr, sizeof(*comp));
+    Z_ElementSetNames *esn =
+        (Z_ElementSetNames *) odr_malloc(odr, sizeof(*esn));
+
+    esn->which = Z_ElementSetNames_generic;
+    esn->u.generic = odr_strdup(odr, "full");
+    comp->which = Z_RecordComp_simple;
+    comp->u.simple = esn;
+    req->recordComposition = comp;
+    *req->resultSetStartPoint = 1;
+    *req->numberOfRecordsRequested = RECORDS;
+    return apdu;
+}
+
+// search and present of RECORDS, with concurrency given in defaults
+// (0: not given, so the default of 1)
+static void tst_present(int concurrency)
+{
+    std::string config =
+        "<filter type=\"sparql\" xmlns=\"http://indexdata.com/metaproxy\">\n"
+        " <defaults uri=\"http://localhost/sparql/\"";
+    char attr[40];
+
+    if (concurrency)
+    {
+        sprintf(attr, " concurrency=\"%d\"", concurrency);
+        config += attr;
+    }
+    else
+        concurrency = 1;
+    config += "/>\n";
+    config += config_db;
+    xmlDoc *doc = xmlParseMemory(config.c_str(), config.length());
+    boost::scoped_ptr<mp::filter::Base> sparql(
+        metaproxy_1_filter_sparql.creator());
+    Backend backend;
+    mp::RouterChain router;
+    mp::Session session;
+    mp::Origin origin;
+    mp::odr odr;
+    int i;
+
+    YAZ_CHECK(doc);
+    sparql->configure(xmlDocGetRootElement(doc), false, ".");
+    router.append(*sparql);
+    router.append(backend);
+    {
+        mp::Package package(session, origin);
+        package.router(router);
+        package.request() = search_request(odr);
+        package.move();
+        Z_GDU *gdu = package.response().get();
+        YAZ_CHECK(gdu && gdu->which == Z_GDU_Z3950 &&
+                  gdu->u.z3950->which == Z_APDU_searchResponse &&
+                  *gdu->u.z3950->u.searchResponse->resultCount == RECORDS);
+    }
+    {
+        mp::Package package(session, origin);
+        package.router(router);
+        package.request() = present_request(odr);
+        package.move();
+        Z_GDU *gdu = package.response().get();
+        YAZ_CHECK(gdu && gdu->which == Z_GDU_Z3950 &&
+                  gdu->u.z3950->which == Z_APDU_presentResponse);
+        Z_PresentResponse *res = gdu->u.z3950->u.presentResponse;
+        YAZ_CHECK(res->records && res->records->which == Z_Records_DBOSD);
+        Z_NamePlusRecordList *list = res->records->u.databaseOrSurDiagnostics;
+        YAZ_CHECK_EQ(list->num_records, RECORDS);
+        for (i = 0; i < list->num_records; i++)
+        {
+            Z_External *ext = list->records[i]->u.databaseRecord;
+            char uri[80];
+            sprintf(uri, "&lt;http://example.org/thing/%d&gt;", i);
+            YAZ_CHECK(ext->which == Z_External_octet);
+            std::string rec((const char *) ext->u.octet_aligned->buf,
+                            ext->u.octet_aligned->len);
+            YAZ_CHECK(rec.find(uri) != std::string::npos);
+        }
+    }
+    if (concurrency > 1)
+        YAZ_CHECK(backend.m_max_in_flight > 1);
+    YAZ_CHECK(backend.m_max_in_flight <= concurrency);
+    YAZ_CHECK_EQ(backend.m_shared, 0);
+    YAZ_CHECK_EQ(backend.m_closed, concurrency - 1);
+
+    {
+        mp::Package package(session, origin);
+        package.session().close();
+        package.router(router);
+        package.move();
+    }
+    sparql.reset();
+    xmlFreeDoc(doc);
+}
+
+int main(int argc, char **argv)
+{
+    YAZ_CHECK_INIT(argc, argv);
+    YAZ_CHECK_LOG();
+    tst_present(0);
+    tst_present(4);
+    YAZ_CHECK_TERM;
+}
+/*
+ * Local variables:
+ * c-basic-offset: 4
+ * c-file-style: "Stroustrup"
+ * indent-tabs-mode: nil
+ * End:
+ * vim: shiftwidth=4 tabstop=8 expandtab
+ */
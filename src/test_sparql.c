@@ -11,6 +11,7 @@
 #include <yaz/log.h>
 #include <yaz/test.h>
 #include <yaz/pquery.h>
+#include <yaz/sortspec.h>
 
 static int test_query(yaz_sparql_t s, const char *pqf, const char *expect)
 {
@@ -263,16 +264,12 @@ static void tst1(void)
                   "  ?inst bf:instanceTitle/bf:titleValue ?ititle .\n"
                   "  OPTIONAL { ?inst bf:heldBy ?lib } .\n"
                   "  {\n"
-                  "   {\n"
-                  "    ?work bf:creator/bf:label ?o2 "
+                  "   ?work bf:creator/bf:label ?o2 "
                   "FILTER(contains(?o2, \"a\"))\n"
-                  "   } UNION {\n"
-                  "    ?work bf:workTitle/bf:titleValue ?o1 "
-                  "FILTER(contains(?o1, \"b\"))\n"
-                  "   }\n"
                   "  } UNION {\n"
+                  "   VALUES ?v2 { \"b\" \"c\" }\n"
                   "   ?work bf:workTitle/bf:titleValue ?o1 "
-                  "FILTER(contains(?o1, \"c\"))\n"
+                  "FILTER(contains(?o1, ?v2))\n"
                   "  }\n"
                   "}\n"
                   ));
@@ -482,12 +479,932 @@ static void tst2(void)
     yaz_sparql_destroy(s);
 }
 
+static void tst3(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+
+    yaz_sparql_add_pattern(s, "prefix", "bf: http://bibframe.org/vocab/");
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "criteria", "?work a bf:Work");
+    yaz_sparql_add_pattern(s, "index.4", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "index.1003", "?work bf:creator %s");
+    yaz_sparql_add_pattern(s, "index.any", "?work bf:label %s");
+    yaz_sparql_add_pattern(s, "index.bf.type", "?work a %t");
+    yaz_sparql_add_pattern(s, "index.bf.rate",
+                           "?work bf:rate %v FILTER(%v = \"%d%%\")");
+    /* first definition of an index wins */
+    yaz_sparql_add_pattern(s, "index.4", "?work bf:other %s");
+
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=4 computer",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:title \"computer\"\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=1003 a @attr 1=4 b",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:creator \"a\" .\n"
+                  "  ?work bf:title \"b\"\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=1003 london",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:creator \"london\"\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "london",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:label \"london\"\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.type bf:Text @attr 1=bf.rate 50",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work a bf:Text .\n"
+                  "  ?work bf:rate ?v1 FILTER(?v1 = \"50%\")\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(s, "@attr 1=1016 london", 0));
+    YAZ_CHECK(test_query(s, "@attr 1=bf.title london", 0));
+
+    /* static query parts follow later additions */
+    yaz_sparql_add_pattern(s, "prefix", "rdf: http://www.w3.org/1999/02/22-rdf-syntax-ns");
+    yaz_sparql_add_pattern(s, "criteria", "?work bf:title ?title");
+    yaz_sparql_add_pattern(s, "modifier", "LIMIT 10");
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=4 computer",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "PREFIX rdf: <http://www.w3.org/1999/02/22-rdf-syntax-ns>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:title ?title .\n"
+                  "  ?work bf:title \"computer\"\n"
+                  "}\n"
+                  "LIMIT 10\n"));
+
+    /* optional is only required when the query binds its variable */
+    yaz_sparql_add_pattern(s, "criteria.optional", "?work bf:heldBy ?lib");
+    yaz_sparql_add_pattern(s, "index.bf.xlib", "?xlib bf:near %s");
+    yaz_sparql_add_pattern(s, "index.bf.lib", "?work bf:heldBy ?lib . "
+                           "?lib bf:label %s");
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.xlib x",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "PREFIX rdf: <http://www.w3.org/1999/02/22-rdf-syntax-ns>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:title ?title .\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?xlib bf:near \"x\"\n"
+                  "}\n"
+                  "LIMIT 10\n"));
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=4 y @attr 1=bf.lib x",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "PREFIX rdf: <http://www.w3.org/1999/02/22-rdf-syntax-ns>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:title ?title .\n"
+                  "  ?work bf:heldBy ?lib .\n"
+                  "  ?work bf:title \"y\" .\n"
+                  "  ?work bf:heldBy ?lib . ?lib bf:label \"x\"\n"
+                  "}\n"
+                  "LIMIT 10\n"));
+
+    /* ?lib in an IRI or a quoted string is no variable */
+    yaz_sparql_add_pattern(s, "index.bf.link", "?work bf:link "
+                           "<http://example.org/find?lib=1&x=%d> . "
+                           "?work bf:note \"?lib\"");
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.link 7",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "PREFIX rdf: <http://www.w3.org/1999/02/22-rdf-syntax-ns>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:title ?title .\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?work bf:link <http://example.org/find?lib=1&x=7> . "
+                  "?work bf:note \"?lib\"\n"
+                  "}\n"
+                  "LIMIT 10\n"));
+
+    /* a < before %s is an operator; ?lib after it is a variable */
+    yaz_sparql_add_pattern(s, "index.31", "FILTER(?y<%s) ?lib bf:label \"x\"");
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=31 1990",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "PREFIX rdf: <http://www.w3.org/1999/02/22-rdf-syntax-ns>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work a bf:Work .\n"
+                  "  ?work bf:title ?title .\n"
+                  "  ?work bf:heldBy ?lib .\n"
+                  "  FILTER(?y<\"1990\") ?lib bf:label \"x\"\n"
+                  "}\n"
+                  "LIMIT 10\n"));
+
+    yaz_sparql_destroy(s);
+}
+
+static void tst4(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+    YAZ_PQF_Parser parser = yaz_pqf_create();
+    ODR odr = odr_createmem(ODR_ENCODE);
+
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "index.bf.type", "?work a %t");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "index.bf.isbn", "?work bf:isbn %s");
+    yaz_sparql_add_pattern(s, "index.bf.note", "?work bf:note %s");
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "selectivity.bf.type", "1000000")
+              == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "selectivity.bf.isbn", "1") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "selectivity.bf.title", "x") != 0);
+
+    /* bf.isbn first, then bf.type; bf.title has no estimate */
+    YAZ_CHECK(test_query(
+                  s, "@and @and @attr 1=bf.title a @attr 1=bf.type b "
+                  "@attr 1=bf.isbn c",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:isbn \"c\" .\n"
+                  "  ?work a b .\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"));
+
+    /* observed hits take precedence */
+    yaz_sparql_observe_hits(s, yaz_pqf_parse(parser, odr,
+                                             "@attr 1=bf.title x"), 10);
+    yaz_sparql_observe_hits(s, yaz_pqf_parse(parser, odr,
+                                             "@attr 1=bf.isbn x"), 100);
+    yaz_sparql_observe_hits(s, yaz_pqf_parse(parser, odr,
+                                             "@attr 1=bf.isbn x"), 100);
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.note d @and @attr 1=bf.isbn c "
+                  "@or @attr 1=bf.title a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  VALUES ?v1 { \"a\" \"b\" }\n"
+                  "  ?work bf:title ?v1 .\n"
+                  "  ?work bf:isbn \"c\" .\n"
+                  "  ?work bf:note \"d\"\n"
+                  "}\n"));
+
+    odr_destroy(odr);
+    yaz_pqf_destroy(parser);
+    yaz_sparql_destroy(s);
+}
+
+static void tst5(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "index.bf.uri", "?work owl:sameAs %u");
+    yaz_sparql_add_pattern(s, "index.bf.isbn",
+                           "?work bf:isbn %v FILTER(%v = %s)");
+    yaz_sparql_add_pattern(s, "index.bf.type", "?work a %t");
+    yaz_sparql_add_pattern(s, "index.bf.mixed", "?work bf:id %s . ?x bf:id %u");
+
+    /* same index: one pattern with a VALUES block */
+    YAZ_CHECK(test_query(
+                  s, "@or @or @attr 1=bf.uri a @attr 1=bf.uri b "
+                  "@attr 1=bf.uri c",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  VALUES ?v1 { <a> <b> <c> }\n"
+                  "  ?work owl:sameAs ?v1\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "@or @attr 1=bf.isbn 1 @attr 1=bf.isbn 2",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  VALUES ?v1 { \"1\" \"2\" }\n"
+                  "  ?work bf:isbn ?v0 FILTER(?v0 = ?v1)\n"
+                  "}\n"));
+
+    /* verbatim and mixed terms can not be bound: flat UNION */
+    YAZ_CHECK(test_query(
+                  s, "@or @or @attr 1=bf.type a @attr 1=bf.type b "
+                  "@attr 1=bf.mixed c",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  {\n"
+                  "   ?work a a\n"
+                  "  } UNION {\n"
+                  "   ?work a b\n"
+                  "  } UNION {\n"
+                  "   ?work bf:id \"c\" . ?x bf:id <c>\n"
+                  "  }\n"
+                  "}\n"));
+
+    /* VALUES branch next to other branches, in order of first term */
+    YAZ_CHECK(test_query(
+                  s, "@or @or @or @attr 1=bf.isbn 1 "
+                  "@and @attr 1=bf.type t @attr 1=bf.uri u "
+                  "@attr 1=bf.uri v @attr 1=bf.isbn 2",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  {\n"
+                  "   VALUES ?v1 { \"1\" \"2\" }\n"
+                  "   ?work bf:isbn ?v0 FILTER(?v0 = ?v1)\n"
+                  "  } UNION {\n"
+                  "   ?work a t .\n"
+                  "   ?work owl:sameAs <u>\n"
+                  "  } UNION {\n"
+                  "   ?work owl:sameAs <v>\n"
+                  "  }\n"
+                  "}\n"));
+
+    YAZ_CHECK(test_query(s, "@or @attr 1=bf.uri a @attr 1=bf.none b", 0));
+    yaz_sparql_destroy(s);
+}
+
+static void tst6(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "criteria.optional", "?work bf:heldBy ?lib");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "index.bf.lib", "?lib bf:label %s");
+
+    YAZ_CHECK(test_query(
+                  s, "@not @attr 1=bf.title a @attr 1=bf.lib b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  FILTER NOT EXISTS {\n"
+                  "   ?lib bf:label \"b\"\n"
+                  "  }\n"
+                  "}\n"));
+
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "andnot", "none") != 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "andnot", "minus") == 0);
+    YAZ_CHECK(test_query(
+                  s, "@not @not @attr 1=bf.title a @attr 1=bf.title b "
+                  "@or @attr 1=bf.title c @attr 1=bf.title d",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  MINUS {\n"
+                  "   ?work bf:title \"b\"\n"
+                  "  } .\n"
+                  "  MINUS {\n"
+                  "   VALUES ?v3 { \"c\" \"d\" }\n"
+                  "   ?work bf:title ?v3\n"
+                  "  }\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "@not @attr 1=bf.title a @attr 1=bf.none b", 0));
+    yaz_sparql_destroy(s);
+}
+
+static void tst7(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+    WRBUF w = wrbuf_alloc();
+
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    /* variants before and after the base entry */
+    YAZ_CHECK(yaz_sparql_add_pattern(
+                  s, "index.bf.title;5=1",
+                  "?work bf:title %v . %v bif:contains '\"%t*\"'") == 0);
+    yaz_sparql_add_pattern(s, "index.bf.title",
+                           "?work bf:title %v FILTER(contains(%v, %s))");
+    YAZ_CHECK(yaz_sparql_add_pattern(
+                  s, "index.bf.title;2=3;5=1",
+                  "?work bf:title %v . %v bif:contains '\"%t*\"' "
+                  "FILTER(strstarts(%v, %s))") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(
+                  s, "index.31;2=4", "?work bf:date %v FILTER(%v >= %d)") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(
+                  s, "index.31;2=2", "?work bf:date %v FILTER(%v <= %d)") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "index.x;3=1", "") != 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "index.x;2=", "") != 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "index.x;2=1x", "") != 0);
+
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title ?v0 FILTER(contains(?v0, \"a\"))\n"
+                  "}\n"));
+    /* relation defaults to 3: both variants match, most specific wins */
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title @attr 5=1 a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title ?v0 . ?v0 bif:contains '\"a*\"' "
+                  "FILTER(strstarts(?v0, \"a\"))\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title @attr 2=102 @attr 5=1 a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title ?v0 . ?v0 bif:contains '\"a*\"'\n"
+                  "}\n"));
+    /* no match: base entry */
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title @attr 5=2 a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title ?v0 FILTER(contains(?v0, \"a\"))\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=31 @attr 2=4 2000 @attr 1=31 @attr 2=2 2010",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:date ?v0 FILTER(?v0 >= 2000) .\n"
+                  "  ?work bf:date ?v1 FILTER(?v1 <= 2010)\n"
+                  "}\n"));
+    /* variants only: no base to fall back on */
+    YAZ_CHECK(test_query(s, "@attr 1=31 2000", 0));
+    YAZ_CHECK(test_query(s, "@attr 1=31 @attr 2=5 2000", 0));
+
+    yaz_sparql_explain_indexes(s, w, 0);
+    YAZ_CHECK(!strcmp(wrbuf_cstr(w),
+                      "<indexInfo>\n"
+                      "  <index>\n"
+                      "    <title>bf.title</title>\n"
+                      "    <map><name>bf.title</name></map>\n"
+                      "  </index>\n"
+                      "  <index>\n"
+                      "    <title>31</title>\n"
+                      "    <map><name>31</name></map>\n"
+                      "  </index>\n"
+                      "</indexInfo>\n"));
+    wrbuf_destroy(w);
+    yaz_sparql_destroy(s);
+}
+
+static int test_sort(yaz_sparql_t s, const char *pqf, const char *spec,
+                     const char *expect)
+{
+    YAZ_PQF_Parser parser = yaz_pqf_create();
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_RPNQuery *rpn = yaz_pqf_parse(parser, odr, pqf);
+    Z_SortKeySpecList *sort = yaz_sort_spec(odr, spec);
+    WRBUF addinfo = wrbuf_alloc();
+    WRBUF w = wrbuf_alloc();
+    int ret = 0;
+
+    if (rpn && sort)
+    {
+        int r = yaz_sparql_from_rpn_sort_wrbuf(s, addinfo, w, rpn, sort, 0);
+        if (expect ? (!r && !strcmp(expect, wrbuf_cstr(w))) : r != 0)
+            ret = 1;
+        else
+        {
+            yaz_log(YLOG_WARN, "test_sparql: pqf=%s sort=%s", pqf, spec);
+            yaz_log(YLOG_WARN, " expect: %s", expect ? expect : "error");
+            yaz_log(YLOG_WARN, " got %d:%s %s", r, wrbuf_cstr(addinfo),
+                    wrbuf_cstr(w));
+        }
+    }
+    wrbuf_destroy(w);
+    wrbuf_destroy(addinfo);
+    odr_destroy(odr);
+    yaz_pqf_destroy(parser);
+    return ret;
+}
+
+static void tst8(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "modifier", "LIMIT 10");
+    yaz_sparql_add_pattern(s, "modifier", "GROUP BY ?work");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "sort.bf.title",
+                                     "?work bf:title %v") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "sort.30",
+                                     "?work bf:date %v") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "sort.bf.x",
+                                     "?work bf:x %s") != 0);
+
+    /* modifiers are put in the order the grammar requires */
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"
+                  "GROUP BY ?work\n"
+                  "LIMIT 10\n"));
+
+    /* sort keys in the query, ordered by their term */
+    YAZ_CHECK(test_query(
+                  s, "@or @or @attr 1=bf.title a "
+                  "@attr 7=2 @attr 1=30 1 @attr 7=1 @attr 1=bf.title 0",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  OPTIONAL { ?work bf:title ?v1 } .\n"
+                  "  OPTIONAL { ?work bf:date ?v2 }\n"
+                  "}\n"
+                  "GROUP BY ?work\n"
+                  "ORDER BY ASC(?v1) DESC(?v2)\n"
+                  "LIMIT 10\n"));
+    YAZ_CHECK(test_query(
+                  s, "@or @attr 1=bf.title a @attr 7=1 @attr 1=bf.none 0", 0));
+    YAZ_CHECK(test_query(
+                  s, "@or @attr 1=bf.title a @attr 7=3 @attr 1=30 0", 0));
+
+    /* sort specification takes precedence over sort keys in query */
+    YAZ_CHECK(test_sort(
+                  s, "@or @attr 1=bf.title a @attr 7=1 @attr 1=30 0",
+                  "1=30 d bf.title a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  OPTIONAL { ?work bf:date ?v1 } .\n"
+                  "  OPTIONAL { ?work bf:title ?v2 }\n"
+                  "}\n"
+                  "GROUP BY ?work\n"
+                  "ORDER BY DESC(?v1) ASC(?v2)\n"
+                  "LIMIT 10\n"));
+    YAZ_CHECK(test_sort(s, "@attr 1=bf.title a", "bf.none a", 0));
+    YAZ_CHECK(test_sort(s, "@attr 1=bf.title a", "1=31 a", 0));
+
+    /* a static ORDER BY gives secondary keys */
+    yaz_sparql_add_pattern(s, "modifier", "order by ?work");
+    YAZ_CHECK(test_sort(
+                  s, "@attr 1=bf.title a", "bf.title d",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  OPTIONAL { ?work bf:title ?v1 }\n"
+                  "}\n"
+                  "GROUP BY ?work\n"
+                  "ORDER BY DESC(?v1) ?work\n"
+                  "LIMIT 10\n"));
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"
+                  "GROUP BY ?work\n"
+                  "ORDER BY ?work\n"
+                  "LIMIT 10\n"));
+    yaz_sparql_destroy(s);
+}
+
+/* whether pqf is downgraded; -1 if it does not translate */
+static int test_downgraded(yaz_sparql_t s, const char *pqf)
+{
+    YAZ_PQF_Parser parser = yaz_pqf_create();
+    ODR odr = odr_createmem(ODR_ENCODE);
+    Z_RPNQuery *rpn = yaz_pqf_parse(parser, odr, pqf);
+    WRBUF w = wrbuf_alloc();
+    int downgraded = -1;
+
+    if (rpn && yaz_sparql_from_rpn_sort_wrbuf(s, 0, w, rpn, 0, &downgraded))
+        downgraded = -1;
+    wrbuf_destroy(w);
+    odr_destroy(odr);
+    yaz_pqf_destroy(parser);
+    return downgraded;
+}
+
+static void tst9(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "modifier", "LIMIT 1000");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "index.bf.note", "?work bf:note %s");
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "cost.bf.note", "5") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "cost.bf.note", "-1") != 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "limit.cost", "10") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "limit.operands", "4") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "limit.depth", "1") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "limit.unanchored", "1") == 0);
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "limit.other", "1") != 0);
+
+    /* 5 + 1 */
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.note a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:note \"a\" .\n"
+                  "  ?work bf:title \"b\"\n"
+                  "}\n"
+                  "LIMIT 1000\n"));
+    /* 2 * 5 + 2 * 1 */
+    YAZ_CHECK(test_query(
+                  s, "@or @attr 1=bf.note a @attr 1=bf.title b", 0));
+    /* 5 operands */
+    YAZ_CHECK(test_query(
+                  s, "@and @and @and @and @attr 1=bf.title a "
+                  "@attr 1=bf.title b @attr 1=bf.title c "
+                  "@attr 1=bf.title d @attr 1=bf.title e", 0));
+    /* an OR chain is one level; nested is two */
+    YAZ_CHECK(test_query(
+                  s, "@or @or @attr 1=bf.title a @attr 1=bf.title b "
+                  "@attr 1=bf.title c",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  VALUES ?v1 { \"a\" \"b\" \"c\" }\n"
+                  "  ?work bf:title ?v1\n"
+                  "}\n"
+                  "LIMIT 1000\n"));
+    YAZ_CHECK(test_query(
+                  s, "@or @attr 1=bf.title a @and @attr 1=bf.title b "
+                  "@or @attr 1=bf.title c @attr 1=bf.title d", 0));
+    /* 10 * 1 */
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title @attr 5=2 a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"
+                  "LIMIT 1000\n"));
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.title @attr 5=2 a "
+                  "@attr 1=bf.title @attr 5=3 b", 0));
+
+    /* over cost: run, but with fewer rows */
+    YAZ_CHECK(yaz_sparql_add_pattern(s, "limit.downgrade", "10") == 0);
+    YAZ_CHECK(test_query(
+                  s, "@or @attr 1=bf.note a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  {\n"
+                  "   ?work bf:note \"a\"\n"
+                  "  } UNION {\n"
+                  "   ?work bf:title \"b\"\n"
+                  "  }\n"
+                  "}\n"
+                  "LIMIT 10\n"));
+    yaz_sparql_destroy(s);
+
+    /* downgrade keeps a lower LIMIT and the OFFSET */
+    s = yaz_sparql_create();
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "modifier", "LIMIT 5");
+    yaz_sparql_add_pattern(s, "modifier", "OFFSET 20");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "limit.cost", "1");
+    yaz_sparql_add_pattern(s, "limit.downgrade", "10");
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.title a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  ?work bf:title \"b\"\n"
+                  "}\n"
+                  "LIMIT 5\n"
+                  "OFFSET 20\n"));
+    yaz_sparql_add_pattern(s, "limit.downgrade", "3");
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.title a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  ?work bf:title \"b\"\n"
+                  "}\n"
+                  "LIMIT 3\n"
+                  "OFFSET 20\n"));
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"
+                  "LIMIT 5\n"
+                  "OFFSET 20\n"));
+    yaz_sparql_destroy(s);
+
+    /* clauses of one modifier are filed apart */
+    s = yaz_sparql_create();
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "modifier", "LIMIT 50 OFFSET 20");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "limit.cost", "1");
+    yaz_sparql_add_pattern(s, "limit.downgrade", "10");
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"
+                  "LIMIT 50\n"
+                  "OFFSET 20\n"));
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.title a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  ?work bf:title \"b\"\n"
+                  "}\n"
+                  "LIMIT 10\n"
+                  "OFFSET 20\n"));
+    YAZ_CHECK_EQ(test_downgraded(s, "@attr 1=bf.title a"), 0);
+    YAZ_CHECK_EQ(test_downgraded(
+                     s, "@and @attr 1=bf.title a @attr 1=bf.title b"), 1);
+    yaz_sparql_destroy(s);
+
+    s = yaz_sparql_create();
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "modifier", "ORDER BY ?work LIMIT 50");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "limit.cost", "1");
+    yaz_sparql_add_pattern(s, "limit.downgrade", "10");
+    YAZ_CHECK(test_query(
+                  s, "@attr 1=bf.title a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"
+                  "ORDER BY ?work\n"
+                  "LIMIT 50\n"));
+    YAZ_CHECK(test_query(
+                  s, "@and @attr 1=bf.title a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  ?work bf:title \"b\"\n"
+                  "}\n"
+                  "ORDER BY ?work\n"
+                  "LIMIT 10\n"));
+    yaz_sparql_destroy(s);
+}
+
+static void tst10(void)
+{
+    yaz_sparql_t b = yaz_sparql_create();
+    yaz_sparql_t d1 = yaz_sparql_create();
+    yaz_sparql_t d2 = yaz_sparql_create();
+    yaz_sparql_t d3;
+    WRBUF w = wrbuf_alloc();
+
+    yaz_sparql_add_pattern(b, "prefix", "bf: http://bibframe.org/vocab/");
+    yaz_sparql_add_pattern(b, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(b, "criteria.optional", "?work bf:heldBy ?lib");
+    yaz_sparql_add_pattern(b, "index.bf.title",
+                           "?work bf:title %v FILTER(contains(%v, %s))");
+    yaz_sparql_add_pattern(b, "index.bf.title;5=1",
+                           "?work bf:title %v FILTER(strstarts(%v, %s))");
+    yaz_sparql_add_pattern(b, "index.bf.lib",
+                           "?lib bf:label %v FILTER(contains(%v, %s))");
+    yaz_sparql_add_pattern(b, "modifier", "LIMIT 5");
+
+    /* own variables first, so that numbers differ from those of b */
+    yaz_sparql_add_pattern(d1, "index.bf.note", "?x bf:note %s");
+    yaz_sparql_include(d1, b);
+    yaz_sparql_add_pattern(d1, "index.bf.title", "?work bf:other %s");
+    yaz_sparql_add_pattern(d1, "andnot", "minus");
+
+    /* variant given before the base of the include */
+    yaz_sparql_add_pattern(d2, "index.bf.date;2=4",
+                           "?work bf:date %v FILTER(%v >= %d)");
+    yaz_sparql_add_pattern(d2, "index.bf.date", "?work bf:date %s");
+    yaz_sparql_include(d2, b);
+    yaz_sparql_add_pattern(d2, "index.bf.title;2=4",
+                           "?work bf:title %v FILTER(%v >= %s)");
+
+    /* included definition came first */
+    YAZ_CHECK(test_query(
+                  d1, "@attr 1=bf.title a",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?work bf:title ?v0 FILTER(contains(?v0, \"a\"))\n"
+                  "}\n"
+                  "LIMIT 5\n"));
+    /* ?lib is bound by an included entry */
+    YAZ_CHECK(test_query(
+                  d1, "@attr 1=bf.lib a",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:heldBy ?lib .\n"
+                  "  ?lib bf:label ?v0 FILTER(contains(?v0, \"a\"))\n"
+                  "}\n"
+                  "LIMIT 5\n"));
+    YAZ_CHECK(test_query(
+                  d1, "@not @attr 1=bf.note a @attr 1=bf.title @attr 5=1 b",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?x bf:note \"a\" .\n"
+                  "  MINUS {\n"
+                  "   ?work bf:title ?v1 FILTER(strstarts(?v1, \"b\"))\n"
+                  "  }\n"
+                  "}\n"
+                  "LIMIT 5\n"));
+    /* variants of both layers; b itself is not changed */
+    YAZ_CHECK(test_query(
+                  d2, "@and @attr 1=bf.title @attr 2=4 a "
+                  "@attr 1=bf.title @attr 5=1 b",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?work bf:title ?v0 FILTER(?v0 >= \"a\") .\n"
+                  "  ?work bf:title ?v1 FILTER(strstarts(?v1, \"b\"))\n"
+                  "}\n"
+                  "LIMIT 5\n"));
+    YAZ_CHECK(test_query(
+                  b, "@attr 1=bf.title @attr 2=4 a",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?work bf:title ?v0 FILTER(contains(?v0, \"a\"))\n"
+                  "}\n"
+                  "LIMIT 5\n"));
+    YAZ_CHECK(test_query(
+                  d2, "@attr 1=bf.date @attr 2=4 2000",
+                  "PREFIX bf: <http://bibframe.org/vocab/>\n"
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  OPTIONAL { ?work bf:heldBy ?lib } .\n"
+                  "  ?work bf:date ?v0 FILTER(?v0 >= 2000)\n"
+                  "}\n"
+                  "LIMIT 5\n"));
+
+    yaz_sparql_explain_indexes(d1, w, 0);
+    YAZ_CHECK(!strcmp(wrbuf_cstr(w),
+                      "<indexInfo>\n"
+                      "  <index>\n"
+                      "    <title>bf.note</title>\n"
+                      "    <map><name>bf.note</name></map>\n"
+                      "  </index>\n"
+                      "  <index>\n"
+                      "    <title>bf.title</title>\n"
+                      "    <map><name>bf.title</name></map>\n"
+                      "  </index>\n"
+                      "  <index>\n"
+                      "    <title>bf.lib</title>\n"
+                      "    <map><name>bf.lib</name></map>\n"
+                      "  </index>\n"
+                      "  <index>\n"
+                      "    <title>bf.title</title>\n"
+                      "    <map><name>bf.title</name></map>\n"
+                      "  </index>\n"
+                      "</indexInfo>\n"));
+
+    /* no include of itself or of an including config */
+    YAZ_CHECK(yaz_sparql_include(b, b) == -1);
+    YAZ_CHECK(yaz_sparql_include(b, d1) == -1);
+
+    wrbuf_destroy(w);
+    yaz_sparql_destroy(d2);
+    yaz_sparql_destroy(d1);
+    yaz_sparql_destroy(b);
+
+    /* 04 and 4 are both use attribute 4: first declared wins, also
+       through an include */
+    b = yaz_sparql_create();
+    d1 = yaz_sparql_create();
+    d2 = yaz_sparql_create();
+    d3 = yaz_sparql_create();
+    yaz_sparql_add_pattern(b, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(b, "index.04", "?work bf:first %s");
+    yaz_sparql_add_pattern(b, "index.4", "?work bf:second %s");
+    yaz_sparql_add_pattern(d1, "index.4", "?work bf:first %s");
+    yaz_sparql_add_pattern(d1, "index.04", "?work bf:second %s");
+    YAZ_CHECK(yaz_sparql_include(d2, b) == 0);
+    YAZ_CHECK(yaz_sparql_include(d3, d1) == 0);
+    YAZ_CHECK(test_query(
+                  b, "@attr 1=4 a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:first \"a\"\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  d1, "@attr 1=4 a",
+                  "WHERE {\n"
+                  "  ?work bf:first \"a\"\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  d2, "@attr 1=4 a",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:first \"a\"\n"
+                  "}\n"));
+    YAZ_CHECK(test_query(
+                  d3, "@attr 1=4 a",
+                  "WHERE {\n"
+                  "  ?work bf:first \"a\"\n"
+                  "}\n"));
+    yaz_sparql_destroy(d3);
+    yaz_sparql_destroy(d2);
+    yaz_sparql_destroy(d1);
+    yaz_sparql_destroy(b);
+
+    /* a setting given before an include is kept, as indexes are */
+    b = yaz_sparql_create();
+    d1 = yaz_sparql_create();
+    d2 = yaz_sparql_create();
+    yaz_sparql_add_pattern(b, "index.4", "?work bf:title %s");
+    yaz_sparql_add_pattern(b, "limit.cost", "100");
+    yaz_sparql_add_pattern(d1, "limit.cost", "1");
+    YAZ_CHECK(yaz_sparql_include(d1, b) == 0);
+    YAZ_CHECK(yaz_sparql_include(d2, b) == 0);
+    YAZ_CHECK(test_query(d1, "@and @attr 1=4 a @attr 1=4 b", 0));
+    YAZ_CHECK(test_query(
+                  d2, "@and @attr 1=4 a @attr 1=4 b",
+                  "WHERE {\n"
+                  "  ?work bf:title \"a\" .\n"
+                  "  ?work bf:title \"b\"\n"
+                  "}\n"));
+    yaz_sparql_destroy(d2);
+    yaz_sparql_destroy(d1);
+    yaz_sparql_destroy(b);
+}
+
+/* learned hits survive a new configuration */
+static void tst11(void)
+{
+    yaz_sparql_t s = yaz_sparql_create();
+    yaz_sparql_t n = yaz_sparql_create();
+    YAZ_PQF_Parser parser = yaz_pqf_create();
+    ODR odr = odr_createmem(ODR_ENCODE);
+
+    yaz_sparql_add_pattern(s, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(s, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(s, "index.bf.isbn", "?work bf:isbn %s");
+    yaz_sparql_add_pattern(n, "form", "SELECT ?work");
+    yaz_sparql_add_pattern(n, "index.bf.title", "?work bf:title %s");
+    yaz_sparql_add_pattern(n, "index.bf.isbn", "?work bf:isbn %s");
+    yaz_sparql_add_pattern(n, "index.bf.note", "?work bf:note %s");
+
+    yaz_sparql_observe_hits(s, yaz_pqf_parse(parser, odr,
+                                             "@attr 1=bf.title x"), 1000);
+    yaz_sparql_observe_hits(s, yaz_pqf_parse(parser, odr,
+                                             "@attr 1=bf.isbn x"), 10);
+    yaz_sparql_observe_hits(n, yaz_pqf_parse(parser, odr,
+                                             "@attr 1=bf.title x"), 100);
+    yaz_sparql_copy_learned(n, s);
+    yaz_sparql_destroy(s);
+
+    /* bf.isbn took over the old observation */
+    YAZ_CHECK(test_query(
+                  n, "@and @attr 1=bf.title a @attr 1=bf.isbn b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:isbn \"b\" .\n"
+                  "  ?work bf:title \"a\"\n"
+                  "}\n"));
+    /* bf.title kept its own */
+    yaz_sparql_observe_hits(n, yaz_pqf_parse(parser, odr,
+                                             "@attr 1=bf.note x"), 500);
+    YAZ_CHECK(test_query(
+                  n, "@and @attr 1=bf.note a @attr 1=bf.title b",
+                  "SELECT ?work\n"
+                  "WHERE {\n"
+                  "  ?work bf:title \"b\" .\n"
+                  "  ?work bf:note \"a\"\n"
+                  "}\n"));
+
+    odr_destroy(odr);
+    yaz_pqf_destroy(parser);
+    yaz_sparql_destroy(n);
+}
+
 int main(int argc, char **argv)
 {
     YAZ_CHECK_INIT(argc, argv);
     YAZ_CHECK_LOG();
     tst1();
     tst2();
+    tst3();
+    tst4();
+    tst5();
+    tst6();
+    tst7();
+    tst8();
+    tst9();
+    tst10();
+    tst11();
     YAZ_CHECK_TERM;
 }
 /*